@@ -13,26 +13,48 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
+//
 // This tool reads from the standard input a list of ratings and creates
 // a dataset from that list of ratings. Each rating must be specified in
 // a different line, where the first two integers are the user ID and the
 // item ID respectively. The following real numbers in the line are the
 // scores for each criterion. It is assumed that all the ratings have the
 // same criteria size. It is also assumed that the user ID and item ID start
-// from 0. Each field must be separated using spaces.
-// Warning: The maximum line length is 1000 bytes.
+// from 0. Each field must be separated using spaces. Empty lines are ignored.
 // This tool is specially useful to convert, for instance, the MovieLens data
 // to the mcfs dataset format.
 //
+// The input is mapped into memory (or read, if it is not a regular file),
+// split at line boundaries and parsed by -threads workers, which write the
+// ratings directly into the dataset columns. Use -v 2 to log each rating.
+//
+// With -native, the dataset is written in the native binary format, which
+// can be memory-mapped by the rest of the tools. With -stream, the ratings
+// are parsed and written in blocks as they are read, using the chunked
+// format (see ratings-stream.h), so the input can be larger than the
+// available memory.
+//
 // Example: generate-binarize -minv "1 1" -maxv "5 5"
 //          -precision "INT INT" < human_data > mcfs_data
 
+#include <errno.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
-#include <stdio.h>
 #include <protos/ratings.pb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define MAX_LINE_SIZE 1000
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dataset.h>
+#include <ratings-stream.h>
 
 using mcfs::protos::Ratings;
 using mcfs::protos::Rating;
@@ -42,63 +64,269 @@ using mcfs::protos::Ratings_Precision_FLOAT;
 DEFINE_string(precision, "", "Precision of each criteria");
 DEFINE_string(minv, "", "Min. value in each criteria");
 DEFINE_string(maxv, "", "Max. value in each criteria");
+DEFINE_bool(native, false, "Output the dataset in the native binary format");
+DEFINE_bool(index, true, "Include the user/item indices in native files");
+DEFINE_bool(stream, false, "Output the dataset in the chunked format");
+DEFINE_uint64(threads, 0, "Number of parser threads (0 = number of CPUs)");
 
-int main(int argc, char ** argv) {
-  // Google tools initialization
-  google::InitGoogleLogging(argv[0]);
-  google::SetUsageMessage(
-      "This tool reads from the standard input a list of ratings and creates "
-      "a binary dataset from that list of ratings.\nUsage:" +
-      std::string(argv[0]) + " < plain_text_file > binary_dataset");
-  google::ParseCommandLineFlags(&argc, &argv, true);
+std::default_random_engine PRNG;
 
-  Ratings ratings_pb;
-  uint32_t criteria_size = 0;
-  char buffer[MAX_LINE_SIZE];
-  uint32_t max_user = 0;
-  uint32_t max_item = 0;
-  while (fgets(buffer, MAX_LINE_SIZE, stdin)) {
-    // Read user id
-    char* end_user = NULL;
-    uint32_t user = strtoul(buffer, &end_user, 10);
-    CHECK_NE(buffer, end_user);
-    max_user = std::max(user, max_user);
-    // Read item id
-    char* end_item = NULL;
-    uint32_t item = strtoul(end_user, &end_item, 10);
-    CHECK_NE(end_user, end_item);
-    max_item = std::max(item, max_item);
-    // Add new rating
-    Rating* rating = ratings_pb.add_rating();
-    rating->set_user(user);
-    rating->set_item(item);
-    LOG(INFO) << "New rating: User = " << user << ", Item = " << item;
-    // Read rating scores
-    char* end_score = NULL;
-    float score = strtof(end_item, &end_score);
-    CHECK_NE(end_item, end_score);
-    rating->add_score(score);
-    uint32_t criteria_size_item = 1;
-    LOG(INFO) << "Rating(" << user << "," << item
-              << "," << criteria_size_item-1 << ") = " << score;
-    do {
-      char* end_score2 = NULL;
-      score = strtof(end_score, &end_score2);
-      if (end_score2 == end_score) { break; }
-      end_score = end_score2;
-      rating->add_score(score);
-      ++criteria_size_item;
-      LOG(INFO) << "Rating(" << user << "," << item
-                << "," << criteria_size_item-1 << ") = " << score;
-    } while (1);
-    if (criteria_size == 0) {
-      criteria_size = criteria_size_item;
+// Size of the read buffer in stream mode, and minimum amount of input
+// parsed by each thread.
+static const size_t kBlockSize = 1 << 22;
+
+static const double kPow10[16] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15
+};
+
+// Ratings parsed by one worker.
+struct ParsedRatings {
+  ParsedRatings() : criteria_size(0), max_user(0), max_item(0) {}
+  std::vector<uint32_t> users;
+  std::vector<uint32_t> items;
+  std::vector<float> scores;
+  uint32_t criteria_size;
+  uint32_t max_user;
+  uint32_t max_item;
+};
+
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static inline const char* skip_blanks(const char* p, const char* end) {
+  while (p < end && is_blank(*p)) ++p;
+  return p;
+}
+
+// Parse an unsigned integer. Returns NULL if the field is not a valid ID.
+static inline const char* parse_uint(const char* p, const char* end,
+                                     uint32_t* v) {
+  uint64_t x = 0;
+  const char* q = p;
+  for (; q < end && is_digit(*q); ++q) {
+    x = x * 10 + (*q - '0');
+    if (x > UINT32_MAX) return NULL;
+  }
+  if (q == p || (q < end && !is_blank(*q))) return NULL;
+  *v = static_cast<uint32_t>(x);
+  return q;
+}
+
+// Parse a real number. Plain decimals (i.e. "4", "-0.25") are converted
+// directly, anything else (exponents, "inf", long mantissas...) is left to
+// strtof, using a local copy of the field. Returns NULL on error.
+static inline const char* parse_float(const char* p, const char* end,
+                                      float* v) {
+  const char* q = p;
+  const bool neg = q < end && *q == '-';
+  if (q < end && (*q == '-' || *q == '+')) ++q;
+  uint64_t mant = 0;
+  int digits = 0, frac = 0;
+  for (; q < end && is_digit(*q); ++q, ++digits) {
+    mant = mant * 10 + (*q - '0');
+  }
+  if (q < end && *q == '.') {
+    for (++q; q < end && is_digit(*q); ++q, ++digits, ++frac) {
+      mant = mant * 10 + (*q - '0');
     }
-    CHECK_EQ(criteria_size, criteria_size_item);
   }
-  ratings_pb.set_criteria_size(criteria_size);
-  ratings_pb.set_num_users(max_user + 1);
-  ratings_pb.set_num_items(max_item + 1);
+  if (digits > 0 && digits < 16 && (q == end || is_blank(*q))) {
+    const double x = static_cast<double>(mant) / kPow10[frac];
+    *v = static_cast<float>(neg ? -x : x);
+    return q;
+  }
+  char field[64];
+  for (q = p; q < end && !is_blank(*q); ++q) {}
+  const size_t n = q - p;
+  if (n == 0 || n >= sizeof(field)) return NULL;
+  memcpy(field, p, n);
+  field[n] = 0;
+  char* field_end = NULL;
+  *v = strtof(field, &field_end);
+  return field_end == field + n ? q : NULL;
+}
+
+// Parse the lines in [begin, end) and call f(user, item, scores) for each
+// rating. 'begin' must be the start of a line.
+template <typename F>
+static void parse_lines(const char* begin, const char* end, F f) {
+  std::vector<float> scores;
+  for (const char* line = begin; line < end; ) {
+    const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+    if (eol == NULL) eol = end;
+    const char* p = skip_blanks(line, eol);
+    if (p < eol) {
+      uint32_t user = 0, item = 0;
+      p = parse_uint(p, eol, &user);
+      CHECK(p != NULL) << "Bad user ID: " << std::string(line, eol);
+      p = parse_uint(skip_blanks(p, eol), eol, &item);
+      CHECK(p != NULL) << "Bad item ID: " << std::string(line, eol);
+      scores.clear();
+      for (p = skip_blanks(p, eol); p < eol; p = skip_blanks(p, eol)) {
+        float score = 0.0f;
+        p = parse_float(p, eol, &score);
+        CHECK(p != NULL) << "Bad score: " << std::string(line, eol);
+        scores.push_back(score);
+      }
+      CHECK(!scores.empty()) << "Missing scores: " << std::string(line, eol);
+      f(user, item, scores);
+    }
+    line = eol + 1;
+  }
+}
+
+// Parse the lines of fd as they are read, keeping only kBlockSize bytes
+// (or the longest line) in memory.
+template <typename F>
+static void parse_fd(int fd, F f) {
+  std::vector<char> buffer(kBlockSize);
+  size_t filled = 0;
+  while (true) {
+    if (filled == buffer.size()) {
+      buffer.resize(2 * buffer.size());
+    }
+    const ssize_t n = read(fd, buffer.data() + filled, buffer.size() - filled);
+    CHECK_GE(n, 0) << "Failed to read the input. Error: " << strerror(errno);
+    if (n == 0) {
+      parse_lines(buffer.data(), buffer.data() + filled, f);
+      return;
+    }
+    filled += n;
+    size_t done = filled;
+    while (done > 0 && buffer[done - 1] != '\n') --done;
+    parse_lines(buffer.data(), buffer.data() + done, f);
+    memmove(buffer.data(), buffer.data() + done, filled - done);
+    filled -= done;
+  }
+}
+
+// Append a parsed rating to the worker's columns.
+static void add_parsed_rating(ParsedRatings* out, uint32_t user,
+                              uint32_t item, const std::vector<float>& scores) {
+  if (out->criteria_size == 0) {
+    out->criteria_size = scores.size();
+  }
+  CHECK_EQ(out->criteria_size, scores.size())
+      << "Inconsistent criteria size for rating (" << user << ", " << item
+      << ")";
+  out->users.push_back(user);
+  out->items.push_back(item);
+  out->scores.insert(out->scores.end(), scores.begin(), scores.end());
+  out->max_user = std::max(out->max_user, user);
+  out->max_item = std::max(out->max_item, item);
+  VLOG(2) << "New rating: User = " << user << ", Item = " << item;
+}
+
+// Text read from the standard input. Regular files are mapped into memory,
+// anything else (i.e. a pipe) is read into a buffer.
+class InputText {
+ public:
+  explicit InputText(int fd) : data_(NULL), size_(0), mapped_(false) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(addr);
+        size_ = st.st_size;
+        mapped_ = true;
+        return;
+      }
+    }
+    size_t filled = 0;
+    buffer_.resize(kBlockSize);
+    ssize_t n = 0;
+    while ((n = read(fd, buffer_.data() + filled,
+                     buffer_.size() - filled)) > 0) {
+      filled += n;
+      if (filled == buffer_.size()) buffer_.resize(2 * buffer_.size());
+    }
+    CHECK_GE(n, 0) << "Failed to read the input. Error: " << strerror(errno);
+    data_ = buffer_.data();
+    size_ = filled;
+  }
+  ~InputText() {
+    if (mapped_) munmap(const_cast<char*>(data_), size_);
+  }
+  inline const char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+  std::vector<char> buffer_;
+};
+
+// Parse the whole input with the given number of threads. Each thread
+// parses a range of lines; the results are concatenated in input order.
+static void parse_parallel(const InputText& input, size_t threads,
+                           Ratings* header, std::vector<uint32_t>* users,
+                           std::vector<uint32_t>* items,
+                           std::vector<float>* scores) {
+  const char* begin = input.data();
+  const char* end = begin + input.size();
+  threads = std::max<size_t>(
+      1, std::min<size_t>(threads, input.size() / kBlockSize + 1));
+  // Split the input at line boundaries
+  std::vector<const char*> bounds(threads + 1, end);
+  bounds[0] = begin;
+  for (size_t t = 1; t < threads; ++t) {
+    const char* p = std::max(bounds[t - 1], begin + input.size() * t / threads);
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    bounds[t] = eol != NULL ? eol + 1 : end;
+  }
+  std::vector<ParsedRatings> parsed(threads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    ParsedRatings* out = &parsed[t];
+    const char* b = bounds[t];
+    const char* e = bounds[t + 1];
+    workers.push_back(std::thread([out, b, e]() {
+          parse_lines(b, e, [out](uint32_t user, uint32_t item,
+                                  const std::vector<float>& s) {
+                            add_parsed_rating(out, user, item, s);
+                          });
+        }));
+  }
+  for (std::thread& w : workers) w.join();
+  // Concatenate the columns parsed by each thread
+  uint32_t criteria_size = 0, max_user = 0, max_item = 0;
+  size_t num_ratings = 0;
+  for (const ParsedRatings& p : parsed) {
+    if (p.users.empty()) continue;
+    if (criteria_size == 0) criteria_size = p.criteria_size;
+    CHECK_EQ(criteria_size, p.criteria_size) << "Inconsistent criteria size";
+    max_user = std::max(max_user, p.max_user);
+    max_item = std::max(max_item, p.max_item);
+    num_ratings += p.users.size();
+  }
+  users->clear();
+  items->clear();
+  scores->clear();
+  users->reserve(num_ratings);
+  items->reserve(num_ratings);
+  scores->reserve(num_ratings * criteria_size);
+  for (ParsedRatings& p : parsed) {
+    users->insert(users->end(), p.users.begin(), p.users.end());
+    items->insert(items->end(), p.items.begin(), p.items.end());
+    scores->insert(scores->end(), p.scores.begin(), p.scores.end());
+    p = ParsedRatings();
+  }
+  header->set_criteria_size(criteria_size);
+  header->set_num_users(max_user + 1);
+  header->set_num_items(max_item + 1);
+}
+
+// Set the metadata given by -minv, -maxv and -precision.
+static void set_metadata_flags(Ratings* ratings_pb) {
+  const uint32_t criteria_size = ratings_pb->criteria_size();
   // Set min. values manually
   if (FLAGS_minv != "") {
     const char* ptr = FLAGS_minv.c_str();
@@ -107,9 +335,9 @@ int main(int argc, char ** argv) {
       const float v = strtof(ptr, &end_float);
       CHECK_NE(ptr, end_float);
       ptr = end_float;
-      ratings_pb.add_minv(v);
-      LOG(INFO) << "Min. value for criterion " << ratings_pb.minv_size() - 1
-                << ": " << ratings_pb.minv(ratings_pb.minv_size() - 1);
+      ratings_pb->add_minv(v);
+      LOG(INFO) << "Min. value for criterion " << ratings_pb->minv_size() - 1
+                << ": " << ratings_pb->minv(ratings_pb->minv_size() - 1);
     }
   }
   // Set max. values manually
@@ -120,9 +348,9 @@ int main(int argc, char ** argv) {
       const float v = strtof(ptr, &end_float);
       CHECK_NE(ptr, end_float);
       ptr = end_float;
-      ratings_pb.add_maxv(v);
-      LOG(INFO) << "Max. value for criterion " << ratings_pb.maxv_size() - 1
-                << ": " << ratings_pb.maxv(ratings_pb.maxv_size() - 1);
+      ratings_pb->add_maxv(v);
+      LOG(INFO) << "Max. value for criterion " << ratings_pb->maxv_size() - 1
+                << ": " << ratings_pb->maxv(ratings_pb->maxv_size() - 1);
     }
   }
   // Set precision manually
@@ -135,18 +363,77 @@ int main(int argc, char ** argv) {
       while (!isspace(FLAGS_precision[j]) && j < fpl) ++j;
       std::string cprec = FLAGS_precision.substr(i, j - i);
       if (cprec == "INT") {
-        ratings_pb.add_precision(Ratings_Precision_INT);
+        ratings_pb->add_precision(Ratings_Precision_INT);
       } else if (cprec == "FLOAT") {
-        ratings_pb.add_precision(Ratings_Precision_FLOAT);
+        ratings_pb->add_precision(Ratings_Precision_FLOAT);
       } else {
         LOG(FATAL) << "Undefined precision constant: " << cprec;
       }
       LOG(INFO) << "Precision for criterion "
-                << ratings_pb.precision_size() - 1
+                << ratings_pb->precision_size() - 1
                 << ": " << cprec;
     }
   }
+}
+
+int main(int argc, char ** argv) {
+  // Google tools initialization
+  google::InitGoogleLogging(argv[0]);
+  google::SetUsageMessage(
+      "This tool reads from the standard input a list of ratings and creates "
+      "a binary dataset from that list of ratings.\nUsage:" +
+      std::string(argv[0]) + " < plain_text_file > binary_dataset");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK(!FLAGS_stream || !FLAGS_native)
+      << "Only one of -stream and -native can be used.";
+
+  // In stream mode, ratings_pb only keeps the metadata, which is written
+  // at the end of the stream.
+  Ratings ratings_pb;
+  if (FLAGS_stream) {
+    RatingsStreamWriter writer(1);
+    uint32_t criteria_size = 0, max_user = 0, max_item = 0;
+    parse_fd(0, [&](uint32_t user, uint32_t item,
+                    const std::vector<float>& scores) {
+               if (criteria_size == 0) criteria_size = scores.size();
+               CHECK_EQ(criteria_size, scores.size())
+                   << "Inconsistent criteria size for rating (" << user
+                   << ", " << item << ")";
+               max_user = std::max(max_user, user);
+               max_item = std::max(max_item, item);
+               Rating* rating = writer.add_rating();
+               rating->set_user(user);
+               rating->set_item(item);
+               rating->mutable_score()->Reserve(scores.size());
+               for (float s : scores) rating->add_score(s);
+               VLOG(2) << "New rating: User = " << user << ", Item = " << item;
+             });
+    ratings_pb.set_criteria_size(criteria_size);
+    ratings_pb.set_num_users(max_user + 1);
+    ratings_pb.set_num_items(max_item + 1);
+    set_metadata_flags(&ratings_pb);
+    CHECK(writer.close(&ratings_pb));
+    return 0;
+  }
+
+  std::vector<uint32_t> users, items;
+  std::vector<float> scores;
+  {
+    InputText input(0);
+    const size_t threads = FLAGS_threads > 0 ?
+        FLAGS_threads : std::max(1u, std::thread::hardware_concurrency());
+    parse_parallel(input, threads, &ratings_pb, &users, &items, &scores);
+  }
+  LOG(INFO) << "Parsed " << users.size() << " ratings.";
+  set_metadata_flags(&ratings_pb);
+  Dataset dataset;
+  CHECK(dataset.load(ratings_pb, &users, &items, &scores));
   // Serialize dataset to the standard output
-  ratings_pb.SerializeToFileDescriptor(1);
+  if (FLAGS_native) {
+    CHECK(dataset.save_native(1, FLAGS_index));
+  } else {
+    dataset.save(&ratings_pb);
+    CHECK(ratings_pb.SerializeToFileDescriptor(1));
+  }
   return 0;
 }
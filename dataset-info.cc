@@ -19,22 +19,131 @@
 // the maximum and minimum value for each criterion and the precision
 // of each criterion (whether it's a real number or an integer), etc.
 // Additionally, this can print n random ratings from the dataset.
+// Datasets in the chunked format are read block by block, so they can be
+// larger than the available memory. With -verify, every rating and index
+// entry of datasets in the native format is checked when they are loaded.
 //
 // Example: dataset-info -input data_file -seed 1234 -n 100
 
+#include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <random>
+#include <string>
+#include <vector>
 
 #include <dataset.h>
+#include <ratings-stream.h>
+
+using mcfs::protos::Rating;
+using mcfs::protos::Ratings;
+using mcfs::protos::Ratings_Precision_FLOAT;
 
 DEFINE_string(input, "", "Input dataset filename");
 DEFINE_uint64(seed, 0, "Pseudo-random number generator seed");
 DEFINE_uint64(n, 0, "Print n random ratings");
+DEFINE_bool(verify, false, "Check every rating and index entry of native "
+            "datasets");
 
 std::default_random_engine PRNG;
 
+// Same output as Dataset::info(), computed reading the chunked dataset
+// block by block. The n random ratings are chosen by reservoir sampling.
+std::string stream_info(int fd, uint64_t npr) {
+  RatingsStreamReader reader(fd);
+  CHECK(reader.open()) << "Failed to read the input dataset.";
+  uint64_t num_ratings = 0;
+  uint32_t max_user = 0, max_item = 0;
+  std::vector<float> minv, maxv;
+  std::vector<std::pair<uint64_t, Rating> > sample;
+  Ratings block;
+  while (reader.next(&block)) {
+    for (const Rating& rating : block.rating()) {
+      max_user = std::max(max_user, rating.user());
+      max_item = std::max(max_item, rating.item());
+      if (minv.size() < static_cast<size_t>(rating.score_size())) {
+        minv.resize(rating.score_size(), INFINITY);
+        maxv.resize(rating.score_size(), -INFINITY);
+      }
+      for (int c = 0; c < rating.score_size(); ++c) {
+        minv[c] = std::min(minv[c], rating.score(c));
+        maxv[c] = std::max(maxv[c], rating.score(c));
+      }
+      if (sample.size() < npr) {
+        sample.push_back(std::make_pair(num_ratings, rating));
+      } else if (npr > 0) {
+        std::uniform_int_distribution<uint64_t> udist(0, num_ratings);
+        const uint64_t k = udist(PRNG);
+        if (k < npr) {
+          sample[k] = std::make_pair(num_ratings, rating);
+        }
+      }
+      ++num_ratings;
+    }
+  }
+  CHECK(reader.ok()) << "Failed to read the input dataset.";
+  const Ratings& header = reader.header();
+  const uint32_t criteria_size =
+      header.has_criteria_size() ? header.criteria_size() : minv.size();
+  const uint32_t users = header.has_num_users() ? header.num_users() :
+      (num_ratings > 0 ? max_user + 1 : 0);
+  const uint32_t items = header.has_num_items() ? header.num_items() :
+      (num_ratings > 0 ? max_item + 1 : 0);
+  if (static_cast<uint32_t>(header.minv_size()) == criteria_size) {
+    minv.assign(header.minv().begin(), header.minv().end());
+  }
+  if (static_cast<uint32_t>(header.maxv_size()) == criteria_size) {
+    maxv.assign(header.maxv().begin(), header.maxv().end());
+  }
+  std::vector<int> precision(criteria_size, Ratings_Precision_FLOAT);
+  if (static_cast<uint32_t>(header.precision_size()) == criteria_size) {
+    precision.assign(header.precision().begin(), header.precision().end());
+  } else if (header.precision_size() == 1) {
+    precision.assign(criteria_size, header.precision(0));
+  }
+  minv.resize(criteria_size, INFINITY);
+  maxv.resize(criteria_size, -INFINITY);
+  char buff[50];
+  std::string msg;
+  snprintf(buff, sizeof(buff), "Users: %u\n", users);
+  msg += buff;
+  snprintf(buff, sizeof(buff), "Items: %u\n", items);
+  msg += buff;
+  snprintf(buff, sizeof(buff), "Ratings: %" PRIu64 "\n", num_ratings);
+  msg += buff;
+  snprintf(buff, sizeof(buff), "Criteria size: %u\n", criteria_size);
+  msg += buff;
+  msg += "Min. value:";
+  for (uint32_t c = 0; c < criteria_size; ++c) {
+    snprintf(buff, sizeof(buff), " %f", minv[c]);
+    msg += buff;
+  }
+  msg += "\nMax. value:";
+  for (uint32_t c = 0; c < criteria_size; ++c) {
+    snprintf(buff, sizeof(buff), " %f", maxv[c]);
+    msg += buff;
+  }
+  msg += "\nPrecision:";
+  for (uint32_t c = 0; c < criteria_size; ++c) {
+    const std::string label[] = {" FLOAT", " INT"};
+    msg += label[precision[c]];
+  }
+  for (const auto& s : sample) {
+    snprintf(buff, sizeof(buff), "\n[%" PRIu64 "] %u %u",
+             s.first, s.second.user(), s.second.item());
+    msg += buff;
+    for (int c = 0; c < s.second.score_size(); ++c) {
+      snprintf(buff, sizeof(buff), " %f", s.second.score(c));
+      msg += buff;
+    }
+  }
+  return msg;
+}
+
 int main(int argc, char ** argv) {
   // Google tools initialization
   google::InitGoogleLogging(argv[0]);
@@ -47,8 +156,17 @@ int main(int argc, char ** argv) {
       "An input dataset filename must be specified.";
   PRNG.seed(FLAGS_seed);
 
+  int fd = open(FLAGS_input.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Failed to open \"" << FLAGS_input << "\".";
+  if (RatingsStreamReader::is_stream(fd)) {
+    printf("%s\n", stream_info(fd, FLAGS_n).c_str());
+    close(fd);
+    return 0;
+  }
+  close(fd);
   Dataset dataset;
-  dataset.load(FLAGS_input);
+  CHECK(dataset.load(FLAGS_input, FLAGS_verify))
+      << "Failed to load \"" << FLAGS_input << "\".";
   printf("%s\n", dataset.info(FLAGS_n).c_str());
   return 0;
 }
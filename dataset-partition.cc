@@ -32,6 +32,8 @@ DEFINE_string(part1, "", "Partition 1 filename");
 DEFINE_string(part2, "", "Partition 2 filename");
 DEFINE_double(f, 0.8, "Fraction of input data used for part1 (Range: 0..1)");
 DEFINE_bool(ascii, false, "Output partitions in ASCII format");
+DEFINE_bool(native, false, "Output partitions in the native binary format");
+DEFINE_bool(index, true, "Include the user/item indices in native files");
 DEFINE_uint64(seed, 0, "Pseudo-random number generator seed");
 
 int main(int argc, char ** argv) {
@@ -55,7 +57,12 @@ int main(int argc, char ** argv) {
   Dataset dataset1, dataset2;
   dataset1.load(FLAGS_input);
   Dataset::partition(&dataset1, &dataset2, FLAGS_f);
-  dataset1.save(FLAGS_part1, FLAGS_ascii);
-  dataset2.save(FLAGS_part2, FLAGS_ascii);
+  if (FLAGS_native) {
+    CHECK(dataset1.save_native(FLAGS_part1, FLAGS_index));
+    CHECK(dataset2.save_native(FLAGS_part2, FLAGS_index));
+  } else {
+    dataset1.save(FLAGS_part1, FLAGS_ascii);
+    dataset2.save(FLAGS_part2, FLAGS_ascii);
+  }
   return 0;
 }
@@ -17,12 +17,17 @@
 
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <intersection.h>
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <protos/ratings.pb.h>
+#include <ratings-stream.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <algorithm>
+#include <limits>
 #include <string>
 
 using google::protobuf::TextFormat;
@@ -33,7 +38,92 @@ using mcfs::protos::Ratings_Precision_FLOAT;
 
 extern std::default_random_engine PRNG;
 
-Dataset::Dataset() : criteria_size_(0), N_(0), M_(0) {
+// Native binary format. All fields are stored in the host byte order and
+// each section starts at a multiple of kNativeAlign bytes:
+//   NativeHeader
+//   minv[C], maxv[C] (float), precision[C] (int32)
+//   users[R], items[R] (uint32), scores[R x C] (float)
+//   If kNativeHasIndex is set: by_user_offset[N + 1], by_user_index[R],
+//   by_item_offset[M + 1], by_item_index[R] (uint32)
+//   If kNativeHasKeys is also set: by_user_item[R], by_item_user[R] (uint32)
+static const char kNativeMagic[8] = {'M', 'C', 'F', 'S', 'D', 'A', 'T', 0};
+static const uint32_t kNativeVersion = 1;
+static const uint32_t kNativeHasIndex = 0x1;
+static const uint32_t kNativeHasKeys = 0x2;
+static const size_t kNativeAlign = 64;
+// Density of the ratings that never builds the bitmaps of the items of each
+// user (they are only built when asked for, see set_bitmap_density()).
+static const float kNoBitmapDensity = 2.0f;
+
+struct NativeHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t criteria_size;
+  uint32_t num_users;
+  uint32_t num_items;
+  uint64_t num_ratings;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static inline size_t native_align(size_t n) {
+  return (n + kNativeAlign - 1) / kNativeAlign * kNativeAlign;
+}
+
+static bool write_all(int fd, const void* p, size_t n) {
+  const char* ptr = static_cast<const char*>(p);
+  while (n > 0) {
+    const ssize_t w = write(fd, ptr, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    ptr += w;
+    n -= w;
+  }
+  return true;
+}
+
+// Write n bytes from p, followed by the padding up to the next section.
+static bool native_write(int fd, const void* p, size_t n) {
+  static const char zeros[kNativeAlign] = {0};
+  return write_all(fd, p, n) && write_all(fd, zeros, native_align(n) - n);
+}
+
+// Whether the n values of v are smaller than 'bound'.
+static bool native_check_ids(const uint32_t* v, size_t n, size_t bound) {
+  for (size_t k = 0; k < n; ++k) {
+    if (v[k] >= bound) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether the n + 1 offsets of a CSR index start at 0, are non-decreasing
+// and end at 'total'.
+static bool native_check_offsets(const uint32_t* offset, size_t n,
+                                 size_t total) {
+  if (offset[0] != 0 || offset[n] != total) {
+    return false;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    if (offset[k] > offset[k + 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Dataset::Dataset()
+    : criteria_size_(0), N_(0), M_(0), bitmap_density_(kNoBitmapDensity),
+      bitmap_words_(0) {
+}
+
+Dataset::Dataset(const Dataset& other)
+    : criteria_size_(0), N_(0), M_(0), bitmap_density_(kNoBitmapDensity),
+      bitmap_words_(0) {
+  other.copy(this, 0, other.ratings_size());
 }
 
 bool Dataset::save(const std::string& filename, bool ascii) const {
@@ -62,7 +152,7 @@ bool Dataset::save(const std::string& filename, bool ascii) const {
   return true;
 }
 
-bool Dataset::load(const std::string& filename) {
+bool Dataset::load(const std::string& filename, bool verify) {
   mcfs::protos::Ratings proto_ratings;
   // Read protocol buffer
   int fd = open(filename.c_str(), O_RDONLY);
@@ -71,6 +161,23 @@ bool Dataset::load(const std::string& filename) {
                << strerror(errno);
     return false;
   }
+  // Datasets in the native format are mapped into memory instead
+  char magic[sizeof(kNativeMagic)];
+  if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+      memcmp(magic, kNativeMagic, sizeof(magic)) == 0) {
+    close(fd);
+    return load_native(filename, verify);
+  }
+  lseek(fd, 0, SEEK_SET);
+  // Chunked datasets are read block by block
+  if (RatingsStreamReader::is_stream(fd)) {
+    const bool loaded = load_stream(fd);
+    close(fd);
+    if (!loaded) {
+      LOG(ERROR) << "Dataset \"" << filename << "\": Failed to parse.";
+    }
+    return loaded;
+  }
   FileInputStream fs(fd);
   if (!proto_ratings.ParseFromFileDescriptor(fd)) {
     /*&&
@@ -85,10 +192,293 @@ bool Dataset::load(const std::string& filename) {
   return load(proto_ratings);
 }
 
+bool Dataset::load_native(const std::string& filename, bool verify) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to open. Error: "
+               << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(NativeHeader)) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to parse.";
+    close(fd);
+    return false;
+  }
+  const size_t size = st.st_size;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to map. Error: "
+               << strerror(errno);
+    return false;
+  }
+  std::shared_ptr<void> mapping(addr, [size](void* p) { munmap(p, size); });
+  const char* base = static_cast<const char*>(addr);
+  const NativeHeader* header = reinterpret_cast<const NativeHeader*>(base);
+  if (memcmp(header->magic, kNativeMagic, sizeof(kNativeMagic)) != 0 ||
+      header->version != kNativeVersion) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Unsupported format.";
+    return false;
+  }
+  const size_t C = header->criteria_size;
+  const size_t N = header->num_users;
+  const size_t M = header->num_items;
+  const uint64_t R = header->num_ratings;
+  const bool has_index = header->flags & kNativeHasIndex;
+  const bool has_keys = has_index && (header->flags & kNativeHasKeys);
+  // The ratings are indexed with 32-bit integers, and each section must fit
+  // in the file (which also prevents overflows in their sizes)
+  if (R > std::numeric_limits<uint32_t>::max() ||
+      (R > 0 && C == 0) || C > size || (C > 0 && R > size / C)) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Invalid header.";
+    return false;
+  }
+  // Compute the offset of each section and check the size of the file
+  size_t offset[12];
+  size_t end = native_align(sizeof(NativeHeader));
+  const size_t section_size[12] = {
+    C * sizeof(float), C * sizeof(float), C * sizeof(int32_t),
+    R * sizeof(uint32_t), R * sizeof(uint32_t), R * C * sizeof(float),
+    (N + 1) * sizeof(uint32_t), R * sizeof(uint32_t),
+    (M + 1) * sizeof(uint32_t), R * sizeof(uint32_t),
+    R * sizeof(uint32_t), R * sizeof(uint32_t)
+  };
+  for (int s = 0; s < 12; ++s) {
+    offset[s] = end;
+    if (s < 6 || (s < 10 && has_index) || has_keys) {
+      end += native_align(section_size[s]);
+    }
+  }
+  if (end > size) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Truncated file. "
+               << "Size found = " << size << ". Size expected = " << end;
+    return false;
+  }
+  auto section = [base, &offset](int s) -> const uint32_t* {
+    return reinterpret_cast<const uint32_t*>(base + offset[s]);
+  };
+  // The first and last offsets of the indices are always checked. Every
+  // rating and index entry is only checked when asked for, or when the keys
+  // are built in memory (which reads all of them anyway), since the scan
+  // touches almost every page of the file
+  bool valid = !has_index ||
+      (section(6)[0] == 0 && section(6)[N] == R &&
+       section(8)[0] == 0 && section(8)[M] == R);
+  if (valid && (verify || !has_keys)) {
+    valid = native_check_ids(section(3), R, N) &&
+        native_check_ids(section(4), R, M);
+  }
+  if (valid && has_index && (verify || !has_keys)) {
+    valid = native_check_offsets(section(6), N, R) &&
+        native_check_ids(section(7), R, R) &&
+        native_check_offsets(section(8), M, R) &&
+        native_check_ids(section(9), R, R);
+  }
+  if (valid && has_keys && verify) {
+    valid = native_check_ids(section(10), R, M) &&
+        native_check_ids(section(11), R, N);
+  }
+  if (!valid) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Corrupted ratings or "
+               << "indices.";
+    return false;
+  }
+  clear();
+  mapping_ = mapping;
+  criteria_size_ = C;
+  N_ = N;
+  M_ = M;
+  const float* minv = reinterpret_cast<const float*>(base + offset[0]);
+  const float* maxv = reinterpret_cast<const float*>(base + offset[1]);
+  const int32_t* precision =
+      reinterpret_cast<const int32_t*>(base + offset[2]);
+  minv_.assign(minv, minv + C);
+  maxv_.assign(maxv, maxv + C);
+  precision_.assign(precision, precision + C);
+  users_.assign_external(section(3), R);
+  items_.assign_external(section(4), R);
+  scores_.assign_external(
+      reinterpret_cast<const float*>(base + offset[5]), R * C);
+  if (has_index) {
+    by_user_offset_.assign_external(section(6), N + 1);
+    by_user_index_.assign_external(section(7), R);
+    by_item_offset_.assign_external(section(8), M + 1);
+    by_item_index_.assign_external(section(9), R);
+  }
+  if (has_keys) {
+    by_user_item_.assign_external(section(10), R);
+    by_item_user_.assign_external(section(11), R);
+  } else if (has_index) {
+    prepare_index_keys();
+  } else {
+    prepare_aux();
+  }
+  return true;
+}
+
+bool Dataset::save_native(const std::string& filename, bool index) const {
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to open. Error: "
+               << strerror(errno);
+    return false;
+  }
+  if (!save_native(fd, index)) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to write.";
+    close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool Dataset::save_native(int fd, bool index) const {
+  // The indices (and their keys) are only saved if they are up to date
+  index = index && by_user_offset_.size() == N_ + 1 &&
+      by_item_offset_.size() == M_ + 1 &&
+      by_user_item_.size() == ratings_size() &&
+      by_item_user_.size() == ratings_size();
+  NativeHeader header;
+  memset(&header, 0x00, sizeof(header));
+  memcpy(header.magic, kNativeMagic, sizeof(kNativeMagic));
+  header.version = kNativeVersion;
+  header.criteria_size = criteria_size_;
+  header.num_users = N_;
+  header.num_items = M_;
+  header.num_ratings = ratings_size();
+  header.flags = index ? kNativeHasIndex | kNativeHasKeys : 0;
+  const std::vector<int32_t> precision(precision_.begin(), precision_.end());
+  if (!native_write(fd, &header, sizeof(header)) ||
+      !native_write(fd, minv_.data(), criteria_size_ * sizeof(float)) ||
+      !native_write(fd, maxv_.data(), criteria_size_ * sizeof(float)) ||
+      !native_write(fd, precision.data(), criteria_size_ * sizeof(int32_t)) ||
+      !native_write(fd, users_.data(), users_.size() * sizeof(uint32_t)) ||
+      !native_write(fd, items_.data(), items_.size() * sizeof(uint32_t)) ||
+      !native_write(fd, scores_.data(), scores_.size() * sizeof(float))) {
+    return false;
+  }
+  if (index && (
+          !native_write(fd, by_user_offset_.data(),
+                        by_user_offset_.size() * sizeof(uint32_t)) ||
+          !native_write(fd, by_user_index_.data(),
+                        by_user_index_.size() * sizeof(uint32_t)) ||
+          !native_write(fd, by_item_offset_.data(),
+                        by_item_offset_.size() * sizeof(uint32_t)) ||
+          !native_write(fd, by_item_index_.data(),
+                        by_item_index_.size() * sizeof(uint32_t)) ||
+          !native_write(fd, by_user_item_.data(),
+                        by_user_item_.size() * sizeof(uint32_t)) ||
+          !native_write(fd, by_item_user_.data(),
+                        by_item_user_.size() * sizeof(uint32_t)))) {
+    return false;
+  }
+  return true;
+}
+
 bool Dataset::load(const mcfs::protos::Ratings& proto_ratings) {
   // Fill internal data
   clear();
   criteria_size_ = proto_ratings.criteria_size();
+  if (proto_ratings.rating_size() == 0) {
+    return true;
+  }
+  if (!append_ratings(proto_ratings)) {
+    return false;
+  }
+  load_metadata(proto_ratings);
+  return true;
+}
+
+bool Dataset::load(const mcfs::protos::Ratings& header,
+                   std::vector<uint32_t>* users, std::vector<uint32_t>* items,
+                   std::vector<float>* scores) {
+  CHECK_NOTNULL(users);
+  CHECK_NOTNULL(items);
+  CHECK_NOTNULL(scores);
+  clear();
+  criteria_size_ = header.criteria_size();
+  if (users->size() != items->size() ||
+      scores->size() != users->size() * criteria_size_) {
+    LOG(ERROR) << "Dataset: Inconsistent columns. Users = " << users->size()
+               << ", Items = " << items->size() << ", Scores = "
+               << scores->size() << ", Criteria size = " << criteria_size_;
+    return false;
+  }
+  if (users->empty()) {
+    return true;
+  }
+  users_.swap(users);
+  items_.swap(items);
+  scores_.swap(scores);
+  load_metadata(header);
+  return true;
+}
+
+bool Dataset::load_stream(int fd) {
+  RatingsStreamReader reader(fd);
+  if (!reader.open()) {
+    return false;
+  }
+  clear();
+  criteria_size_ = reader.header().criteria_size();
+  mcfs::protos::Ratings block;
+  while (reader.next(&block)) {
+    if (!append_ratings(block)) {
+      return false;
+    }
+  }
+  if (!reader.ok()) {
+    return false;
+  }
+  if (ratings_size() > 0) {
+    load_metadata(reader.header());
+  }
+  return true;
+}
+
+bool Dataset::save_stream(const std::string& filename,
+                          uint32_t block_size) const {
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to open. Error: "
+               << strerror(errno);
+    return false;
+  }
+  if (!save_stream(fd, block_size)) {
+    LOG(ERROR) << "Dataset \"" << filename << "\": Failed to write.";
+    close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+bool Dataset::save_stream(int fd, uint32_t block_size) const {
+  RatingsStreamWriter writer(fd, block_size);
+  // The header gets all the metadata, but no ratings
+  mcfs::protos::Ratings header;
+  save_metadata(&header);
+  if (!writer.write_header(header)) {
+    return false;
+  }
+  for (size_t r = 0; r < ratings_size(); ++r) {
+    mcfs::protos::Rating* rating = writer.add_rating();
+    rating->set_user(users_[r]);
+    rating->set_item(items_[r]);
+    rating->mutable_score()->Reserve(criteria_size_);
+    const float* r_scores = scores(r);
+    for (uint32_t c = 0; c < criteria_size_; ++c) {
+      rating->add_score(r_scores[c]);
+    }
+  }
+  return writer.close();
+}
+
+bool Dataset::append_ratings(const mcfs::protos::Ratings& proto_ratings) {
   if (proto_ratings.rating_size() == 0) {
     return true;
   }
@@ -96,12 +486,15 @@ bool Dataset::load(const mcfs::protos::Ratings& proto_ratings) {
   if (criteria_size_ == 0) {
     criteria_size_ = proto_ratings.rating(0).score_size();
   }
-  ratings_.resize(proto_ratings.rating_size());
+  const size_t first = ratings_size();
+  resize(first + proto_ratings.rating_size());
+  uint32_t* users = users_.mutable_data() + first;
+  uint32_t* items = items_.mutable_data() + first;
   // Copy from protobuf to self-memory
-  for (uint32_t r = 0; r < ratings_.size(); ++r) {
+  for (int r = 0; r < proto_ratings.rating_size(); ++r) {
     // Set user & item ID
-    ratings_[r].user = proto_ratings.rating(r).user();
-    ratings_[r].item = proto_ratings.rating(r).item();
+    users[r] = proto_ratings.rating(r).user();
+    items[r] = proto_ratings.rating(r).item();
     // Check wether the number of scores is the expected
     if (static_cast<uint32_t>(
             proto_ratings.rating(r).score_size()) != criteria_size_) {
@@ -112,9 +505,12 @@ bool Dataset::load(const mcfs::protos::Ratings& proto_ratings) {
     }
     // Set the rating scores
     const float * p_scores = proto_ratings.rating(r).score().data();
-    ratings_[r].scores.resize(criteria_size_);
-    std::copy(p_scores, p_scores + criteria_size_, ratings_[r].scores.begin());
+    std::copy(p_scores, p_scores + criteria_size_, mutable_scores(first + r));
   }
+  return true;
+}
+
+void Dataset::load_metadata(const mcfs::protos::Ratings& proto_ratings) {
   // Set min value for each criteria
   if (static_cast<uint32_t>(proto_ratings.minv_size()) == criteria_size_) {
     minv_.resize(criteria_size_);
@@ -155,16 +551,33 @@ bool Dataset::load(const mcfs::protos::Ratings& proto_ratings) {
     count_items();
   }
   prepare_aux();
-  return true;
 }
 
 void Dataset::save(mcfs::protos::Ratings * proto_ratings) const {
   CHECK_NOTNULL(proto_ratings);
   // Fill protocol buffer
+  save_metadata(proto_ratings);
+  proto_ratings->clear_rating();
+  for (uint32_t r = 0; r < users_.size(); ++r) {
+    mcfs::protos::Rating * rating = proto_ratings->add_rating();
+    // Set user
+    rating->set_user(users_[r]);
+    // Set item
+    rating->set_item(items_[r]);
+    // Set criteria scores
+    rating->mutable_score()->Reserve(criteria_size_);
+    const float* r_scores = scores(r);
+    for (uint32_t c = 0; c < criteria_size_; ++c) {
+      rating->add_score(r_scores[c]);
+    }
+  }
+}
+
+void Dataset::save_metadata(mcfs::protos::Ratings * proto_ratings) const {
+  CHECK_NOTNULL(proto_ratings);
   proto_ratings->clear_minv();
   proto_ratings->clear_maxv();
   proto_ratings->clear_precision();
-  proto_ratings->clear_rating();
   if (criteria_size_ > 0) {
     proto_ratings->set_criteria_size(criteria_size_);
   }
@@ -176,18 +589,6 @@ void Dataset::save(mcfs::protos::Ratings * proto_ratings) const {
     proto_ratings->add_precision(static_cast<Ratings_Precision>(
         precision_[c]));
   }
-  for (uint32_t r = 0; r < ratings_.size(); ++r) {
-    mcfs::protos::Rating * rating = proto_ratings->add_rating();
-    // Set user
-    rating->set_user(ratings_[r].user);
-    // Set item
-    rating->set_item(ratings_[r].item);
-    // Set criteria scores
-    rating->mutable_score()->Reserve(criteria_size_);
-    for (uint32_t c = 0; c < criteria_size_; ++c) {
-      rating->add_score(ratings_[r].scores[c]);
-    }
-  }
 }
 
 std::string Dataset::info(uint32_t npr) const {
@@ -203,7 +604,7 @@ std::string Dataset::info(uint32_t npr) const {
   msg += buff;
   // Number of ratings
   msg += "Ratings: ";
-  snprintf(buff, sizeof(buff), "%u\n", static_cast<uint32_t>(ratings_.size()));
+  snprintf(buff, sizeof(buff), "%u\n", static_cast<uint32_t>(users_.size()));
   msg += buff;
   // Number of scores per ratings
   msg += "Criteria size: ";
@@ -230,15 +631,15 @@ std::string Dataset::info(uint32_t npr) const {
     msg += label[precision_[c]];
   }
   // Print random ratings
-  std::uniform_int_distribution<uint32_t> udist(0, ratings_.size()-1);
+  std::uniform_int_distribution<uint32_t> udist(0, users_.size()-1);
   for (; npr > 0; --npr) {
     msg += "\n";
     const uint32_t r = udist(PRNG);
-    snprintf(
-        buff, sizeof(buff), "[%u] %u %u", r, ratings_[r].user, ratings_[r].item);
+    snprintf(buff, sizeof(buff), "[%u] %u %u", r, users_[r], items_[r]);
     msg += buff;
+    const float* r_scores = scores(r);
     for (uint32_t c = 0; c < criteria_size_; ++c) {
-      snprintf(buff, sizeof(buff), " %f", ratings_[r].scores[c]);
+      snprintf(buff, sizeof(buff), " %f", r_scores[c]);
       msg += buff;
     }
   }
@@ -246,11 +647,15 @@ std::string Dataset::info(uint32_t npr) const {
 }
 
 void Dataset::shuffle(bool prepare) {
-  std::uniform_int_distribution<uint32_t> udist(0, ratings_.size()-1);
-  for (size_t i = 0; i < ratings_.size(); ++i) {
-    Rating& r1 = ratings_[i];
-    Rating& r2 = ratings_[udist(PRNG)];
-    std::swap(r1, r2);
+  std::uniform_int_distribution<uint32_t> udist(0, users_.size()-1);
+  uint32_t* users = users_.mutable_data();
+  uint32_t* items = items_.mutable_data();
+  for (size_t i = 0; i < users_.size(); ++i) {
+    const size_t j = udist(PRNG);
+    std::swap(users[i], users[j]);
+    std::swap(items[i], items[j]);
+    std::swap_ranges(mutable_scores(i), mutable_scores(i) + criteria_size_,
+                     mutable_scores(j));
   }
   if (prepare) {
     prepare_aux();
@@ -261,9 +666,9 @@ void Dataset::partition(Dataset* original, Dataset* partition, float f) {
   original->shuffle(false);
   partition->clear();
   const uint32_t new_size_o = static_cast<uint32_t>(
-      f * original->ratings_.size());
-  const uint32_t new_size_p = original->ratings_.size() - new_size_o;
-  DLOG(INFO) << "Old size: " << original->ratings_.size();
+      f * original->ratings_size());
+  const uint32_t new_size_p = original->ratings_size() - new_size_o;
+  DLOG(INFO) << "Old size: " << original->ratings_size();
   DLOG(INFO) << "New size: " << new_size_o;
   DLOG(INFO) << "Partition size: " << new_size_p;
   partition->criteria_size_ = original->criteria_size_;
@@ -272,10 +677,14 @@ void Dataset::partition(Dataset* original, Dataset* partition, float f) {
   partition->minv_ = original->minv_;
   partition->maxv_ = original->maxv_;
   partition->precision_ = original->precision_;
-  partition->ratings_.resize(new_size_p);
-  std::copy(original->ratings_.begin() + new_size_o, original->ratings_.end(),
-            partition->ratings_.begin());
-  original->ratings_.resize(new_size_o);
+  partition->resize(new_size_p);
+  std::copy(original->users_.begin() + new_size_o, original->users_.end(),
+            partition->users_.mutable_data());
+  std::copy(original->items_.begin() + new_size_o, original->items_.end(),
+            partition->items_.mutable_data());
+  std::copy(original->scores(new_size_o), original->scores_.end(),
+            partition->scores_.mutable_data());
+  original->resize(new_size_o);
   if (new_size_o == 0 || new_size_p == 0) {
     LOG(WARNING) << "Some partition is empty.";
   }
@@ -285,7 +694,7 @@ void Dataset::partition(Dataset* original, Dataset* partition, float f) {
 
 void Dataset::copy(Dataset* other, size_t i, size_t n) const {
   CHECK_NOTNULL(other);
-  CHECK_LT(i, ratings_.size());
+  CHECK_LE(i, users_.size());
   other->clear();
   other->criteria_size_ = criteria_size_;
   other->N_ = N_;
@@ -293,26 +702,29 @@ void Dataset::copy(Dataset* other, size_t i, size_t n) const {
   other->minv_ = minv_;
   other->maxv_ = maxv_;
   other->precision_ = precision_;
-  n = std::min(n, ratings_.size());
-  other->ratings_.resize(n);
+  other->bitmap_density_ = kNoBitmapDensity;
+  n = std::min(n, users_.size() - i);
+  other->resize(n);
   if (n > 0) {
-    std::copy(ratings_.begin() + i, ratings_.begin() + i + n,
-              other->ratings_.begin());
+    std::copy(users_.begin() + i, users_.begin() + i + n,
+              other->users_.mutable_data());
+    std::copy(items_.begin() + i, items_.begin() + i + n,
+              other->items_.mutable_data());
+    std::copy(scores(i), scores(i) + n * criteria_size_,
+              other->scores_.mutable_data());
   }
   other->prepare_aux();
 }
 
 float Dataset::rmse(const Dataset& a, const Dataset& b) {
-  CHECK_EQ(a.ratings_.size(), b.ratings_.size());
+  CHECK_EQ(a.ratings_size(), b.ratings_size());
   CHECK_EQ(a.criteria_size_, b.criteria_size_);
   float s = 0.0f;
-  for (uint32_t r = 0; r < a.ratings_.size(); ++r) {
-    for (uint32_t c = 0; c < a.criteria_size_; ++c) {
-      const float d = a.ratings_[r].scores[c] - b.ratings_[r].scores[c];
-      s += d * d;
-    }
+  for (size_t k = 0; k < a.scores_.size(); ++k) {
+    const float d = a.scores_[k] - b.scores_[k];
+    s += d * d;
   }
-  const uint32_t total_scores = a.ratings_.size() * a.criteria_size_;
+  const uint32_t total_scores = a.scores_.size();
   if (total_scores > 0) {
     return sqrtf(s / total_scores);
   } else {
@@ -320,172 +732,278 @@ float Dataset::rmse(const Dataset& a, const Dataset& b) {
   }
 }
 
-bool Dataset::SortPRatingsByItem::operator() (
-    const Rating* a, const Rating* b) const {
-  CHECK_NOTNULL(a);
-  CHECK_NOTNULL(b);
-  return a->item < b->item;
-}
-
-bool Dataset::SortPRatingsByUser::operator() (
-    const Rating* a, const Rating* b) const {
-  CHECK_NOTNULL(a);
-  CHECK_NOTNULL(b);
-  return a->user < b->user;
-}
-
 Dataset& Dataset::operator = (const Dataset& other) {
-  other.copy(this, 0, other.ratings_.size());
+  other.copy(this, 0, other.ratings_size());
   return *this;
 }
 
 void Dataset::count_users() {
   N_ = 0;
-  if (ratings_.size() > 0) {
-    for (const Rating& rating : ratings_) {
-      N_ = std::max<uint32_t>(rating.user, N_);
-    }
-    ++N_;
+  if (users_.size() > 0) {
+    N_ = *std::max_element(users_.begin(), users_.end()) + 1;
   }
 }
 
 void Dataset::count_items() {
   M_ = 0;
-  if (ratings_.size() > 0) {
-    for (const Rating& rating : ratings_) {
-      M_ = std::max<uint32_t>(rating.item, M_);
-    }
-    ++M_;
+  if (items_.size() > 0) {
+    M_ = *std::max_element(items_.begin(), items_.end()) + 1;
   }
 }
 
+void Dataset::resize(size_t n) {
+  users_.resize(n);
+  items_.resize(n);
+  scores_.resize(n * criteria_size_);
+}
+
 void Dataset::clear() {
   criteria_size_ = 0;
   N_ = 0;
   M_ = 0;
-  ratings_.clear();
-  ratings_by_user_.clear();
-  ratings_by_item_.clear();
+  users_.clear();
+  items_.clear();
+  scores_.clear();
+  by_user_offset_.clear();
+  by_user_index_.clear();
+  by_item_offset_.clear();
+  by_item_index_.clear();
+  by_user_item_.clear();
+  by_item_user_.clear();
+  bitmap_words_ = 0;
+  user_bitmap_.clear();
+  mapping_.reset();
 }
 
-void Dataset::prepare_aux() {
-  ratings_by_user_.clear();
-  ratings_by_item_.clear();
-  ratings_by_user_.resize(N_);
-  ratings_by_item_.resize(M_);
-  for (auto it = ratings_by_user_.begin(); it != ratings_by_user_.end(); ++it) {
-    it->clear();
-  }
-  for (auto it = ratings_by_item_.begin(); it != ratings_by_item_.end(); ++it) {
-    it->clear();
-  }
-  for (auto it = ratings_.begin(); it != ratings_.end(); ++it) {
-    ratings_by_user_[it->user].push_back(&(*it));
-    ratings_by_item_[it->item].push_back(&(*it));
-  }
-  for (auto it = ratings_by_user_.begin(); it != ratings_by_user_.end(); ++it) {
-    if (it->size() > 0) {
-      sort(it->begin(), it->end(), SortPRatingsByItem());
-    }
+// Build the CSR offsets of the given keys and scatter the indices of the
+// ratings in the order given by 'order' (or 0..n-1 if it is NULL). Since the
+// scatter is stable, each list keeps the relative order of 'order'.
+void Dataset::counting_sort(const Column<uint32_t>& keys, uint32_t nkeys,
+                            const Column<uint32_t>* order,
+                            Column<uint32_t>* offset,
+                            Column<uint32_t>* index) {
+  offset->assign(nkeys + 1, 0);
+  uint32_t* off = offset->mutable_data();
+  for (const uint32_t k : keys) {
+    ++off[k + 1];
+  }
+  for (uint32_t k = 0; k < nkeys; ++k) {
+    off[k + 1] += off[k];
+  }
+  std::vector<uint32_t> next(off, off + nkeys);
+  index->clear();
+  index->resize(keys.size());
+  uint32_t* idx = index->mutable_data();
+  for (uint32_t p = 0; p < keys.size(); ++p) {
+    const uint32_t r = order == NULL ? p : (*order)[p];
+    idx[next[keys[r]]++] = r;
   }
-  for (auto it = ratings_by_item_.begin(); it != ratings_by_item_.end(); ++it) {
-    if (it->size() > 0) {
-      sort(it->begin(), it->end(), SortPRatingsByUser());
-    }
+}
+
+void Dataset::prepare_aux() {
+  // Group by user in any order, then by item in user order (so each item
+  // list is sorted by user), and finally by user again in item order (so
+  // each user list is sorted by item).
+  counting_sort(users_, N_, NULL, &by_user_offset_, &by_user_index_);
+  counting_sort(items_, M_, &by_user_index_, &by_item_offset_, &by_item_index_);
+  counting_sort(users_, N_, &by_item_index_, &by_user_offset_, &by_user_index_);
+  prepare_index_keys();
+}
+
+void Dataset::prepare_index_keys() {
+  by_user_item_.clear();
+  by_user_item_.resize(by_user_index_.size());
+  uint32_t* user_item = by_user_item_.mutable_data();
+  for (size_t p = 0; p < by_user_index_.size(); ++p) {
+    user_item[p] = items_[by_user_index_[p]];
+  }
+  by_item_user_.clear();
+  by_item_user_.resize(by_item_index_.size());
+  uint32_t* item_user = by_item_user_.mutable_data();
+  for (size_t p = 0; p < by_item_index_.size(); ++p) {
+    item_user[p] = users_[by_item_index_[p]];
+  }
+  prepare_bitmaps();
+}
+
+void Dataset::prepare_bitmaps() {
+  bitmap_words_ = 0;
+  std::vector<uint64_t>().swap(user_bitmap_);
+  const double cells = static_cast<double>(N_) * M_;
+  if (cells == 0 || ratings_size() < bitmap_density_ * cells) {
+    return;
+  }
+  bitmap_words_ = (M_ + 63) / 64;
+  user_bitmap_.assign(bitmap_words_ * N_, 0);
+  for (size_t r = 0; r < ratings_size(); ++r) {
+    user_bitmap_[users_[r] * bitmap_words_ + items_[r] / 64] |=
+        1ull << (items_[r] % 64);
   }
 }
 
-const std::vector<Dataset::Rating*>& Dataset::ratings_by_item(
-    uint32_t item) const {
-  CHECK_LT(item, ratings_by_item_.size());
-  return ratings_by_item_[item];
+void Dataset::set_bitmap_density(float min_density) {
+  bitmap_density_ = min_density;
+  prepare_bitmaps();
+}
+
+Dataset::RatingsSpan Dataset::ratings_by_item(uint32_t item) const {
+  CHECK_LT(item, M_);
+  const uint32_t* index = by_item_index_.data();
+  return RatingsSpan(index + by_item_offset_[item],
+                     index + by_item_offset_[item + 1]);
+}
+
+Dataset::RatingsSpan Dataset::ratings_by_user(uint32_t user) const {
+  CHECK_LT(user, N_);
+  const uint32_t* index = by_user_index_.data();
+  return RatingsSpan(index + by_user_offset_[user],
+                     index + by_user_offset_[user + 1]);
 }
 
-const std::vector<Dataset::Rating*>& Dataset::ratings_by_user(
-    uint32_t user) const {
-  CHECK_LT(user, ratings_by_user_.size());
-  return ratings_by_user_[user];
+Dataset::RatingsSpan Dataset::items_by_user(uint32_t user) const {
+  CHECK_LT(user, N_);
+  const uint32_t* user_item = by_user_item_.data();
+  return RatingsSpan(user_item + by_user_offset_[user],
+                     user_item + by_user_offset_[user + 1]);
+}
+
+Dataset::RatingsSpan Dataset::users_by_item(uint32_t item) const {
+  CHECK_LT(item, M_);
+  const uint32_t* item_user = by_item_user_.data();
+  return RatingsSpan(item_user + by_item_offset_[item],
+                     item_user + by_item_offset_[item + 1]);
+}
+
+bool Dataset::find_rating(uint32_t user, uint32_t item, size_t* r) const {
+  CHECK_NOTNULL(r);
+  if (user >= N_) {
+    return false;
+  }
+  // The ratings of each user are sorted by item
+  const RatingsSpan user_ratings = ratings_by_user(user);
+  const uint32_t* it = std::lower_bound(
+      user_ratings.begin(), user_ratings.end(), item,
+      [this](uint32_t a, uint32_t i) { return items_[a] < i; });
+  if (it == user_ratings.end() || items_[*it] != item) {
+    return false;
+  }
+  *r = *it;
+  return true;
 }
 
 void Dataset::init_minv() {
   minv_.resize(criteria_size_, INFINITY);
-  for (const Rating& rating: ratings_) {
+  for (size_t r = 0; r < users_.size(); ++r) {
+    const float* r_scores = scores(r);
     for (uint32_t c = 0; c < criteria_size_; ++c) {
-      minv_[c] = std::min(minv_[c], rating.scores[c]);
+      minv_[c] = std::min(minv_[c], r_scores[c]);
     }
   }
 }
 void Dataset::init_maxv() {
   maxv_.resize(criteria_size_, -INFINITY);
-  for (const Rating& rating: ratings_) {
+  for (size_t r = 0; r < users_.size(); ++r) {
+    const float* r_scores = scores(r);
     for (uint32_t c = 0; c < criteria_size_; ++c) {
-      maxv_[c] = std::max(maxv_[c], rating.scores[c]);
+      maxv_[c] = std::max(maxv_[c], r_scores[c]);
     }
   }
 }
 
-void Dataset::get_scores_from_common_ratings_by_users(
-    uint32_t user1, uint32_t user2,
-    std::vector<float> * ratings_u1,
-    std::vector<float> * ratings_u2) const {
-  CHECK_NOTNULL(ratings_u1);
-  CHECK_NOTNULL(ratings_u2);
-  ratings_u1->clear();
-  ratings_u2->clear();
-  // Get the common ratings
-  const std::vector<Rating*>& ratings_by_u1 = ratings_by_user_[user1];
-  const std::vector<Rating*>& ratings_by_u2 = ratings_by_user_[user2];
-  for (uint32_t i = 0, j = 0; i < ratings_by_u1.size() &&
-           j < ratings_by_u2.size(); ) {
-    const Rating * rating_u1 = ratings_by_u1[i];
-    const Rating * rating_u2 = ratings_by_u2[j];
-    if (rating_u1->item == rating_u2->item) {
-      for (uint32_t c = 0; c < criteria_size_; ++c) {
-        ratings_u1->push_back(rating_u1->scores[c]);
-        ratings_u2->push_back(rating_u2->scores[c]);
-      }
-      ++i;
-      ++j;
-    } else if (rating_u1->item < rating_u2->item) {
-      ++i;
-    } else {
-      ++j;
+size_t Dataset::get_common_ratings_by_users(
+    uint32_t user1, uint32_t user2, std::vector<uint32_t>* ratings_u1,
+    std::vector<uint32_t>* ratings_u2) const {
+  CHECK_LT(user1, N_);
+  CHECK_LT(user2, N_);
+  if (!user_bitmap_.empty()) {
+    CHECK_NOTNULL(ratings_u1);
+    CHECK_NOTNULL(ratings_u2);
+    const uint32_t b1 = by_user_offset_[user1], b2 = by_user_offset_[user2];
+    ratings_u1->resize(std::min(by_user_offset_[user1 + 1] - b1,
+                                by_user_offset_[user2 + 1] - b2));
+    ratings_u2->resize(ratings_u1->size());
+    uint32_t* r1 = ratings_u1->data();
+    uint32_t* r2 = ratings_u2->data();
+    // The ranks of the common items are their positions in the lists
+    const size_t n = intersect_bitmaps(
+        &user_bitmap_[user1 * bitmap_words_],
+        &user_bitmap_[user2 * bitmap_words_], bitmap_words_, r1, r2);
+    for (size_t k = 0; k < n; ++k) {
+      r1[k] = by_user_index_[b1 + r1[k]];
+      r2[k] = by_user_index_[b2 + r2[k]];
     }
+    ratings_u1->resize(n);
+    ratings_u2->resize(n);
+    return n;
   }
-  if (ratings_u1->size() == 0) {
-    DLOG(WARNING) << "No common ratings between users "
-                  << user1 << " and " << user2 << ".";
-  }
+  return get_common_ratings(by_user_offset_, by_user_index_, by_user_item_,
+                            user1, user2, ratings_u1, ratings_u2);
+}
+
+size_t Dataset::get_common_ratings_by_items(
+    uint32_t item1, uint32_t item2, std::vector<uint32_t>* ratings_i1,
+    std::vector<uint32_t>* ratings_i2) const {
+  CHECK_LT(item1, M_);
+  CHECK_LT(item2, M_);
+  return get_common_ratings(by_item_offset_, by_item_index_, by_item_user_,
+                            item1, item2, ratings_i1, ratings_i2);
 }
 
+// Intersect the (sorted) keys of the lists a and b of a CSR index, and
+// store the rating indices of the common ones.
+size_t Dataset::get_common_ratings(const Column<uint32_t>& offset,
+                                   const Column<uint32_t>& index,
+                                   const Column<uint32_t>& keys,
+                                   uint32_t a, uint32_t b,
+                                   std::vector<uint32_t>* ratings_a,
+                                   std::vector<uint32_t>* ratings_b) {
+  CHECK_NOTNULL(ratings_a);
+  CHECK_NOTNULL(ratings_b);
+  const uint32_t ba = offset[a], ea = offset[a + 1];
+  const uint32_t bb = offset[b], eb = offset[b + 1];
+  ratings_a->resize(std::min(ea - ba, eb - bb));
+  ratings_b->resize(ratings_a->size());
+  uint32_t* ra = ratings_a->data();
+  uint32_t* rb = ratings_b->data();
+  // Intersect the keys of both lists, and translate the positions of the
+  // common ones into rating indices.
+  const size_t n = intersect(keys.data() + ba, ea - ba, keys.data() + bb,
+                             eb - bb, ra, rb);
+  for (size_t k = 0; k < n; ++k) {
+    ra[k] = index[ba + ra[k]];
+    rb[k] = index[bb + rb[k]];
+  }
+  ratings_a->resize(n);
+  ratings_b->resize(n);
+  return n;
+}
 
 void Dataset::to_normal_scale() {
-  for (auto rat = ratings_.begin(); rat != ratings_.end(); ++rat) {
-    for (uint32_t c = 0; c < rat->scores.size(); ++c) {
+  for (size_t r = 0; r < users_.size(); ++r) {
+    float* r_scores = mutable_scores(r);
+    for (uint32_t c = 0; c < criteria_size_; ++c) {
       if (maxv_[c] != minv_[c]) {
-        rat->scores[c] = (rat->scores[c] - minv_[c])/(maxv_[c] - minv_[c]);
+        r_scores[c] = (r_scores[c] - minv_[c])/(maxv_[c] - minv_[c]);
       } else {
-        rat->scores[c] = 0;
+        r_scores[c] = 0;
       }
     }
   }
 }
 
 void Dataset::to_original_scale() {
-  for (auto rat = ratings_.begin(); rat != ratings_.end(); ++rat) {
-    for (uint32_t c = 0; c < rat->scores.size(); ++c) {
-      rat->scores[c] = rat->scores[c]*(maxv_[c] - minv_[c]) + minv_[c];
+  for (size_t r = 0; r < users_.size(); ++r) {
+    float* r_scores = mutable_scores(r);
+    for (uint32_t c = 0; c < criteria_size_; ++c) {
+      r_scores[c] = r_scores[c]*(maxv_[c] - minv_[c]) + minv_[c];
       if (precision_[c] == mcfs::protos::Ratings_Precision_INT) {
-        rat->scores[c] = round(rat->scores[c]);
+        r_scores[c] = round(r_scores[c]);
       }
     }
   }
 }
 
 void Dataset::erase_scores() {
-  for (auto it = ratings_.begin(); it != ratings_.end(); ++it) {
-    for (auto x = it->scores.begin(); x != it->scores.end(); ++x) {
-      *x = 0.0f;
-    }
-  }
+  std::fill(scores_.mutable_data(), scores_.mutable_data() + scores_.size(),
+            0.0f);
 }
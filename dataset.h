@@ -20,74 +20,250 @@
 #include <math.h>
 #include <stdint.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
+// Minimum density of the ratings from which the bitmaps of the items of the
+// users pay off (see tools/benchmark-bitmaps.sh).
+static const float kDefaultBitmapDensity = 0.01f;
+
+// The ratings are stored column-wise: one array with the users, one array
+// with the items and a single block of ratings_size() x criteria_size()
+// scores. Use rating(r) to get a light view of the r-th rating.
+// The columns (and the by-user/by-item indices) may live in a memory-mapped
+// file in the native binary format (see save_native()). In that case they
+// are only copied to the heap when the dataset is modified.
 class Dataset {
  public:
   struct Rating {
     uint32_t user;
     uint32_t item;
-    std::vector<float> scores;
+    const float* scores;
+  };
+
+  // Contiguous range of rating indices, as returned by ratings_by_user()
+  // and ratings_by_item().
+  class RatingsSpan {
+   public:
+    RatingsSpan(const uint32_t* b, const uint32_t* e) : begin_(b), end_(e) {}
+    inline const uint32_t* begin() const { return begin_; }
+    inline const uint32_t* end() const { return end_; }
+    inline size_t size() const { return end_ - begin_; }
+    inline uint32_t operator[] (size_t i) const { return begin_[i]; }
+   private:
+    const uint32_t* begin_;
+    const uint32_t* end_;
   };
 
   Dataset();
+  Dataset(const Dataset& other);
   Dataset& operator = (const Dataset& other);
 
   void clear();
   void copy(Dataset* other, size_t i, size_t n) const;
   void erase_scores();
-  void get_scores_from_common_ratings_by_users(
-      uint32_t user1, uint32_t user2,
-      std::vector<float> * ratings_u1,
-      std::vector<float> * ratings_u2) const;
+  // Store in ratings_u1 and ratings_u2 the pairs of ratings of user1 and
+  // user2 to the same item, in increasing order of item. Returns the number
+  // of common ratings.
+  size_t get_common_ratings_by_users(uint32_t user1, uint32_t user2,
+                                     std::vector<uint32_t>* ratings_u1,
+                                     std::vector<uint32_t>* ratings_u2) const;
+  // Minimum density of the ratings (i.e. ratings / (users * items)) to
+  // index the items of each user also in a bitmap, which is faster to
+  // intersect than the sorted lists on dense datasets. 0 always builds the
+  // bitmaps, and a value greater than 1 (the default) never does. The
+  // bitmaps are (re)built or dropped immediately. The copies of a dataset
+  // never have bitmaps unless they are also asked for.
+  void set_bitmap_density(float min_density);
+  inline bool has_bitmaps() const { return !user_bitmap_.empty(); }
+  // Same for the ratings of item1 and item2 by the same user.
+  size_t get_common_ratings_by_items(uint32_t item1, uint32_t item2,
+                                     std::vector<uint32_t>* ratings_i1,
+                                     std::vector<uint32_t>* ratings_i2) const;
+  // Find the rating of 'user' to 'item'. Returns false if there is none.
+  bool find_rating(uint32_t user, uint32_t item, size_t* r) const;
   std::string info(uint32_t npr = 0) const;
   bool load(const mcfs::protos::Ratings& ratings);
-  bool load(const std::string& filename);
-  const std::vector<Rating*>& ratings_by_item(uint32_t item) const;
-  const std::vector<Rating*>& ratings_by_user(uint32_t user) const;
+  // Files in the native format are mapped, and every rating and index
+  // entry in them is only checked if 'verify' is true (see load_native()).
+  bool load(const std::string& filename, bool verify = false);
+  // Take the given columns, leaving the vectors empty, and the metadata in
+  // 'header' (which must not contain ratings). Avoids copying large inputs.
+  bool load(const mcfs::protos::Ratings& header,
+            std::vector<uint32_t>* users, std::vector<uint32_t>* items,
+            std::vector<float>* scores);
+  // Map a file in the native format. The header and the bounds of the
+  // indices are always checked; the users, items and index entries of each
+  // rating are scanned only if 'verify' is true or the index keys are not in
+  // the file (they are then built in memory, reading all of them anyway).
+  bool load_native(const std::string& filename, bool verify = false);
+  bool load_stream(int fd);
+  RatingsSpan ratings_by_item(uint32_t item) const;
+  RatingsSpan ratings_by_user(uint32_t user) const;
+  // Items rated by 'user', in increasing order (i.e. the items of the
+  // ratings in ratings_by_user(), in the same order).
+  RatingsSpan items_by_user(uint32_t user) const;
+  // Users that rated 'item', in increasing order (i.e. the users of the
+  // ratings in ratings_by_item(), in the same order).
+  RatingsSpan users_by_item(uint32_t item) const;
   void save(mcfs::protos::Ratings * ratings) const;
   bool save(const std::string&, bool ascii = false) const;
+  bool save_native(const std::string& filename, bool index = true) const;
+  bool save_native(int fd, bool index = true) const;
+  bool save_stream(const std::string& filename,
+                   uint32_t block_size = 65536) const;
+  bool save_stream(int fd, uint32_t block_size = 65536) const;
   void shuffle(bool prepare = true);
   void to_normal_scale();
   void to_original_scale();
 
-  inline std::vector<Rating>& mutable_ratings() { return ratings_; }
-  inline const std::vector<Rating>& ratings() const { return ratings_; }
+  inline Rating rating(size_t r) const {
+    Rating rat = {users_[r], items_[r], scores(r)};
+    return rat;
+  }
+  inline uint32_t user(size_t r) const { return users_[r]; }
+  inline uint32_t item(size_t r) const { return items_[r]; }
+  inline const float* scores(size_t r) const {
+    return scores_.data() + r * criteria_size_;
+  }
+  inline float* mutable_scores(size_t r) {
+    return scores_.mutable_data() + r * criteria_size_;
+  }
   inline float minv(uint32_t c) const { return minv_[c]; }
   inline float maxv(uint32_t c) const { return maxv_[c]; }
   inline float precision(uint32_t c) const { return precision_[c]; }
   inline uint32_t users() const { return N_; }
   inline uint32_t items() const { return M_; }
   inline size_t criteria_size() const { return criteria_size_; }
-  inline size_t ratings_size() const { return ratings_.size(); }
+  inline size_t ratings_size() const { return users_.size(); }
 
   static void partition(Dataset * original, Dataset * partition, float f);
   static float rmse(const Dataset& a, const Dataset& b);
 
  private:
-  struct SortPRatingsByItem {
-    bool operator() (const Rating* a, const Rating* b) const;
-  };
+  // Array that either owns its elements or refers to read-only memory owned
+  // by someone else (i.e. a mapped file). In the latter case, the elements
+  // are copied the first time that the column is modified.
+  template <typename T>
+  class Column {
+   public:
+    Column() : data_(NULL), size_(0), external_(false) {}
+    Column(const Column& other) { *this = other; }
+    Column& operator = (const Column& other) {
+      external_ = other.external_;
+      if (external_) {
+        own_.clear();
+        data_ = other.data_;
+      } else {
+        own_ = other.own_;
+        data_ = own_.data();
+      }
+      size_ = other.size_;
+      return *this;
+    }
+    void assign(size_t n, const T& v) {
+      own_.assign(n, v);
+      set_own();
+    }
+    void assign_external(const T* p, size_t n) {
+      std::vector<T>().swap(own_);
+      data_ = p;
+      size_ = n;
+      external_ = true;
+    }
+    void clear() {
+      own_.clear();
+      set_own();
+    }
+    void swap(std::vector<T>* v) {
+      own_.swap(*v);
+      v->clear();
+      set_own();
+    }
+    void resize(size_t n) {
+      materialize();
+      own_.resize(n);
+      set_own();
+    }
+    inline const T* data() const { return data_; }
+    inline T* mutable_data() {
+      materialize();
+      return own_.data();
+    }
+    inline size_t size() const { return size_; }
+    inline const T* begin() const { return data_; }
+    inline const T* end() const { return data_ + size_; }
+    inline const T& operator[] (size_t i) const { return data_[i]; }
 
-  struct SortPRatingsByUser {
-    bool operator() (const Rating* a, const Rating* b) const;
+   private:
+    inline void materialize() {
+      if (external_) {
+        own_.assign(data_, data_ + size_);
+        set_own();
+      }
+    }
+    inline void set_own() {
+      data_ = own_.data();
+      size_ = own_.size();
+      external_ = false;
+    }
+    std::vector<T> own_;
+    const T* data_;
+    size_t size_;
+    bool external_;
   };
 
-  std::vector<Rating> ratings_;
+  Column<uint32_t> users_;
+  Column<uint32_t> items_;
+  Column<float> scores_;
   std::vector<float> minv_;
   std::vector<float> maxv_;
   std::vector<int> precision_;
   uint32_t criteria_size_;
   uint32_t N_, M_;
-  std::vector<std::vector<Rating*> > ratings_by_user_;
-  std::vector<std::vector<Rating*> > ratings_by_item_;
+  // Compressed sparse row indices. The ratings of user u are
+  // by_user_index_[by_user_offset_[u] .. by_user_offset_[u + 1]), sorted by
+  // item. The ratings of each item are sorted by user, in the same way.
+  Column<uint32_t> by_user_offset_;
+  Column<uint32_t> by_user_index_;
+  Column<uint32_t> by_item_offset_;
+  Column<uint32_t> by_item_index_;
+  // Item of each rating in by_user_index_ and user of each rating in
+  // by_item_index_, so that the (sorted) items of each user and users of
+  // each item are contiguous. Mapped when the native file stores them, and
+  // built in memory otherwise.
+  Column<uint32_t> by_user_item_;
+  Column<uint32_t> by_item_user_;
+  // Bitmap of the items of each user (bitmap_words_ words per user), only
+  // built when the density of the ratings is at least bitmap_density_.
+  float bitmap_density_;
+  size_t bitmap_words_;
+  std::vector<uint64_t> user_bitmap_;
+  // Keeps the mapped file alive while any column refers to it.
+  std::shared_ptr<void> mapping_;
 
+  bool append_ratings(const mcfs::protos::Ratings& ratings);
   void count_items();
   void count_users();
   void init_maxv();
   void init_minv();
+  void load_metadata(const mcfs::protos::Ratings& ratings);
+  void save_metadata(mcfs::protos::Ratings* ratings) const;
   void prepare_aux();
+  void prepare_index_keys();
+  void prepare_bitmaps();
+  void resize(size_t n);
+
+  static size_t get_common_ratings(const Column<uint32_t>& offset,
+                                   const Column<uint32_t>& index,
+                                   const Column<uint32_t>& keys,
+                                   uint32_t a, uint32_t b,
+                                   std::vector<uint32_t>* ratings_a,
+                                   std::vector<uint32_t>* ratings_b);
+  static void counting_sort(const Column<uint32_t>& keys, uint32_t nkeys,
+                            const Column<uint32_t>* order,
+                            Column<uint32_t>* offset, Column<uint32_t>* index);
 };
 
 #endif  // DATASET_H_
@@ -17,32 +17,32 @@
 #define DEFINES_H_
 
 #include <glog/logging.h>
-#include <time.h>
+#include <chrono>
 
-// Print the elapsed seconds to perform the action A.
-#define CLOCK(A) {                                              \
-    clock_t t1 = clock();                                       \
-    A;                                                          \
-    clock_t t2 = clock();                                       \
-    LOG(INFO) << "Elapsed seconds: "                            \
-              << (t2 - t1)/static_cast<float>(CLOCKS_PER_SEC);  \
+// Print the elapsed (wall-clock) seconds to perform the action A.
+#define CLOCK(A) {                                                      \
+    const auto t1 = std::chrono::steady_clock::now();                   \
+    A;                                                                  \
+    const auto t2 = std::chrono::steady_clock::now();                   \
+    LOG(INFO) << "Elapsed seconds: "                                    \
+              << std::chrono::duration<float>(t2 - t1).count();         \
   }
 
 // Print the elapsed seconds to perform the action A, with a customized message.
 #define CLOCK_MSG(A, M) {                                               \
-    clock_t t1 = clock();                                               \
+    const auto t1 = std::chrono::steady_clock::now();                   \
     A;                                                                  \
-    clock_t t2 = clock();                                               \
-    LOG(INFO) << M << (t2 - t1) / static_cast<float>(CLOCKS_PER_SEC);   \
+    const auto t2 = std::chrono::steady_clock::now();                   \
+    LOG(INFO) << M << std::chrono::duration<float>(t2 - t1).count();    \
   }
 
 // Compute the elapsed seconds to perform the action A, and assign the result
 // to the float pointer P.
-#define CLOCK_PTR(A, P) {                                       \
-    clock_t t1 = clock();                                       \
-    A;                                                          \
-    clock_t t2 = clock();                                       \
-    *P = (t2 - t1) / static_cast<float>(CLOCKS_PER_SEC);        \
+#define CLOCK_PTR(A, P) {                                               \
+    const auto t1 = std::chrono::steady_clock::now();                   \
+    A;                                                                  \
+    const auto t2 = std::chrono::steady_clock::now();                   \
+    *P = std::chrono::duration<float>(t2 - t1).count();                 \
   }
 
 #endif  // DEFINES_H_
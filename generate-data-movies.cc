@@ -27,6 +27,11 @@
 // 1..13 (instead of the original 1..5) and each criterion is assumed to have
 // this standard deviation.
 //
+// The ratings are generated twice with the same seed: the first pass finds
+// the range of the scores and the second one outputs the normalized ratings.
+// With -stream, the ratings are written in the chunked format as they are
+// generated, so the output can be larger than the available memory.
+//
 // Example: generate-data-movies -users 100 -movies 100 -fratings 0.1 -seed 1234
 
 #include <gflags/gflags.h>
@@ -37,6 +42,7 @@
 #include <random>
 
 #include <protos/ratings.pb.h>
+#include <ratings-stream.h>
 
 using google::protobuf::TextFormat;
 using google::protobuf::io::FileOutputStream;
@@ -51,6 +57,7 @@ DEFINE_double(fratings, 0.0, "Ratio of ratings to generate");
 DEFINE_uint64(seed, 0, "Pseudo-random number generator seed");
 DEFINE_bool(ascii, false, "Output the ratings in ASCII format");
 DEFINE_bool(zos, false, "Output data in range 0..1");
+DEFINE_bool(stream, false, "Output the ratings in the chunked format");
 
 // Averages provided by [1].
 float AVERAGES[5] = {9.6, 9.9, 9.5, 10.5, 9.5};
@@ -64,27 +71,13 @@ float CORR_L[25] = {1, 0.834, 0.871, 0.782, 0.905,
                     0, 0, 0, 0, 0.3241};
 TNT::Array2D<float> CORR_L_TNT(5, 5, CORR_L);
 
-int main(int argc, char ** argv) {
-  // Google tools initialization
-  google::InitGoogleLogging(argv[0]);
-  google::SetUsageMessage(
-      "This tool generates data simuating the Yahoo! Movies dataset.\n"
-      "Usage: " + std::string(argv[0]) +
-      " -users 1000 -movies 500 -fratings 0.05");
-  google::ParseCommandLineFlags(&argc, &argv, true);
-  // Check number of users, movies and ratings ratio.
-  CHECK_GT(FLAGS_users, 0) <<
-      "The number of users must be greater than zero.";
-  CHECK_GT(FLAGS_movies, 0) <<
-      "The number of movies must be greater than zero.";
-  CHECK_GT(FLAGS_fratings, 0.0) <<
-      "The ratio of ratings be greater than zero.";
-  // Random generators
-  std::default_random_engine rndg(FLAGS_seed);
+// Generate the ratings using the given seed and call f(user, movie, scores)
+// for each one of them.
+template <typename F>
+void generate_ratings(uint64_t seed, F f) {
+  std::default_random_engine rndg(seed);
   std::uniform_real_distribution<float> unif_dist(0.0, 1.0);
   std::normal_distribution<float> norm_dist(0.0, 1.0);
-  Ratings ratings_pb;
-
   for (uint32_t u = 0; u < FLAGS_users; ++u) {
     for (uint32_t m = 0; m < FLAGS_movies; ++m) {
       if ( unif_dist(rndg) < FLAGS_fratings ) {
@@ -97,34 +90,60 @@ int main(int argc, char ** argv) {
         TNT::Array2D<float> cratings = TNT::matmult(ratings, CORR_L_TNT);
         // Ratings distributed with the corret mean and dev, and restricted
         // to range 1..13.
-        Rating * final_rating = ratings_pb.add_rating();
-        final_rating->set_user(u);
-        final_rating->set_item(m);
+        float scores[5];
         for (int r = 0; r < 5; ++r) {
-          final_rating->add_score(cratings[0][r] * STDDEVS[r] + AVERAGES[r]);
+          scores[r] = cratings[0][r] * STDDEVS[r] + AVERAGES[r];
         }
+        f(u, m, scores);
       }
     }
   }
+}
+
+int main(int argc, char ** argv) {
+  // Google tools initialization
+  google::InitGoogleLogging(argv[0]);
+  google::SetUsageMessage(
+      "This tool generates data simuating the Yahoo! Movies dataset.\n"
+      "Usage: " + std::string(argv[0]) +
+      " -users 1000 -movies 500 -fratings 0.05");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  // Check number of users, movies and ratings ratio.
+  CHECK_GT(FLAGS_users, 0) <<
+      "The number of users must be greater than zero.";
+  CHECK_GT(FLAGS_movies, 0) <<
+      "The number of movies must be greater than zero.";
+  CHECK_GT(FLAGS_fratings, 0.0) <<
+      "The ratio of ratings be greater than zero.";
+  CHECK(!FLAGS_stream || !FLAGS_ascii)
+      << "The chunked format can not be written in ASCII.";
+  // First pass: find the range of each criterion
   float minr[5] = {INFINITY, INFINITY, INFINITY, INFINITY, INFINITY};
   float maxr[5] = {-INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY};
-  for (int i = 0; i < ratings_pb.rating_size(); ++i) {
-    for (int j = 0; j < 5; ++j) {
-      minr[j] = std::min(minr[j], ratings_pb.rating(i).score(j));
-      maxr[j] = std::max(maxr[j], ratings_pb.rating(i).score(j));
-    }
-  }
-  for (int i = 0; i < ratings_pb.rating_size(); ++i) {
-    for (int j = 0; j < 5; ++j) {
-      const float nrating =
-          (ratings_pb.rating(i).score(j) - minr[j]) / (maxr[j] - minr[j]);
-      ratings_pb.mutable_rating(i)->set_score(j, nrating);
-      if (!FLAGS_zos) {
-        ratings_pb.mutable_rating(i)->set_score(
-            j, round(ratings_pb.rating(i).score(j) * 12.0f + 1.0f));
+  generate_ratings(FLAGS_seed, [&](uint32_t u, uint32_t m, const float* s) {
+      for (int j = 0; j < 5; ++j) {
+        minr[j] = std::min(minr[j], s[j]);
+        maxr[j] = std::max(maxr[j], s[j]);
       }
-    }
-  }
+    });
+  // Second pass: output the normalized ratings. In stream mode, ratings_pb
+  // only keeps the metadata, which is written at the end of the stream.
+  RatingsStreamWriter* writer =
+      FLAGS_stream ? CHECK_NOTNULL(new RatingsStreamWriter(1)) : NULL;
+  Ratings ratings_pb;
+  generate_ratings(FLAGS_seed, [&](uint32_t u, uint32_t m, const float* s) {
+      Rating * final_rating =
+          FLAGS_stream ? writer->add_rating() : ratings_pb.add_rating();
+      final_rating->set_user(u);
+      final_rating->set_item(m);
+      for (int j = 0; j < 5; ++j) {
+        float nrating = (s[j] - minr[j]) / (maxr[j] - minr[j]);
+        if (!FLAGS_zos) {
+          nrating = round(nrating * 12.0f + 1.0f);
+        }
+        final_rating->add_score(nrating);
+      }
+    });
   ratings_pb.set_criteria_size(5);
   ratings_pb.set_num_users(FLAGS_users);
   ratings_pb.set_num_items(FLAGS_movies);
@@ -139,7 +158,10 @@ int main(int argc, char ** argv) {
       ratings_pb.add_precision(Ratings_Precision_INT);
     }
   }
-  if (FLAGS_ascii) {
+  if (FLAGS_stream) {
+    CHECK(writer->close(&ratings_pb));
+    delete writer;
+  } else if (FLAGS_ascii) {
     FileOutputStream fs(1);
     TextFormat::Print(ratings_pb, &fs);
   } else {
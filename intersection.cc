@@ -0,0 +1,251 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <intersection.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+
+// Galloping is used when one list is this many times longer than the other.
+static const size_t kGallopingRatio = 32;
+
+// Scalar merge of a[i..na) and b[j..nb). Appends the matches after the
+// first n ones and returns the total number of matches.
+static inline size_t merge(const uint32_t* a, size_t na, size_t i,
+                           const uint32_t* b, size_t nb, size_t j,
+                           uint32_t* ia, uint32_t* ib, size_t n) {
+  while (i < na && j < nb) {
+    if (a[i] == b[j]) {
+      ia[n] = i++;
+      ib[n] = j++;
+      ++n;
+    } else if (a[i] < b[j]) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  return n;
+}
+
+size_t intersect_scalar(const uint32_t* a, size_t na,
+                        const uint32_t* b, size_t nb,
+                        uint32_t* ia, uint32_t* ib) {
+  return merge(a, na, 0, b, nb, 0, ia, ib, 0);
+}
+
+size_t intersect_galloping(const uint32_t* a, size_t na,
+                           const uint32_t* b, size_t nb,
+                           uint32_t* ia, uint32_t* ib) {
+  // Search each element of the shortest list in the longest one
+  if (na > nb) {
+    return intersect_galloping(b, nb, a, na, ib, ia);
+  }
+  size_t n = 0;
+  size_t j = 0;
+  for (size_t i = 0; i < na && j < nb; ++i) {
+    const uint32_t x = a[i];
+    if (b[j] < x) {
+      // Exponential search of the range containing the first b[j] >= x,
+      // followed by a binary search in that range.
+      size_t step = 1;
+      while (j + step < nb && b[j + step] < x) {
+        step <<= 1;
+      }
+      j = std::lower_bound(b + j + step / 2 + 1,
+                           b + std::min(j + step + 1, nb), x) - b;
+      if (j == nb) {
+        break;
+      }
+    }
+    if (b[j] == x) {
+      ia[n] = i;
+      ib[n] = j++;
+      ++n;
+    }
+  }
+  return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Store the positions of the elements of the block of a starting at i that
+// were found in the block of b starting at j, given their mask.
+static inline size_t store_matches(const uint32_t* a, size_t i,
+                                   const uint32_t* b, size_t j,
+                                   uint32_t mask, uint32_t* ia, uint32_t* ib,
+                                   size_t n) {
+  while (mask) {
+    const size_t k = __builtin_ctz(mask);
+    size_t l = 0;
+    while (b[j + l] != a[i + k]) ++l;
+    ia[n] = i + k;
+    ib[n] = j + l;
+    ++n;
+    mask &= mask - 1;
+  }
+  return n;
+}
+
+// Compare blocks of 4 elements of both lists against each other (all the
+// rotations of the block of b), and advance the block with the smallest
+// last element.
+__attribute__((target("sse2")))
+size_t intersect_sse2(const uint32_t* a, size_t na,
+                      const uint32_t* b, size_t nb,
+                      uint32_t* ia, uint32_t* ib) {
+  size_t i = 0, j = 0, n = 0;
+  while (i + 4 <= na && j + 4 <= nb) {
+    const __m128i va =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    __m128i cmp = _mm_cmpeq_epi32(va, vb);
+    for (int r = 1; r < 4; ++r) {
+      vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+      cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+    }
+    const uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+    n = store_matches(a, i, b, j, mask, ia, ib, n);
+    const uint32_t amax = a[i + 3], bmax = b[j + 3];
+    if (amax <= bmax) i += 4;
+    if (bmax <= amax) j += 4;
+  }
+  return merge(a, na, i, b, nb, j, ia, ib, n);
+}
+
+// Same as intersect_sse2(), with blocks of 8 elements.
+__attribute__((target("avx2")))
+size_t intersect_avx2(const uint32_t* a, size_t na,
+                      const uint32_t* b, size_t nb,
+                      uint32_t* ia, uint32_t* ib) {
+  size_t i = 0, j = 0, n = 0;
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  while (i + 8 <= na && j + 8 <= nb) {
+    const __m256i va =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+    __m256i cmp = _mm256_cmpeq_epi32(va, vb);
+    for (int r = 1; r < 8; ++r) {
+      vb = _mm256_permutevar8x32_epi32(vb, rotate);
+      cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(va, vb));
+    }
+    const uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+    n = store_matches(a, i, b, j, mask, ia, ib, n);
+    const uint32_t amax = a[i + 7], bmax = b[j + 7];
+    if (amax <= bmax) i += 8;
+    if (bmax <= amax) j += 8;
+  }
+  return merge(a, na, i, b, nb, j, ia, ib, n);
+}
+
+#endif
+
+// Word-wise AND of both bitmaps. The ranks of the common elements are the
+// number of elements of each bitmap in the previous words, plus the number
+// of elements before them in their word.
+template <typename Popcount>
+static inline size_t intersect_bitmaps_with(const uint64_t* a,
+                                            const uint64_t* b, size_t words,
+                                            uint32_t* ia, uint32_t* ib) {
+  size_t n = 0;
+  uint32_t ra = 0, rb = 0;
+  for (size_t w = 0; w < words; ++w) {
+    const uint64_t wa = a[w], wb = b[w];
+    for (uint64_t m = wa & wb; m; m &= m - 1) {
+      const uint64_t below = (m & -m) - 1;
+      ia[n] = ra + Popcount::count(wa & below);
+      ib[n] = rb + Popcount::count(wb & below);
+      ++n;
+    }
+    ra += Popcount::count(wa);
+    rb += Popcount::count(wb);
+  }
+  return n;
+}
+
+struct BuiltinPopcount {
+  static inline uint32_t count(uint64_t x) { return __builtin_popcountll(x); }
+};
+
+static size_t intersect_bitmaps_generic(const uint64_t* a, const uint64_t* b,
+                                        size_t words, uint32_t* ia,
+                                        uint32_t* ib) {
+  return intersect_bitmaps_with<BuiltinPopcount>(a, b, words, ia, ib);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Same, compiled to use the POPCNT instruction.
+__attribute__((target("popcnt")))
+static size_t intersect_bitmaps_popcnt(const uint64_t* a, const uint64_t* b,
+                                       size_t words, uint32_t* ia,
+                                       uint32_t* ib) {
+  return intersect_bitmaps_with<BuiltinPopcount>(a, b, words, ia, ib);
+}
+
+#endif
+
+typedef size_t (*IntersectionKernel)(const uint32_t*, size_t,
+                                     const uint32_t*, size_t,
+                                     uint32_t*, uint32_t*);
+
+static IntersectionKernel select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &intersect_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &intersect_sse2;
+  }
+#endif
+  return &intersect_scalar;
+}
+
+static const IntersectionKernel kBlockKernel = select_kernel();
+
+typedef size_t (*BitmapKernel)(const uint64_t*, const uint64_t*, size_t,
+                               uint32_t*, uint32_t*);
+
+static BitmapKernel select_bitmap_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("popcnt")) {
+    return &intersect_bitmaps_popcnt;
+  }
+#endif
+  return &intersect_bitmaps_generic;
+}
+
+static const BitmapKernel kBitmapKernel = select_bitmap_kernel();
+
+size_t intersect(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                 uint32_t* ia, uint32_t* ib) {
+  if (na == 0 || nb == 0) {
+    return 0;
+  }
+  if (na > kGallopingRatio * nb || nb > kGallopingRatio * na) {
+    return intersect_galloping(a, na, b, nb, ia, ib);
+  }
+  return kBlockKernel(a, na, b, nb, ia, ib);
+}
+
+size_t intersect_bitmaps(const uint64_t* a, const uint64_t* b, size_t words,
+                         uint32_t* ia, uint32_t* ib) {
+  return kBitmapKernel(a, b, words, ia, ib);
+}
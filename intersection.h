@@ -0,0 +1,56 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef INTERSECTION_H_
+#define INTERSECTION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Intersection of two strictly increasing lists a[0..na) and b[0..nb).
+// For each common element, its position in a is stored in ia and its
+// position in b in ib, in increasing order. Both ia and ib must have room
+// for min(na, nb) positions. Returns the number of common elements.
+//
+// intersect() uses galloping search when one list is much longer than the
+// other and, otherwise, the fastest block-compare kernel supported by the
+// CPU (detected at runtime).
+size_t intersect(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                 uint32_t* ia, uint32_t* ib);
+
+// Intersection of two sets given as bitmaps of the same number of 64-bit
+// words. For each common element, its rank in a (i.e. its position in the
+// sorted list of elements of a) is stored in ia and its rank in b in ib,
+// in increasing order. Returns the number of common elements.
+size_t intersect_bitmaps(const uint64_t* a, const uint64_t* b, size_t words,
+                         uint32_t* ia, uint32_t* ib);
+
+// Individual kernels.
+size_t intersect_scalar(const uint32_t* a, size_t na,
+                        const uint32_t* b, size_t nb,
+                        uint32_t* ia, uint32_t* ib);
+size_t intersect_galloping(const uint32_t* a, size_t na,
+                           const uint32_t* b, size_t nb,
+                           uint32_t* ia, uint32_t* ib);
+#if defined(__x86_64__) || defined(__i386__)
+size_t intersect_sse2(const uint32_t* a, size_t na,
+                      const uint32_t* b, size_t nb,
+                      uint32_t* ia, uint32_t* ib);
+size_t intersect_avx2(const uint32_t* a, size_t na,
+                      const uint32_t* b, size_t nb,
+                      uint32_t* ia, uint32_t* ib);
+#endif
+
+#endif  // INTERSECTION_H_
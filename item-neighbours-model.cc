@@ -0,0 +1,359 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <item-neighbours-model.h>
+
+#include <dataset.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/text_format.h>
+#include <intersection.h>
+#include <neighbours-model.h>
+#include <similarities.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+
+using google::protobuf::TextFormat;
+using google::protobuf::io::FileInputStream;
+using google::protobuf::io::FileOutputStream;
+
+using mcfs::protos::ItemNeighboursModelConfig;
+using mcfs::protos::NeighboursModelConfig_Similarity_COSINE;
+using mcfs::protos::NeighboursModelConfig_Similarity_Name;
+
+
+ItemNeighboursModel::ItemNeighboursModel() : K_(0), max_neighbours_(100) {
+  set_similarity(NeighboursModelConfig_Similarity_COSINE);
+}
+
+bool ItemNeighboursModel::set_similarity(
+    NeighboursModelConfig_Similarity similarity) {
+  KernelSelector selector = { this };
+  if (!visit_similarity_kernel(similarity, &selector)) {
+    return false;
+  }
+  similarity_code_ = similarity;
+  return true;
+}
+
+bool ItemNeighboursModel::load_string(const std::string& str) {
+  ItemNeighboursModelConfig config;
+  if (!TextFormat::ParseFromString(str, &config)) {
+    LOG(ERROR) << "ItemNeighboursModel: Failed to parse.";
+    return false;
+  }
+  return load(config);
+}
+
+bool ItemNeighboursModel::save_string(std::string * str) const {
+  CHECK_NOTNULL(str);
+  ItemNeighboursModelConfig config;
+  save(&config);
+  return TextFormat::PrintToString(config, str);
+}
+
+bool ItemNeighboursModel::load(const std::string& filename) {
+  ItemNeighboursModelConfig config;
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "ItemNeighboursModel \"" << filename
+               << "\": Failed to open. Error: " << strerror(errno);
+    return false;
+  }
+  FileInputStream fs(fd);
+  if (!config.ParseFromFileDescriptor(fd) &&
+      !TextFormat::Parse(&fs, &config)) {
+    LOG(ERROR) << "ItemNeighboursModel \"" << filename
+               << "\": Failed to parse.";
+    return false;
+  }
+  close(fd);
+  return load(config);
+}
+
+bool ItemNeighboursModel::load(const ItemNeighboursModelConfig& config) {
+  if (!data_.load(config.ratings())) {
+    return false;
+  }
+  K_ = config.k();
+  max_neighbours_ = config.max_neighbours();
+  if (!set_similarity(config.similarity())) {
+    return false;
+  }
+  neighbours_offset_.clear();
+  neighbours_item_.clear();
+  neighbours_sim_.clear();
+  if (config.neighbours_size() > 0) {
+    if (static_cast<uint32_t>(config.neighbours_size()) != data_.items()) {
+      LOG(ERROR) << "ItemNeighboursModel: Expected the neighbours of "
+                 << data_.items() << " items, found "
+                 << config.neighbours_size() << ".";
+      return false;
+    }
+    neighbours_offset_.push_back(0);
+    for (const ItemNeighboursModelConfig::Neighbours& n :
+             config.neighbours()) {
+      if (n.item_size() != n.similarity_size()) {
+        LOG(ERROR) << "ItemNeighboursModel: Neighbours and similarities "
+                   << "sizes do not match.";
+        return false;
+      }
+      for (int j = 0; j < n.item_size(); ++j) {
+        if (n.item(j) >= data_.items() ||
+            (j > 0 && n.item(j) <= n.item(j - 1))) {
+          LOG(ERROR) << "ItemNeighboursModel: Unknown or unsorted neighbour "
+                     << n.item(j) << ".";
+          return false;
+        }
+      }
+      neighbours_item_.insert(neighbours_item_.end(),
+                              n.item().begin(), n.item().end());
+      neighbours_sim_.insert(neighbours_sim_.end(),
+                             n.similarity().begin(), n.similarity().end());
+      neighbours_offset_.push_back(neighbours_item_.size());
+    }
+  } else if (data_.ratings_size() > 0) {
+    compute_neighbours();
+  }
+  return true;
+}
+
+bool ItemNeighboursModel::save(ItemNeighboursModelConfig * config) const {
+  if (data_.ratings_size() > 0) {
+    data_.save(config->mutable_ratings());
+  }
+  config->set_k(K_);
+  config->set_similarity(similarity_code_);
+  config->set_max_neighbours(max_neighbours_);
+  for (size_t i = 0; i + 1 < neighbours_offset_.size(); ++i) {
+    ItemNeighboursModelConfig::Neighbours* n = config->add_neighbours();
+    const uint32_t b = neighbours_offset_[i], e = neighbours_offset_[i + 1];
+    n->mutable_item()->Reserve(e - b);
+    n->mutable_similarity()->Reserve(e - b);
+    for (uint32_t j = b; j < e; ++j) {
+      n->add_item(neighbours_item_[j]);
+      n->add_similarity(neighbours_sim_[j]);
+    }
+  }
+  return true;
+}
+
+bool ItemNeighboursModel::save(const std::string& filename) const {
+  ItemNeighboursModelConfig config;
+  if (!save(&config)) {
+    return false;
+  }
+  // Write protocol buffer
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    LOG(ERROR) << "ItemNeighboursModel \"" << filename
+               << "\": Failed to open. Error: " << strerror(errno);
+    return false;
+  }
+  FileOutputStream fs(fd);
+  if (!config.SerializeToFileDescriptor(fd)) {
+    LOG(ERROR) << "ItemNeighboursModel \"" << filename
+               << "\": Failed to write.";
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+float ItemNeighboursModel::train(const Dataset& train_set,
+                                 const Dataset& valid_set) {
+  data_ = train_set;
+  compute_neighbours();
+  LOG(INFO) << "Model config:\n" << info();
+  const float valid_rmse = Model::test(valid_set);
+  // The error on the training data is always 0.0 for this model
+  LOG(INFO) << "Train RMSE = " << 0.0 << ", Valid RMSE = " << valid_rmse;
+  return valid_rmse;
+}
+
+void ItemNeighboursModel::compute_neighbours() {
+  (this->*compute_neighbours_)();
+}
+
+template <typename Kernel>
+void ItemNeighboursModel::compute_neighbours_with() {
+  const uint32_t num_items = data_.items();
+  std::vector<WeightedRatings> neighbours(num_items);
+  std::atomic<uint32_t> next_item(0);
+  // Each thread takes the next item to process. For each item, the
+  // similarity is computed only against the items with some common rater.
+  auto worker = [this, num_items, &neighbours, &next_item]() {
+    std::vector<uint32_t> mark(num_items, 0);
+    std::vector<uint32_t> candidates;
+    for (uint32_t i = next_item++; i < num_items; i = next_item++) {
+      candidates.clear();
+      for (const uint32_t r : data_.ratings_by_item(i)) {
+        for (const uint32_t j : data_.items_by_user(data_.user(r))) {
+          if (j != i && mark[j] != i + 1) {
+            mark[j] = i + 1;
+            candidates.push_back(j);
+          }
+        }
+      }
+      WeightedRatings& i_neighbours = neighbours[i];
+      for (const uint32_t j : candidates) {
+        const float f = item_similarity<Kernel>(data_, i, j);
+        CHECK_EQ(std::isnan(f), 0);
+        if (f > 0.0) {
+          i_neighbours.push_back(std::make_pair(f, j));
+        }
+      }
+      // Keep the most similar items, and sort them by item
+      if (max_neighbours_ > 0 && i_neighbours.size() > max_neighbours_) {
+        std::nth_element(i_neighbours.begin(),
+                         i_neighbours.begin() + max_neighbours_,
+                         i_neighbours.end(),
+                         std::greater<std::pair<float, uint32_t> >());
+        i_neighbours.resize(max_neighbours_);
+        i_neighbours.shrink_to_fit();
+      }
+      std::sort(i_neighbours.begin(), i_neighbours.end(),
+                [](const std::pair<float, uint32_t>& a,
+                   const std::pair<float, uint32_t>& b) {
+                  return a.second < b.second;
+                });
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+  // Store the lists in CSR format
+  neighbours_offset_.assign(1, 0);
+  neighbours_item_.clear();
+  neighbours_sim_.clear();
+  for (const WeightedRatings& i_neighbours : neighbours) {
+    for (const std::pair<float, uint32_t>& n : i_neighbours) {
+      neighbours_sim_.push_back(n.first);
+      neighbours_item_.push_back(n.second);
+    }
+    neighbours_offset_.push_back(neighbours_item_.size());
+  }
+  LOG(INFO) << "Computed " << neighbours_item_.size() << " neighbours of "
+            << num_items << " items.";
+}
+
+void ItemNeighboursModel::test(Dataset* test_set) const {
+  CHECK_NOTNULL(test_set);
+  // Each thread predicts blocks of consecutive ratings. Each prediction only
+  // writes on its own scores.
+  static const size_t kBlockSize = 256;
+  std::atomic<size_t> next_block(0);
+  auto worker = [this, test_set, &next_block]() {
+    WeightedRatings weighted_ratings;
+    std::vector<uint32_t> pos_user, pos_item;
+    for (size_t b = next_block++ * kBlockSize; b < test_set->ratings_size();
+         b = next_block++ * kBlockSize) {
+      const size_t e = std::min(b + kBlockSize, test_set->ratings_size());
+      // For each user_item to rate...
+      for (size_t t = b; t < e; ++t) {
+        const uint32_t pred_user = test_set->user(t);
+        const uint32_t pred_item = test_set->item(t);
+        float* pred_scores = test_set->mutable_scores(t);
+        if (pred_item >= data_.items() ||
+            data_.ratings_by_item(pred_item).size() == 0) {
+          LOG(WARNING) << "Item " << pred_item << " not rated before.";
+          for (uint32_t c = 0; c < data_.criteria_size(); ++c) {
+            pred_scores[c] = (data_.maxv(c) - data_.minv(c)) / 2.0f;
+          }
+          continue;
+        }
+        // Check if the desired prediction was in the training set.
+        size_t exact_match;
+        if (data_.find_rating(pred_user, pred_item, &exact_match)) {
+          const float* rat_scores = data_.scores(exact_match);
+          std::copy(rat_scores, rat_scores + data_.criteria_size(),
+                    pred_scores);
+          continue;
+        }
+        // Ratings of the user to the neighbours of the item: both lists
+        // are sorted by item.
+        weighted_ratings.clear();
+        if (pred_user < data_.users()) {
+          const Dataset::RatingsSpan user_items =
+              data_.items_by_user(pred_user);
+          const Dataset::RatingsSpan user_ratings =
+              data_.ratings_by_user(pred_user);
+          const uint32_t nb = neighbours_offset_[pred_item];
+          const uint32_t ne = neighbours_offset_[pred_item + 1];
+          pos_user.resize(std::min<size_t>(user_items.size(), ne - nb));
+          pos_item.resize(pos_user.size());
+          const size_t n = intersect(
+              user_items.begin(), user_items.size(),
+              neighbours_item_.data() + nb, ne - nb,
+              pos_user.data(), pos_item.data());
+          for (size_t k = 0; k < n; ++k) {
+            weighted_ratings.push_back(std::make_pair(
+                neighbours_sim_[nb + pos_item[k]], user_ratings[pos_user[k]]));
+          }
+        }
+        // Select the K ratings to the most similar items, and sort them by
+        // similarity.
+        if (K_ > 0 && weighted_ratings.size() > K_) {
+          std::nth_element(weighted_ratings.begin(),
+                           weighted_ratings.begin() + K_,
+                           weighted_ratings.end(),
+                           std::greater<std::pair<float, uint32_t> >());
+          weighted_ratings.resize(K_);
+        }
+        std::sort(weighted_ratings.begin(), weighted_ratings.end(),
+                  std::greater<std::pair<float, uint32_t> >());
+        // If the user did not rate any neighbour of the item, predict the
+        // average rating of the item.
+        if (weighted_ratings.size() == 0) {
+          DLOG(INFO) << "User " << pred_user
+                     << " have not rated any item similar to item "
+                     << pred_item << ".";
+          for (const uint32_t r : data_.ratings_by_item(pred_item)) {
+            weighted_ratings.push_back(std::make_pair(1.0f, r));
+          }
+        }
+        predict_from_neighbours(data_, weighted_ratings, pred_scores);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+}
+
+std::string ItemNeighboursModel::info() const {
+#define BUFF_SIZE 50
+  char buff[BUFF_SIZE];
+  std::string msg;
+  snprintf(buff, BUFF_SIZE, "K = %u\n", K_);
+  msg += buff;
+  snprintf(buff, BUFF_SIZE, "Similarity = %s\n",
+           NeighboursModelConfig_Similarity_Name(similarity_code_).c_str());
+  msg += buff;
+  snprintf(buff, BUFF_SIZE, "Max. neighbours = %u\n", max_neighbours_);
+  msg += buff;
+  msg += data_.info(0);
+  return msg;
+}
@@ -0,0 +1,79 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ITEM_NEIGHBOURS_MODEL_H_
+#define ITEM_NEIGHBOURS_MODEL_H_
+
+#include <dataset.h>
+#include <protos/item-neighbours-model.pb.h>
+#include <model.h>
+
+#include <string>
+#include <vector>
+
+using mcfs::protos::ItemNeighboursModelConfig;
+using mcfs::protos::NeighboursModelConfig_Similarity;
+
+// Item-based neighbours model. The similarities between items (computed
+// from the users that rated both) are precomputed during the training, and
+// the rating of an item is predicted from the ratings of the same user to
+// the most similar items.
+class ItemNeighboursModel : public Model {
+ public:
+  ItemNeighboursModel();
+
+  float train(const Dataset& train_set, const Dataset& valid_set);
+  void test(Dataset* test_set) const;
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename);
+  bool save(ItemNeighboursModelConfig * config) const;
+  bool load(const ItemNeighboursModelConfig& config);
+  bool load_string(const std::string& str);
+  bool save_string(std::string* str) const;
+  std::string info() const;
+
+ private:
+  typedef void (ItemNeighboursModel::*ComputeNeighboursFn)();
+
+  Dataset data_;
+  uint32_t K_;
+  uint32_t max_neighbours_;
+  NeighboursModelConfig_Similarity similarity_code_;
+  // Instance of compute_neighbours_with() for the similarity kernel in use,
+  // chosen by set_similarity().
+  ComputeNeighboursFn compute_neighbours_;
+  // Neighbours of each item, in CSR format. The neighbours of item i are
+  // neighbours_item_[neighbours_offset_[i] .. neighbours_offset_[i + 1]),
+  // sorted by item, so that they can be intersected with the items rated
+  // by a user.
+  std::vector<uint32_t> neighbours_offset_;
+  std::vector<uint32_t> neighbours_item_;
+  std::vector<float> neighbours_sim_;
+
+  void compute_neighbours();
+  template <typename Kernel> void compute_neighbours_with();
+  bool set_similarity(NeighboursModelConfig_Similarity similarity);
+
+  // Visitor of visit_similarity_kernel() that selects the kernel to use.
+  struct KernelSelector {
+    ItemNeighboursModel* model;
+    template <typename Kernel> void visit() {
+      model->compute_neighbours_ =
+          &ItemNeighboursModel::compute_neighbours_with<Kernel>;
+    }
+  };
+};
+
+#endif  // ITEM_NEIGHBOURS_MODEL_H_
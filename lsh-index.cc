@@ -0,0 +1,203 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <lsh-index.h>
+
+#include <glog/logging.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+
+static const double kPi = 3.14159265358979323846;
+// The values of the directions of the p-stable families are taken among
+// 2^kQuantileBits quantiles of their distribution.
+static const uint32_t kQuantileBits = 12;
+
+// Finalizer of splitmix64: a 64-bit hash of x.
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+// Stores in 'q' the quantiles (k + 0.5) / 2^kQuantileBits of the standard
+// Gaussian or Cauchy distribution.
+static void stable_quantiles(LSHIndex::Family family, std::vector<float>* q) {
+  q->resize(1u << kQuantileBits);
+  for (size_t k = 0; k < q->size(); ++k) {
+    const double u = (k + 0.5) / q->size();
+    if (family == LSHIndex::CAUCHY_PROJECTIONS) {
+      (*q)[k] = tan(kPi * (u - 0.5));
+      continue;
+    }
+    // Inverse of the Gaussian CDF, by bisection
+    double lo = -10.0, hi = 10.0;
+    for (int it = 0; it < 64; ++it) {
+      const double x = (lo + hi) / 2.0;
+      if (0.5 * erfc(-x / sqrt(2.0)) < u) {
+        lo = x;
+      } else {
+        hi = x;
+      }
+    }
+    (*q)[k] = (lo + hi) / 2.0;
+  }
+}
+
+// Stores in 'dir' the values of the given number of random directions in
+// dimension 'dim' (an item and criterion). Each value is derived from a hash
+// of the seed, the dimension and the projection, so that the directions
+// are not stored: they are +/-1 for SIGNED_PROJECTIONS (which only need a
+// symmetric distribution), and one of the quantiles 'q' of the Gaussian or
+// Cauchy distribution for the p-stable families.
+static void random_directions(LSHIndex::Family family, uint64_t seed,
+                              uint64_t dim, size_t projections,
+                              const std::vector<float>& q, float* dir) {
+  const uint64_t base = mix64(seed ^ mix64(dim));
+  uint64_t h = 0;
+  if (family == LSHIndex::SIGNED_PROJECTIONS) {
+    for (size_t p = 0; p < projections; ++p) {
+      if (p % 64 == 0) h = mix64(base + (p / 64 + 1) * 0x9e3779b97f4a7c15ull);
+      dir[p] = 1.0f - 2.0f * static_cast<float>((h >> (p % 64)) & 1);
+    }
+    return;
+  }
+  const size_t per_hash = 64 / kQuantileBits;
+  const uint64_t mask = (1ull << kQuantileBits) - 1;
+  for (size_t p = 0; p < projections; ++p) {
+    if (p % per_hash == 0) {
+      h = mix64(base + (p / per_hash + 1) * 0x9e3779b97f4a7c15ull);
+    }
+    dir[p] = q[(h >> ((p % per_hash) * kQuantileBits)) & mask];
+  }
+}
+
+LSHIndex::LSHIndex() : tables_(0), users_(0) {}
+
+void LSHIndex::clear() {
+  tables_ = 0;
+  users_ = 0;
+  user_key_.clear();
+  buckets_.clear();
+}
+
+void LSHIndex::build(const Dataset& data, Family family, uint32_t tables,
+                     uint32_t bits, float bucket_width, uint64_t seed,
+                     uint32_t threads) {
+  CHECK_GT(tables, 0);
+  CHECK_GT(bits, 0);
+  if (family == SIGNED_PROJECTIONS) {
+    CHECK_LE(bits, 64);
+  } else {
+    CHECK_GT(bucket_width, 0.0f);
+  }
+  clear();
+  tables_ = tables;
+  users_ = data.users();
+  // Offsets of the quantized projections (the random directions are
+  // computed when they are used, see random_directions()).
+  const size_t projections = static_cast<size_t>(tables) * bits;
+  std::vector<float> offsets(projections);
+  std::vector<float> quantiles;
+  if (family != SIGNED_PROJECTIONS) {
+    stable_quantiles(family, &quantiles);
+  }
+  std::default_random_engine prng(seed);
+  std::uniform_real_distribution<float> udist(0.0f, bucket_width);
+  for (float& x : offsets) x = udist(prng);
+  // Each thread hashes the next user in all the tables.
+  user_key_.assign(static_cast<size_t>(tables) * users_, 0);
+  std::atomic<uint32_t> next_user(0);
+  auto worker = [&]() {
+    std::vector<float> proj(projections);
+    std::vector<float> dir(projections);
+    for (uint32_t u = next_user++; u < users_; u = next_user++) {
+      std::fill(proj.begin(), proj.end(), 0.0f);
+      float norm = 0.0f;
+      for (const uint32_t r : data.ratings_by_user(u)) {
+        const float* s = data.scores(r);
+        const size_t d = static_cast<size_t>(data.item(r)) *
+            data.criteria_size();
+        for (size_t c = 0; c < data.criteria_size(); ++c) {
+          random_directions(family, seed, d + c, projections, quantiles,
+                            dir.data());
+          for (size_t p = 0; p < projections; ++p) {
+            proj[p] += dir[p] * s[c];
+          }
+          norm += s[c] * s[c];
+        }
+      }
+      norm = norm > 0.0f ? sqrt(norm) : 1.0f;
+      for (uint32_t t = 0; t < tables; ++t) {
+        uint64_t key = 0;
+        for (uint32_t b = 0; b < bits; ++b) {
+          const float x = proj[t * bits + b];
+          if (family == SIGNED_PROJECTIONS) {
+            key |= static_cast<uint64_t>(x > 0.0f) << b;
+          } else {
+            const int64_t h = static_cast<int64_t>(
+                floor((x / norm + offsets[t * bits + b]) / bucket_width));
+            key = (key ^ static_cast<uint64_t>(h)) * 0x9e3779b97f4a7c15ull;
+          }
+        }
+        user_key_[static_cast<size_t>(u) * tables + t] = key;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < std::max(threads, 1u); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+  // Sort the users of each table by key, so that each bucket is contiguous.
+  buckets_.resize(user_key_.size());
+  for (uint32_t t = 0; t < tables; ++t) {
+    const size_t b = static_cast<size_t>(t) * users_;
+    for (uint32_t u = 0; u < users_; ++u) {
+      buckets_[b + u] = std::make_pair(
+          user_key_[static_cast<size_t>(u) * tables + t], u);
+    }
+    std::sort(buckets_.begin() + b, buckets_.begin() + b + users_);
+  }
+}
+
+void LSHIndex::candidates(uint32_t user,
+                          std::vector<uint32_t>* users) const {
+  CHECK_NOTNULL(users);
+  users->clear();
+  if (user >= users_) {
+    return;
+  }
+  for (uint32_t t = 0; t < tables_; ++t) {
+    const size_t b = static_cast<size_t>(t) * users_;
+    const uint64_t key = user_key_[static_cast<size_t>(user) * tables_ + t];
+    for (auto it = std::lower_bound(buckets_.begin() + b,
+                                    buckets_.begin() + b + users_,
+                                    std::make_pair(key, 0u));
+         it != buckets_.begin() + b + users_ && it->first == key; ++it) {
+      if (it->second != user) {
+        users->push_back(it->second);
+      }
+    }
+  }
+  std::sort(users->begin(), users->end());
+  users->erase(std::unique(users->begin(), users->end()), users->end());
+}
@@ -0,0 +1,81 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LSH_INDEX_H_
+#define LSH_INDEX_H_
+
+#include <dataset.h>
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Locality-sensitive hashing index of the users of a dataset. Each user is
+// represented by the (sparse) vector of all its scores, indexed by item and
+// criterion, and hashed into a bucket of each table using random
+// projections of that vector. Users that share some bucket with a given
+// user are candidates to be its neighbours.
+class LSHIndex {
+ public:
+  enum Family {
+    // Signs of the projections (for the cosine similarity).
+    SIGNED_PROJECTIONS,
+    // Quantized projections on Gaussian (2-stable) directions of the
+    // normalized vectors (for the Euclidean distance).
+    GAUSSIAN_PROJECTIONS,
+    // Quantized projections on Cauchy (1-stable) directions of the
+    // normalized vectors (for the Manhattan distance).
+    CAUCHY_PROJECTIONS
+  };
+
+  LSHIndex();
+
+  // Builds 'tables' hash tables with 'bits' projections each (at most 64
+  // for SIGNED_PROJECTIONS). 'bucket_width' is the quantization step of
+  // the p-stable families. The random projections only depend on 'seed'.
+  void build(const Dataset& data, Family family, uint32_t tables,
+             uint32_t bits, float bucket_width, uint64_t seed,
+             uint32_t threads);
+  void clear();
+  inline bool empty() const { return tables_ == 0; }
+
+  // Stores in 'users' the users that share some bucket with 'user' (never
+  // 'user' itself), in increasing order.
+  void candidates(uint32_t user, std::vector<uint32_t>* users) const;
+  // Whether user1 and user2 share some bucket.
+  inline bool share_bucket(uint32_t user1, uint32_t user2) const {
+    if (user1 >= users_ || user2 >= users_) {
+      return false;
+    }
+    const uint64_t* k1 = &user_key_[static_cast<size_t>(user1) * tables_];
+    const uint64_t* k2 = &user_key_[static_cast<size_t>(user2) * tables_];
+    for (uint32_t t = 0; t < tables_; ++t) {
+      if (k1[t] == k2[t]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  uint32_t tables_;
+  uint32_t users_;
+  // Key of each user in each table (tables_ keys per user).
+  std::vector<uint64_t> user_key_;
+  // Pairs (key, user) of each table (users_ pairs per table), sorted.
+  std::vector<std::pair<uint64_t, uint32_t> > buckets_;
+};
+
+#endif  // LSH_INDEX_H_
@@ -0,0 +1,133 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// This program is used to recommend the top-N items to some users (or all
+// of them) using a trained PMF model. For each user and recommended item, a
+// line "user item score" is printed, by decreasing score. If the model has a
+// MIPS index, only the items of some partitions are scored, and the recall
+// with respect to the exact recommendations can be reported.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pmf-model.h>
+
+DEFINE_string(mfile, "", "Model configuration file");
+DEFINE_string(users, "", "Comma-separated list of users (empty = all users)");
+DEFINE_uint64(n, 10, "Number of items to recommend to each user");
+DEFINE_bool(exclude_rated, true, "Do not recommend the items already rated");
+DEFINE_string(weights, "", "Comma-separated weights of the criteria used to "
+              "rank the items (empty = same weight for all the criteria)");
+DEFINE_int64(probes, -1, "Partitions of the MIPS index to probe (0 = score "
+             "all the items, -1 = the value stored in the model)");
+DEFINE_bool(recall, false, "Report the recall of the MIPS index with respect "
+            "to the exact recommendations");
+DEFINE_uint64(threads, 0, "Number of threads (0 = number of CPUs)");
+
+std::default_random_engine PRNG;
+
+template <typename T>
+std::vector<T> parse_list(const std::string& str) {
+  std::vector<T> values;
+  std::istringstream iss(str);
+  std::string token;
+  while (std::getline(iss, token, ',')) {
+    std::istringstream itoken(token);
+    T value;
+    CHECK(itoken >> value) << "Invalid value: \"" << token << "\"";
+    values.push_back(value);
+  }
+  return values;
+}
+
+// Recommends FLAGS_n items to each user, logging the throughput.
+void recommend(const PMFModel& model, const std::vector<uint32_t>& users,
+               std::vector<PMFModel::Recommendations>* recs) {
+  const auto t1 = std::chrono::steady_clock::now();
+  model.recommend(users, FLAGS_n, FLAGS_exclude_rated, recs);
+  const auto t2 = std::chrono::steady_clock::now();
+  const float secs = std::chrono::duration<float>(t2 - t1).count();
+  LOG(INFO) << "Recommended " << FLAGS_n << " items to " << users.size()
+            << " users in " << secs << " seconds ("
+            << users.size() / secs << " users/second)";
+}
+
+int main(int argc, char ** argv) {
+  // Google tools initialization
+  google::InitGoogleLogging(argv[0]);
+  google::SetUsageMessage(
+      "This program is used to recommend items using a trained PMF model.\n"
+      "Usage: " + std::string(argv[0]) + " -mfile pmf_model [-users 1,2,3]"
+      " [-n 10]");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  // Check flags
+  CHECK_NE(FLAGS_mfile, "") << "A model configuration file must be specified.";
+  PMFModel model;
+  model.set_threads(FLAGS_threads);
+  CHECK(model.load(FLAGS_mfile));
+  LOG(INFO) << "Model config:\n" << model.info();
+  model.set_criteria_weights(parse_list<float>(FLAGS_weights));
+  // Users to recommend to
+  std::vector<uint32_t> users = parse_list<uint32_t>(FLAGS_users);
+  if (users.empty()) {
+    for (uint32_t u = 0; u < model.users(); ++u) {
+      users.push_back(u);
+    }
+  }
+  if (FLAGS_probes >= 0) {
+    model.set_mips_probes(FLAGS_probes);
+  }
+  std::vector<PMFModel::Recommendations> recs;
+  recommend(model, users, &recs);
+  if (FLAGS_recall) {
+    std::vector<PMFModel::Recommendations> exact_recs;
+    model.set_mips_probes(0);
+    recommend(model, users, &exact_recs);
+    size_t found = 0, total = 0;
+    for (size_t k = 0; k < users.size(); ++k) {
+      std::vector<uint32_t> items, exact_items;
+      for (const std::pair<float, uint32_t>& r : recs[k]) {
+        items.push_back(r.second);
+      }
+      for (const std::pair<float, uint32_t>& r : exact_recs[k]) {
+        exact_items.push_back(r.second);
+      }
+      std::sort(items.begin(), items.end());
+      std::sort(exact_items.begin(), exact_items.end());
+      std::vector<uint32_t> common;
+      std::set_intersection(items.begin(), items.end(), exact_items.begin(),
+                            exact_items.end(), std::back_inserter(common));
+      found += common.size();
+      total += exact_items.size();
+    }
+    LOG(INFO) << "Recall: " << (total > 0 ? found / double(total) : 1.0);
+  }
+  for (size_t k = 0; k < users.size(); ++k) {
+    for (const std::pair<float, uint32_t>& r : recs[k]) {
+      printf("%u %u %f\n", users[k], r.second, r.first);
+    }
+  }
+  return 0;
+}
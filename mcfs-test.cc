@@ -23,6 +23,7 @@
 #include <random>
 
 #include <dataset.h>
+#include <item-neighbours-model.h>
 #include <model.h>
 #include <neighbours-model.h>
 #include <pmf-model.h>
@@ -32,6 +33,9 @@ DEFINE_string(mtype, "neighbours", "Model type");
 DEFINE_string(mfile, "", "Model configuration file");
 DEFINE_string(test, "", "Train data partition");
 DEFINE_uint64(seed, 0, "Pseudo-random number generator seed");
+DEFINE_uint64(threads, 0, "Number of threads (0 = number of CPUs)");
+DEFINE_bool(int8, false, "Use the int8 quantized factors of a PMF model and "
+            "report the RMSE difference with respect to the float factors");
 
 std::default_random_engine PRNG;
 
@@ -52,17 +56,32 @@ int main(int argc, char ** argv) {
   Model * model;
   if (FLAGS_mtype == "neighbours") {
     model = CHECK_NOTNULL(new NeighboursModel());
+  } else if (FLAGS_mtype == "item-neighbours") {
+    model = CHECK_NOTNULL(new ItemNeighboursModel());
   } else if (FLAGS_mtype == "pmf") {
     model = CHECK_NOTNULL(new PMFModel());
   } else {
     LOG(FATAL) << "Unknown model type: \"" << FLAGS_mtype << "\"";
   }
+  model->set_threads(FLAGS_threads);
   CHECK(model->load(FLAGS_mfile));
   LOG(INFO) << "Model config:\n" << model->info();
   // Test the model
   Dataset test_partition;
   CHECK(test_partition.load(FLAGS_test));
-  printf("Test RMSE: %f\n", model->test(test_partition));
+  if (FLAGS_int8) {
+    CHECK_EQ(FLAGS_mtype, "pmf") << "Only PMF models have int8 factors.";
+    PMFModel* pmf_model = static_cast<PMFModel*>(model);
+    pmf_model->set_int8_factors(true);
+    const float int8_rmse = model->test(test_partition);
+    pmf_model->set_int8_factors(false);
+    const float fp32_rmse = model->test(test_partition);
+    printf("Test RMSE: %f\n", int8_rmse);
+    printf("Float factors test RMSE: %f (int8 delta = %f)\n", fp32_rmse,
+           int8_rmse - fp32_rmse);
+  } else {
+    printf("Test RMSE: %f\n", model->test(test_partition));
+  }
   delete model;
   return 0;
 }
@@ -24,6 +24,7 @@
 #include <random>
 
 #include <dataset.h>
+#include <item-neighbours-model.h>
 #include <model.h>
 #include <neighbours-model.h>
 #include <pmf-model.h>
@@ -35,6 +36,7 @@ DEFINE_string(mfile, "", "Path to the output model file");
 DEFINE_string(train, "", "Train data partition");
 DEFINE_string(valid, "", "Validation data partition");
 DEFINE_uint64(seed, 0, "Pseudo-random number generator seed");
+DEFINE_uint64(threads, 0, "Number of threads (0 = number of CPUs)");
 
 std::default_random_engine PRNG;
 
@@ -55,11 +57,14 @@ int main(int argc, char ** argv) {
   Model * model;
   if (FLAGS_mtype == "neighbours") {
     model = CHECK_NOTNULL(new NeighboursModel());
+  } else if (FLAGS_mtype == "item-neighbours") {
+    model = CHECK_NOTNULL(new ItemNeighboursModel());
   } else if (FLAGS_mtype == "pmf") {
     model = CHECK_NOTNULL(new PMFModel());
   } else {
     LOG(FATAL) << "Unknown model type: \"" << FLAGS_mtype << "\"";
   }
+  model->set_threads(FLAGS_threads);
   // Configure the hyperparameters of the model
   if (FLAGS_mconf != "") {
     CHECK(model->load_string(FLAGS_mconf));
@@ -0,0 +1,244 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <mips-index.h>
+
+#include <glog/logging.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <random>
+#include <thread>
+#include <utility>
+
+// Number of items that each thread assigns to the centroids at once.
+static const uint32_t kAssignBlock = 1024;
+
+MIPSIndex::MIPSIndex() : dims_(0), partitions_(0) {}
+
+void MIPSIndex::clear() {
+  dims_ = 0;
+  partitions_ = 0;
+  centroids_.clear();
+  centroids_norm2_.clear();
+  offset_.clear();
+  item_.clear();
+}
+
+void MIPSIndex::init_norms() {
+  centroids_norm2_.assign(partitions_, 0.0f);
+  for (uint32_t p = 0; p < partitions_; ++p) {
+    const float* cp = &centroids_[static_cast<size_t>(p) * dims_];
+    for (uint32_t d = 0; d < dims_; ++d) {
+      centroids_norm2_[p] += cp[d] * cp[d];
+    }
+  }
+}
+
+void MIPSIndex::build(const float* factors, uint32_t items, uint32_t dims,
+                      uint32_t partitions, uint32_t iters, uint64_t seed,
+                      uint32_t threads) {
+  CHECK_NOTNULL(factors);
+  CHECK_GT(dims, 0);
+  CHECK_GT(partitions, 0);
+  clear();
+  if (items == 0) {
+    return;
+  }
+  dims_ = dims + 1;
+  partitions_ = std::min(partitions, items);
+  // Augmented items
+  std::vector<float> x(static_cast<size_t>(items) * dims_);
+  std::vector<float> norm2(items, 0.0f);
+  float max_norm2 = 0.0f;
+  for (uint32_t j = 0; j < items; ++j) {
+    const float* fj = factors + static_cast<size_t>(j) * dims;
+    float* xj = &x[static_cast<size_t>(j) * dims_];
+    for (uint32_t d = 0; d < dims; ++d) {
+      xj[d] = fj[d];
+      norm2[j] += fj[d] * fj[d];
+    }
+    max_norm2 = std::max(max_norm2, norm2[j]);
+  }
+  for (uint32_t j = 0; j < items; ++j) {
+    x[static_cast<size_t>(j) * dims_ + dims] =
+        sqrt(std::max(max_norm2 - norm2[j], 0.0f));
+  }
+  // The initial centroids are random (different) items
+  std::vector<uint32_t> perm(items);
+  for (uint32_t j = 0; j < items; ++j) perm[j] = j;
+  std::default_random_engine prng(seed);
+  std::shuffle(perm.begin(), perm.end(), prng);
+  centroids_.resize(static_cast<size_t>(partitions_) * dims_);
+  for (uint32_t p = 0; p < partitions_; ++p) {
+    std::copy(x.begin() + static_cast<size_t>(perm[p]) * dims_,
+              x.begin() + static_cast<size_t>(perm[p] + 1) * dims_,
+              centroids_.begin() + static_cast<size_t>(p) * dims_);
+  }
+  // k-means: the assignment of the items is done in parallel, the update of
+  // the centroids is cheap. The last iteration only assigns the items.
+  std::vector<uint32_t> assign(items, partitions_);
+  std::vector<float> sum(centroids_.size());
+  std::vector<uint32_t> count(partitions_);
+  for (uint32_t it = 0; it <= iters; ++it) {
+    init_norms();
+    std::atomic<uint32_t> next_block(0);
+    std::atomic<uint32_t> changes(0);
+    auto worker = [&]() {
+      for (uint32_t b = next_block++ * kAssignBlock; b < items;
+           b = next_block++ * kAssignBlock) {
+        const uint32_t e = std::min(b + kAssignBlock, items);
+        uint32_t block_changes = 0;
+        for (uint32_t j = b; j < e; ++j) {
+          // |x - c|^2 = |x|^2 + |c|^2 - 2 x * c, with |x|^2 constant
+          const float* xj = &x[static_cast<size_t>(j) * dims_];
+          float best = std::numeric_limits<float>::max();
+          uint32_t best_p = 0;
+          for (uint32_t p = 0; p < partitions_; ++p) {
+            const float* cp = &centroids_[static_cast<size_t>(p) * dims_];
+            float dot = 0.0f;
+            for (uint32_t d = 0; d < dims_; ++d) {
+              dot += xj[d] * cp[d];
+            }
+            const float dist = centroids_norm2_[p] - 2.0f * dot;
+            if (dist < best) {
+              best = dist;
+              best_p = p;
+            }
+          }
+          if (assign[j] != best_p) {
+            assign[j] = best_p;
+            ++block_changes;
+          }
+        }
+        changes += block_changes;
+      }
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < std::max(threads, 1u); ++t) {
+      workers.push_back(std::thread(worker));
+    }
+    for (std::thread& w : workers) w.join();
+    DLOG(INFO) << "MIPSIndex: k-means iteration " << it << ", " << changes
+               << " items changed of partition.";
+    if (it == iters || changes == 0) {
+      break;
+    }
+    // Move each centroid to the mean of its items (the empty partitions keep
+    // their centroid).
+    std::fill(sum.begin(), sum.end(), 0.0f);
+    std::fill(count.begin(), count.end(), 0);
+    for (uint32_t j = 0; j < items; ++j) {
+      const float* xj = &x[static_cast<size_t>(j) * dims_];
+      float* sp = &sum[static_cast<size_t>(assign[j]) * dims_];
+      for (uint32_t d = 0; d < dims_; ++d) {
+        sp[d] += xj[d];
+      }
+      ++count[assign[j]];
+    }
+    for (uint32_t p = 0; p < partitions_; ++p) {
+      if (count[p] == 0) {
+        continue;
+      }
+      for (uint32_t d = 0; d < dims_; ++d) {
+        centroids_[static_cast<size_t>(p) * dims_ + d] =
+            sum[static_cast<size_t>(p) * dims_ + d] / count[p];
+      }
+    }
+  }
+  // Store the items of each partition in CSR format
+  offset_.assign(partitions_ + 1, 0);
+  for (uint32_t j = 0; j < items; ++j) {
+    ++offset_[assign[j] + 1];
+  }
+  for (uint32_t p = 0; p < partitions_; ++p) {
+    offset_[p + 1] += offset_[p];
+  }
+  item_.resize(items);
+  std::vector<uint32_t> pos(offset_.begin(), offset_.end() - 1);
+  for (uint32_t j = 0; j < items; ++j) {
+    item_[pos[assign[j]]++] = j;
+  }
+}
+
+void MIPSIndex::candidates(const float* query, uint32_t probes,
+                           std::vector<uint32_t>* items) const {
+  CHECK_NOTNULL(query);
+  CHECK_NOTNULL(items);
+  items->clear();
+  if (partitions_ == 0 || probes == 0) {
+    return;
+  }
+  // The augmented query has a 0 in the last dimension, so the distance to
+  // each centroid only depends on the first dims_ - 1 dimensions (and on the
+  // norm of the centroid).
+  std::vector<std::pair<float, uint32_t> > score(partitions_);
+  for (uint32_t p = 0; p < partitions_; ++p) {
+    const float* cp = &centroids_[static_cast<size_t>(p) * dims_];
+    float dot = 0.0f;
+    for (uint32_t d = 0; d + 1 < dims_; ++d) {
+      dot += query[d] * cp[d];
+    }
+    score[p] = std::make_pair(dot - 0.5f * centroids_norm2_[p], p);
+  }
+  probes = std::min(probes, partitions_);
+  std::partial_sort(score.begin(), score.begin() + probes, score.end(),
+                    std::greater<std::pair<float, uint32_t> >());
+  for (uint32_t k = 0; k < probes; ++k) {
+    const uint32_t p = score[k].second;
+    items->insert(items->end(), item_.begin() + offset_[p],
+                  item_.begin() + offset_[p + 1]);
+  }
+  std::sort(items->begin(), items->end());
+}
+
+void MIPSIndex::save(PMFModelConfig_MIPSIndex* config) const {
+  CHECK_NOTNULL(config);
+  config->Clear();
+  for (const float c : centroids_) config->add_centroids(c);
+  for (const uint32_t o : offset_) config->add_offset(o);
+  for (const uint32_t j : item_) config->add_item(j);
+}
+
+bool MIPSIndex::load(const PMFModelConfig_MIPSIndex& config, uint32_t items,
+                     uint32_t dims) {
+  clear();
+  // The augmented vectors have dims + 1 values
+  bool valid = config.offset_size() >= 2 && config.offset(0) == 0 &&
+      config.offset(config.offset_size() - 1) ==
+      static_cast<uint32_t>(config.item_size()) &&
+      config.centroids_size() ==
+      static_cast<int64_t>(config.offset_size() - 1) * (dims + 1);
+  for (int p = 1; valid && p < config.offset_size(); ++p) {
+    valid = config.offset(p - 1) <= config.offset(p);
+  }
+  for (int k = 0; valid && k < config.item_size(); ++k) {
+    valid = config.item(k) < items;
+  }
+  if (!valid) {
+    LOG(ERROR) << "MIPSIndex: Invalid index.";
+    return false;
+  }
+  partitions_ = config.offset_size() - 1;
+  dims_ = dims + 1;
+  centroids_.assign(config.centroids().begin(), config.centroids().end());
+  offset_.assign(config.offset().begin(), config.offset().end());
+  item_.assign(config.item().begin(), config.item().end());
+  init_norms();
+  return true;
+}
@@ -0,0 +1,73 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MIPS_INDEX_H_
+#define MIPS_INDEX_H_
+
+#include <protos/pmf-model.pb.h>
+
+#include <stdint.h>
+#include <vector>
+
+using mcfs::protos::PMFModelConfig_MIPSIndex;
+
+// Approximate maximum inner product search (MIPS) index of a set of item
+// factors. Each item x is augmented with an extra dimension sqrt(F^2 -
+// |x|^2), where F is the maximum norm of the items, so that all of them have
+// norm F and, for a query q (augmented with a 0), the items with the highest
+// inner product q * x are the nearest ones. The augmented items are
+// partitioned with k-means, and a query only looks at the items of the
+// partitions with the nearest centroids.
+class MIPSIndex {
+ public:
+  MIPSIndex();
+
+  // Builds the index of the 'items' vectors of 'dims' factors, stored one
+  // after the other, with the given number of partitions (at most one per
+  // item) and iterations of k-means. The initial centroids only depend on
+  // 'seed'.
+  void build(const float* factors, uint32_t items, uint32_t dims,
+             uint32_t partitions, uint32_t iters, uint64_t seed,
+             uint32_t threads);
+  void clear();
+  inline bool empty() const { return partitions_ == 0; }
+
+  // Stores in 'items' the items of the 'probes' partitions whose centroids
+  // have the highest inner product with 'query' (minus half their squared
+  // norm, i.e. the nearest ones), in increasing order.
+  void candidates(const float* query, uint32_t probes,
+                  std::vector<uint32_t>* items) const;
+
+  void save(PMFModelConfig_MIPSIndex* config) const;
+  // Loads an index of 'items' vectors of 'dims' factors. Returns false if
+  // the stored index does not match them or is corrupted.
+  bool load(const PMFModelConfig_MIPSIndex& config, uint32_t items,
+            uint32_t dims);
+
+ private:
+  // Dimension of the augmented vectors (factors + 1).
+  uint32_t dims_;
+  uint32_t partitions_;
+  // Centroids of the partitions (dims_ values each) and their squared norms.
+  std::vector<float> centroids_;
+  std::vector<float> centroids_norm2_;
+  // Items of each partition, sorted.
+  std::vector<uint32_t> offset_;
+  std::vector<uint32_t> item_;
+
+  void init_norms();
+};
+
+#endif  // MIPS_INDEX_H_
@@ -17,9 +17,19 @@
 
 #include <defines.h>
 
+#include <algorithm>
+#include <thread>
+
 float Model::test(const Dataset& test_set) const {
   Dataset pred_ratings = test_set;
   pred_ratings.erase_scores();
-  CLOCK(this->test(&pred_ratings.mutable_ratings()));
+  CLOCK(this->test(&pred_ratings));
   return Dataset::rmse(test_set, pred_ratings);
 }
+
+uint32_t Model::threads() const {
+  if (threads_ > 0) {
+    return threads_;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
@@ -23,16 +23,24 @@
 
 class Model {
  public:
+  Model() : threads_(0) {}
   virtual ~Model() {}
 
   virtual std::string info() const = 0;
   virtual bool load(const std::string& filename) = 0;
   virtual bool load_string(const std::string& str) = 0;
   virtual float test(const Dataset& test_set) const;
-  virtual void test(std::vector<Dataset::Rating>* users_items) const = 0;
+  virtual void test(Dataset* users_items) const = 0;
   virtual float train(const Dataset& train_set, const Dataset& valid_set) = 0;
   virtual bool save(const std::string& filename) const = 0;
   virtual bool save_string(std::string* str) const = 0;
+
+  // Number of threads used by the model (0 = number of CPUs).
+  void set_threads(uint32_t threads) { threads_ = threads; }
+  uint32_t threads() const;
+
+ private:
+  uint32_t threads_;
 };
 
 #endif  // MODEL_H_
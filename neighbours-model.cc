@@ -24,10 +24,14 @@
 #include <protos/model.pb.h>
 #include <protos/ratings.pb.h>
 #include <similarities.h>
+#include <similarity-matrix.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
-#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
 
 using google::protobuf::TextFormat;
@@ -37,17 +41,31 @@ using google::protobuf::io::FileOutputStream;
 using mcfs::protos::ModelConfig;
 using mcfs::protos::NeighboursModelConfig;
 using mcfs::protos::NeighboursModelConfig_Similarity_COSINE;
-using mcfs::protos::NeighboursModelConfig_Similarity_COSINE_SQRT;
-using mcfs::protos::NeighboursModelConfig_Similarity_COSINE_POW2;
-using mcfs::protos::NeighboursModelConfig_Similarity_COSINE_EXPO;
-using mcfs::protos::NeighboursModelConfig_Similarity_INV_NORM_P1;
-using mcfs::protos::NeighboursModelConfig_Similarity_INV_NORM_P2;
-using mcfs::protos::NeighboursModelConfig_Similarity_INV_NORM_PI;
-using mcfs::protos::NeighboursModelConfig_Similarity_I_N_P1_EXPO;
-using mcfs::protos::NeighboursModelConfig_Similarity_I_N_P2_EXPO;
-using mcfs::protos::NeighboursModelConfig_Similarity_I_N_PI_EXPO;
 using mcfs::protos::Ratings_Precision_INT;
 
+// Maximum number of similarities memoized during the test (~12 bytes each).
+static const uint64_t kMaxCachedSimilarities = 1 << 22;
+// Minimum number of ratings of a user to predict to compute at once its
+// similarities with all the other users.
+static const size_t kMinOneVsAll = 2;
+
+
+NeighboursModel::NeighboursModel()
+    : K_(0), max_neighbours_(0), lsh_tables_(0), lsh_bits_(8),
+      lsh_bucket_width_(1.0f), lsh_seed_(0), sparse_product_(false),
+      bitmap_density_(-1.0f) {
+  set_similarity(NeighboursModelConfig_Similarity_COSINE);
+}
+
+bool NeighboursModel::set_similarity(
+    NeighboursModelConfig_Similarity similarity) {
+  KernelSelector selector = { this };
+  if (!visit_similarity_kernel(similarity, &selector)) {
+    return false;
+  }
+  similarity_code_ = similarity;
+  return true;
+}
 
 bool NeighboursModel::load_string(const std::string& str) {
   NeighboursModelConfig config;
@@ -88,41 +106,65 @@ bool NeighboursModel::load(const NeighboursModelConfig& config) {
     return false;
   }
   K_ = config.k();
-  similarity_code_ = config.similarity();
-  switch (similarity_code_) {
-    case NeighboursModelConfig_Similarity_COSINE:
-      similarity_ = &StaticCosineSimilarity;
-      break;
-    case NeighboursModelConfig_Similarity_COSINE_SQRT:
-      similarity_ = &StaticCosineSqrtSimilarity;
-      break;
-    case NeighboursModelConfig_Similarity_COSINE_POW2:
-      similarity_ = &StaticCosinePow2Similarity;
-      break;
-    case NeighboursModelConfig_Similarity_COSINE_EXPO:
-      similarity_ = &StaticCosineExpSimilarity;
-      break;
-    case NeighboursModelConfig_Similarity_INV_NORM_P1:
-      similarity_ = &StaticNormSimilarityP1;
-      break;
-    case NeighboursModelConfig_Similarity_INV_NORM_P2:
-      similarity_ = &StaticNormSimilarityP2;
-      break;
-    case NeighboursModelConfig_Similarity_INV_NORM_PI:
-      similarity_ = &StaticNormSimilarityPI;
-      break;
-    case NeighboursModelConfig_Similarity_I_N_P1_EXPO:
-      similarity_ = &StaticNormExpSimilarityP1;
-      break;
-    case NeighboursModelConfig_Similarity_I_N_P2_EXPO:
-      similarity_ = &StaticNormExpSimilarityP2;
-      break;
-    case NeighboursModelConfig_Similarity_I_N_PI_EXPO:
-      similarity_ = &StaticNormExpSimilarityPI;
-      break;
-    default:
-      LOG(ERROR) << "Unknown similarity code " << similarity_code_;
+  max_neighbours_ = config.max_neighbours();
+  if (!set_similarity(config.similarity())) {
+    return false;
+  }
+  lsh_tables_ = config.lsh_tables();
+  lsh_bits_ = config.lsh_bits();
+  lsh_bucket_width_ = config.lsh_bucket_width();
+  lsh_seed_ = config.lsh_seed();
+  if (lsh_tables_ > 0 && (lsh_bits_ == 0 || lsh_bucket_width_ <= 0.0f ||
+                          (lsh_bits_ > 64 && similarity_code_ <=
+                           NeighboursModelConfig::COSINE_EXPO))) {
+    LOG(ERROR) << "NeighboursModel: Invalid LSH configuration.";
+    return false;
+  }
+  sparse_product_ = config.sparse_product();
+  if (sparse_product_ &&
+      similarity_code_ > NeighboursModelConfig::COSINE_EXPO) {
+    LOG(ERROR) << "NeighboursModel: The sparse product only computes the "
+               << "COSINE family of similarities.";
+    return false;
+  }
+  bitmap_density_ = config.bitmap_density();
+  data_.set_bitmap_density(
+      bitmap_density_ >= 0.0f ? bitmap_density_ : kDefaultBitmapDensity);
+  lsh_.clear();
+  neighbours_offset_.clear();
+  neighbours_user_.clear();
+  neighbours_sim_.clear();
+  if (config.neighbours_size() > 0) {
+    if (static_cast<uint32_t>(config.neighbours_size()) != data_.users()) {
+      LOG(ERROR) << "NeighboursModel: Expected the neighbours of "
+                 << data_.users() << " users, found "
+                 << config.neighbours_size() << ".";
       return false;
+    }
+    neighbours_offset_.push_back(0);
+    for (const NeighboursModelConfig::Neighbours& n : config.neighbours()) {
+      if (n.user_size() != n.similarity_size()) {
+        LOG(ERROR) << "NeighboursModel: Neighbours and similarities sizes "
+                   << "do not match.";
+        return false;
+      }
+      for (const uint32_t v : n.user()) {
+        if (v >= data_.users()) {
+          LOG(ERROR) << "NeighboursModel: Unknown neighbour " << v << ".";
+          return false;
+        }
+      }
+      neighbours_user_.insert(neighbours_user_.end(),
+                              n.user().begin(), n.user().end());
+      neighbours_sim_.insert(neighbours_sim_.end(),
+                             n.similarity().begin(), n.similarity().end());
+      neighbours_offset_.push_back(neighbours_user_.size());
+    }
+  } else if (data_.ratings_size() > 0) {
+    build_lsh();
+    if (max_neighbours_ > 0) {
+      compute_neighbours();
+    }
   }
   return true;
 }
@@ -133,6 +175,23 @@ bool NeighboursModel::save(NeighboursModelConfig * config) const {
   }
   config->set_k(K_);
   config->set_similarity(similarity_code_);
+  config->set_max_neighbours(max_neighbours_);
+  config->set_lsh_tables(lsh_tables_);
+  config->set_lsh_bits(lsh_bits_);
+  config->set_lsh_bucket_width(lsh_bucket_width_);
+  config->set_lsh_seed(lsh_seed_);
+  config->set_sparse_product(sparse_product_);
+  config->set_bitmap_density(bitmap_density_);
+  for (size_t u = 0; u + 1 < neighbours_offset_.size(); ++u) {
+    NeighboursModelConfig::Neighbours* n = config->add_neighbours();
+    const uint32_t b = neighbours_offset_[u], e = neighbours_offset_[u + 1];
+    n->mutable_user()->Reserve(e - b);
+    n->mutable_similarity()->Reserve(e - b);
+    for (uint32_t i = b; i < e; ++i) {
+      n->add_user(neighbours_user_[i]);
+      n->add_similarity(neighbours_sim_[i]);
+    }
+  }
   return true;
 }
 
@@ -162,6 +221,15 @@ bool NeighboursModel::save(const std::string& filename) const {
 float NeighboursModel::train(const Dataset& train_set,
                              const Dataset& valid_set) {
   data_ = train_set;
+  data_.set_bitmap_density(
+      bitmap_density_ >= 0.0f ? bitmap_density_ : kDefaultBitmapDensity);
+  neighbours_offset_.clear();
+  neighbours_user_.clear();
+  neighbours_sim_.clear();
+  build_lsh();
+  if (max_neighbours_ > 0) {
+    compute_neighbours();
+  }
   LOG(INFO) << "Model config:\n" << info();
   const float valid_rmse = Model::test(valid_set);
   // The error on the training data is always 0.0 for this model
@@ -180,135 +248,408 @@ class UserPair {
       this->u1 = u2;
     }
   }
-  bool operator < (const UserPair& o) const {
-    return (u1 < o.u1 || (u1 == o.u1 && u2 < o.u2));
-  }
-  bool operator == (const UserPair& o) const {
-    return (u1 == o.u1 && u2 == o.u2);
-  }
-  bool operator != (const UserPair& o) const {
-    return (u1 != o.u1 || u2 != o.u2);
-  }
   uint32_t first() const {
     return u1;
   }
   uint32_t second() const {
     return u2;
   }
+  // Both users packed in a single integer. Never equal to ~0.
+  uint64_t key() const {
+    return (static_cast<uint64_t>(u1) << 32) | u2;
+  }
 
  private:
   uint32_t u1;
   uint32_t u2;
 };
 
-void NeighboursModel::test(std::vector<Rating>* test_set) const {
-  CHECK_NOTNULL(test_set);
-  std::map<UserPair, float> users_similarity;
-  // For each user_item to rate...
-  for (auto it = test_set->begin(); it != test_set->end(); ++it) {
-    Rating& pred_rating = *it;
-    // Get the users that rated the item
-    const std::vector<Rating*>& item_ratings =
-        data_.ratings_by_item(pred_rating.item);
-    if (item_ratings.size() == 0) {
-      LOG(WARNING) << "Item " << pred_rating.item << " not rated before.";
-      for (uint32_t c = 0; c < data_.criteria_size(); ++c) {
-        pred_rating.scores[c] = (data_.maxv(c) - data_.minv(c)) / 2.0f;
+// Memo of the similarities between pairs of users, shared by all the
+// threads. It is a fixed-size open-addressing hash table split in shards,
+// each one protected by its own mutex. When a shard gets 3/4 full it is
+// emptied, so the memory used never exceeds the initial capacity.
+class SimilarityCache {
+ public:
+  explicit SimilarityCache(uint64_t capacity) {
+    // Round up the size of each shard to a power of two
+    shard_size_ = 16;
+    while (shard_size_ * kShards < capacity) shard_size_ <<= 1;
+    for (uint32_t s = 0; s < kShards; ++s) {
+      shards_[s].keys.assign(shard_size_, kEmpty);
+      shards_[s].values.resize(shard_size_);
+      shards_[s].size = 0;
+    }
+  }
+  bool find(const UserPair& p, float* f) {
+    const uint64_t key = p.key(), h = hash(key);
+    Shard& shard = shards_[h >> (64 - kShardsBits)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (uint64_t i = h & (shard_size_ - 1); shard.keys[i] != kEmpty;
+         i = (i + 1) & (shard_size_ - 1)) {
+      if (shard.keys[i] == key) {
+        *f = shard.values[i];
+        return true;
       }
-      continue;
     }
-    // For each rating of the item ...
-    std::vector<std::pair<float, const Rating*> > weighted_ratings;
-    weighted_ratings.reserve(item_ratings.size());
-    const Rating* exact_match = NULL;
-    for (const Dataset::Rating* data_rating : item_ratings) {
-      if (data_rating->user == pred_rating.user) {
-        exact_match = data_rating;
-        break;
+    return false;
+  }
+  void insert(const UserPair& p, float f) {
+    const uint64_t key = p.key(), h = hash(key);
+    Shard& shard = shards_[h >> (64 - kShardsBits)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (4 * (shard.size + 1) > 3 * shard_size_) {
+      std::fill(shard.keys.begin(), shard.keys.end(), kEmpty);
+      shard.size = 0;
+    }
+    uint64_t i = h & (shard_size_ - 1);
+    for (; shard.keys[i] != kEmpty && shard.keys[i] != key;
+         i = (i + 1) & (shard_size_ - 1)) {}
+    if (shard.keys[i] == kEmpty) {
+      shard.keys[i] = key;
+      ++shard.size;
+    }
+    shard.values[i] = f;
+  }
+
+ private:
+  static const uint32_t kShardsBits = 6;
+  static const uint32_t kShards = 1 << kShardsBits;
+  static const uint64_t kEmpty = ~0ull;
+  struct Shard {
+    std::mutex mutex;
+    std::vector<uint64_t> keys;
+    std::vector<float> values;
+    uint64_t size;
+  };
+  // Final mixing step of MurmurHash3
+  static inline uint64_t hash(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+  }
+  Shard shards_[kShards];
+  uint64_t shard_size_;
+};
+
+const uint32_t SimilarityCache::kShardsBits;
+const uint32_t SimilarityCache::kShards;
+const uint64_t SimilarityCache::kEmpty;
+
+template <typename Kernel>
+void NeighboursModel::use_kernel() {
+  compute_neighbours_ = &NeighboursModel::compute_neighbours_with<Kernel>;
+  test_ = &NeighboursModel::test_with<Kernel>;
+}
+
+void NeighboursModel::build_lsh() {
+  lsh_.clear();
+  if (lsh_tables_ == 0) {
+    return;
+  }
+  // The hash family approximates the similarity in use: the angle between
+  // the users for the cosine family, and the distance between their
+  // normalized ratings for the INV_NORM family (the 1-norm with Cauchy
+  // projections, the other norms with Gaussian ones).
+  LSHIndex::Family family = LSHIndex::GAUSSIAN_PROJECTIONS;
+  if (similarity_code_ <= NeighboursModelConfig::COSINE_EXPO) {
+    family = LSHIndex::SIGNED_PROJECTIONS;
+  } else if (similarity_code_ == NeighboursModelConfig::INV_NORM_P1 ||
+             similarity_code_ == NeighboursModelConfig::I_N_P1_EXPO) {
+    family = LSHIndex::CAUCHY_PROJECTIONS;
+  }
+  lsh_.build(data_, family, lsh_tables_, lsh_bits_, lsh_bucket_width_,
+             lsh_seed_, threads());
+}
+
+void NeighboursModel::compute_neighbours() {
+  if (sparse_product_) {
+    compute_neighbours_by_product();
+  } else {
+    (this->*compute_neighbours_)();
+  }
+}
+
+void NeighboursModel::compute_neighbours_by_product() {
+  float (*transform)(float) = NULL;
+  switch (similarity_code_) {
+    case NeighboursModelConfig::COSINE:
+      break;
+    case NeighboursModelConfig::COSINE_SQRT:
+      transform = &SqrtTransform::apply;
+      break;
+    case NeighboursModelConfig::COSINE_POW2:
+      transform = &Pow2Transform::apply;
+      break;
+    case NeighboursModelConfig::COSINE_EXPO:
+      transform = &ExpTransform::apply;
+      break;
+    default:
+      LOG(FATAL) << "Unsupported similarity code " << similarity_code_;
+  }
+  SimilarityMatrix matrix(data_);
+  matrix.compute(true, transform, max_neighbours_, threads(),
+                 &neighbours_offset_, &neighbours_user_, &neighbours_sim_);
+  LOG(INFO) << "Computed " << neighbours_user_.size() << " neighbours of "
+            << data_.users() << " users.";
+}
+
+void NeighboursModel::test(Dataset* test_set) const {
+  (this->*test_)(test_set);
+}
+
+template <typename Kernel>
+void NeighboursModel::compute_neighbours_with() {
+  const uint32_t num_users = data_.users();
+  std::vector<WeightedRatings> neighbours(num_users);
+  std::atomic<uint32_t> next_user(0);
+  // Each thread takes the next user to process. For each user, the
+  // similarity is computed only against the users with some common rating
+  // (or against the candidates given by the LSH index).
+  auto worker = [this, num_users, &neighbours, &next_user]() {
+    std::vector<uint32_t> mark(num_users, 0);
+    std::vector<uint32_t> candidates;
+    for (uint32_t u = next_user++; u < num_users; u = next_user++) {
+      if (!lsh_.empty()) {
+        lsh_.candidates(u, &candidates);
+      } else {
+        candidates.clear();
+        for (const uint32_t r : data_.ratings_by_user(u)) {
+          for (const uint32_t r2 : data_.ratings_by_item(data_.item(r))) {
+            const uint32_t v = data_.user(r2);
+            if (v != u && mark[v] != u + 1) {
+              mark[v] = u + 1;
+              candidates.push_back(v);
+            }
+          }
+        }
       }
-      UserPair user_pair(pred_rating.user, data_rating->user);
-      float f = 0.0;
-      auto sim_it = users_similarity.find(user_pair);
-      if (sim_it == users_similarity.end()) {
-        // Get the common ratings between the test user and the rating owner
-        std::vector<float> v_u;
-        std::vector<float> v_i;
-        data_.get_scores_from_common_ratings_by_users(
-            pred_rating.user, data_rating->user, &v_u, &v_i);
-        // Compute similarity between users
-        f = (*similarity_)(v_u, v_i);
+      WeightedRatings& u_neighbours = neighbours[u];
+      for (const uint32_t v : candidates) {
+        const float f = user_similarity<Kernel>(data_, u, v);
         CHECK_EQ(std::isnan(f), 0);
-        users_similarity[user_pair] = f;
-      } else {
-        f = sim_it->second;
+        if (f > 0.0) {
+          u_neighbours.push_back(std::make_pair(f, v));
+        }
       }
-      DLOG(INFO) << "Sim(user " << pred_rating.user << ", user "
-        << data_rating->user << ") = " << f;
-      if (f > 0.0) {
-        std::pair<float, const Rating*> wrat(f, data_rating);
-        weighted_ratings.push_back(wrat);
+      if (u_neighbours.size() > max_neighbours_) {
+        std::partial_sort(u_neighbours.begin(),
+                          u_neighbours.begin() + max_neighbours_,
+                          u_neighbours.end(),
+                          std::greater<std::pair<float, uint32_t> >());
+        u_neighbours.resize(max_neighbours_);
+        u_neighbours.shrink_to_fit();
+      } else {
+        std::sort(u_neighbours.begin(), u_neighbours.end(),
+                  std::greater<std::pair<float, uint32_t> >());
       }
     }
-    // Check if the desired prediction was in the training set.
-    if (exact_match != NULL) {
-      pred_rating.scores = exact_match->scores;
-      continue;
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+  // Store the lists in CSR format
+  neighbours_offset_.assign(1, 0);
+  neighbours_user_.clear();
+  neighbours_sim_.clear();
+  for (const WeightedRatings& u_neighbours : neighbours) {
+    for (const std::pair<float, uint32_t>& n : u_neighbours) {
+      neighbours_sim_.push_back(n.first);
+      neighbours_user_.push_back(n.second);
     }
-    // Check if there is enough data to make the desired prediction.
-    if (weighted_ratings.size() == 0) {
-      LOG(WARNING) << "User " << pred_rating.user
-                   << " have not any common rating"
-                   << " with users that rated item "
-                   << pred_rating.item << ".";
-      continue;
+    neighbours_offset_.push_back(neighbours_user_.size());
+  }
+  LOG(INFO) << "Computed " << neighbours_user_.size() << " neighbours of "
+            << num_users << " users.";
+}
+
+template <typename Kernel>
+void NeighboursModel::test_with(Dataset* test_set) const {
+  CHECK_NOTNULL(test_set);
+  // The similarities are only memoized when they are not precomputed.
+  const uint64_t num_pairs =
+      static_cast<uint64_t>(data_.users()) * data_.users() / 2;
+  std::unique_ptr<SimilarityCache> users_similarity;
+  if (neighbours_offset_.empty()) {
+    users_similarity.reset(new SimilarityCache(
+        std::min<uint64_t>(num_pairs + num_pairs / 2, kMaxCachedSimilarities)));
+  }
+  // Group the ratings to predict by user.
+  std::vector<size_t> order(test_set->ratings_size());
+  for (size_t t = 0; t < order.size(); ++t) order[t] = t;
+  std::stable_sort(order.begin(), order.end(),
+                   [test_set](size_t a, size_t b) {
+                     return test_set->user(a) < test_set->user(b);
+                   });
+  std::vector<size_t> groups;
+  for (size_t t = 0; t < order.size(); ++t) {
+    if (t == 0 || test_set->user(order[t]) != test_set->user(order[t - 1])) {
+      groups.push_back(t);
     }
-    // Sort the ratings of the item by neighbour's similarity
-    std::sort(weighted_ratings.begin(), weighted_ratings.end(),
-              std::greater<std::pair<float, const Rating*> >());
-    // Determine the maximum number of neighbours to use in the prediction
-    const uint32_t max_neighbours =
-        K_ == 0 ? weighted_ratings.size() : std::min<uint32_t>(
-            K_, weighted_ratings.size());
-    if (std::isinf(weighted_ratings[0].first)) {
-      // Compute the predicted rating where there are users with
-      // similarity = INFINITY
-      // In this case, the predicted rating is the average
-      // among those users.
-      // 'r' stores the number of users with similarity = INFINITY
-      uint32_t r = 0;
-      for (; r < max_neighbours && std::isinf(weighted_ratings[r].first); ++r) {
-        const Rating * rat = weighted_ratings[r].second;
-        for (uint32_t c = 0; c < rat->scores.size(); ++c) {
-          pred_rating.scores[c] += rat->scores[c];
-        }
+  }
+  groups.push_back(order.size());
+  // Each thread predicts all the ratings of the next user. Each prediction
+  // only writes on its own scores.
+  std::atomic<size_t> next_group(0);
+  auto worker = [this, test_set, &users_similarity, &order, &groups,
+                 &next_group]() {
+    WeightedRatings weighted_ratings;
+    OneVsAllSimilarity<Kernel> one_vs_all;
+    for (size_t g = next_group++; g + 1 < groups.size(); g = next_group++) {
+      const size_t b = groups[g], e = groups[g + 1];
+      // When the similarities are not precomputed, the similarities of a
+      // user with several ratings to predict are computed at once.
+      const uint32_t group_user = test_set->user(order[b]);
+      const bool use_one_vs_all = users_similarity && lsh_.empty() &&
+          e - b >= kMinOneVsAll && group_user < data_.users();
+      if (use_one_vs_all) {
+        one_vs_all.compute(data_, group_user);
       }
-      // Normalize rating
-      for (uint32_t c = 0; c < data_.criteria_size(); ++c) {
-        pred_rating.scores[c] /= r;
-        if (data_.precision(c) == Ratings_Precision_INT) {
-          pred_rating.scores[c] = round(pred_rating.scores[c]);
+      // For each user_item to rate...
+      for (size_t o = b; o < e; ++o) {
+        const size_t t = order[o];
+        const uint32_t pred_user = test_set->user(t);
+        const uint32_t pred_item = test_set->item(t);
+        float* pred_scores = test_set->mutable_scores(t);
+        // Get the users that rated the item
+        const Dataset::RatingsSpan item_ratings =
+            data_.ratings_by_item(pred_item);
+        if (item_ratings.size() == 0) {
+          LOG(WARNING) << "Item " << pred_item << " not rated before.";
+          for (uint32_t c = 0; c < data_.criteria_size(); ++c) {
+            pred_scores[c] = (data_.maxv(c) - data_.minv(c)) / 2.0f;
+          }
+          continue;
         }
-        CHECK_EQ(std::isinf(pred_rating.scores[c]), 0);
-      }
-    } else {
-      // Compute the predicted rating
-      float sum_f = 0.0f;
-      for (uint32_t r = 0; r < max_neighbours; ++r) {
-        const float f = weighted_ratings[r].first / weighted_ratings[0].first;
-        const Rating * rat = weighted_ratings[r].second;
-        sum_f += f;
-        for (uint32_t c = 0; c < rat->scores.size(); ++c) {
-          pred_rating.scores[c] += rat->scores[c] * f;
+        // Check if the desired prediction was in the training set.
+        size_t exact_match;
+        if (data_.find_rating(pred_user, pred_item, &exact_match)) {
+          const float* rat_scores = data_.scores(exact_match);
+          std::copy(rat_scores, rat_scores + data_.criteria_size(),
+                    pred_scores);
+          continue;
         }
-      }
-      // Normalize rating
-      for (uint32_t c = 0; c < data_.criteria_size(); ++c) {
-        pred_rating.scores[c] /= sum_f;
-        if (data_.precision(c) == Ratings_Precision_INT) {
-          pred_rating.scores[c] = round(pred_rating.scores[c]);
+        weighted_ratings.clear();
+        if (!users_similarity) {
+          // Take the most similar neighbours that rated the item. The lists
+          // are already sorted by decreasing similarity.
+          if (pred_user + 1 < neighbours_offset_.size()) {
+            for (uint32_t n = neighbours_offset_[pred_user];
+                 n < neighbours_offset_[pred_user + 1] &&
+                     (K_ == 0 || weighted_ratings.size() < K_); ++n) {
+              size_t r;
+              if (data_.find_rating(neighbours_user_[n], pred_item, &r)) {
+                weighted_ratings.push_back(
+                    std::make_pair(neighbours_sim_[n], r));
+              }
+            }
+          }
+        } else {
+          // For each rating of the item (by a user that shares some LSH
+          // bucket with the user, if there is an index) ...
+          weighted_ratings.reserve(item_ratings.size());
+          for (const uint32_t r : item_ratings) {
+            const uint32_t data_user = data_.user(r);
+            if (!lsh_.empty() && !lsh_.share_bucket(pred_user, data_user)) {
+              continue;
+            }
+            UserPair user_pair(pred_user, data_user);
+            float f = 0.0;
+            if (use_one_vs_all) {
+              f = one_vs_all.similarity(data_user);
+            } else if (!users_similarity->find(user_pair, &f)) {
+              // Compute similarity between users, from their common ratings
+              f = user_similarity<Kernel>(data_, pred_user, data_user);
+              CHECK_EQ(std::isnan(f), 0);
+              users_similarity->insert(user_pair, f);
+            }
+            DLOG(INFO) << "Sim(user " << pred_user << ", user "
+                       << data_user << ") = " << f;
+            if (f > 0.0) {
+              std::pair<float, uint32_t> wrat(f, r);
+              weighted_ratings.push_back(wrat);
+            }
+          }
+          // Select the K ratings of the item with the most similar owners,
+          // and sort them by similarity. Ties (i.e. several INFINITY
+          // similarities) are broken by rating index, so the selected
+          // ratings are the first K after sorting all of them.
+          if (K_ > 0 && weighted_ratings.size() > K_) {
+            std::nth_element(weighted_ratings.begin(),
+                             weighted_ratings.begin() + K_,
+                             weighted_ratings.end(),
+                             std::greater<std::pair<float, uint32_t> >());
+            weighted_ratings.resize(K_);
+          }
+          std::sort(weighted_ratings.begin(), weighted_ratings.end(),
+                    std::greater<std::pair<float, uint32_t> >());
+        }
+        // Check if there is enough data to make the desired prediction.
+        if (weighted_ratings.size() == 0) {
+          LOG(WARNING) << "User " << pred_user
+                       << " have not any common rating"
+                       << " with users that rated item "
+                       << pred_item << ".";
+          continue;
         }
-        CHECK_EQ(std::isinf(pred_rating.scores[c]), 0);
+        predict_from_neighbours(data_, weighted_ratings, pred_scores);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+}
+
+void predict_from_neighbours(const Dataset& data,
+                             const WeightedRatings& weighted_ratings,
+                             float* pred_scores) {
+  const uint32_t max_neighbours = weighted_ratings.size();
+  if (std::isinf(weighted_ratings[0].first)) {
+    // Compute the predicted rating where there are users with
+    // similarity = INFINITY
+    // In this case, the predicted rating is the average
+    // among those users.
+    // 'r' stores the number of users with similarity = INFINITY
+    uint32_t r = 0;
+    for (; r < max_neighbours && std::isinf(weighted_ratings[r].first); ++r) {
+      const float* rat_scores = data.scores(weighted_ratings[r].second);
+      for (uint32_t c = 0; c < data.criteria_size(); ++c) {
+        pred_scores[c] += rat_scores[c];
+      }
+    }
+    // Normalize rating
+    for (uint32_t c = 0; c < data.criteria_size(); ++c) {
+      pred_scores[c] /= r;
+      if (data.precision(c) == Ratings_Precision_INT) {
+        pred_scores[c] = round(pred_scores[c]);
       }
+      CHECK_EQ(std::isinf(pred_scores[c]), 0);
+    }
+  } else {
+    // Compute the predicted rating
+    float sum_f = 0.0f;
+    for (uint32_t r = 0; r < max_neighbours; ++r) {
+      const float f = weighted_ratings[r].first / weighted_ratings[0].first;
+      const float* rat_scores = data.scores(weighted_ratings[r].second);
+      sum_f += f;
+      for (uint32_t c = 0; c < data.criteria_size(); ++c) {
+        pred_scores[c] += rat_scores[c] * f;
+      }
+    }
+    // Normalize rating
+    for (uint32_t c = 0; c < data.criteria_size(); ++c) {
+      pred_scores[c] /= sum_f;
+      if (data.precision(c) == Ratings_Precision_INT) {
+        pred_scores[c] = round(pred_scores[c]);
+      }
+      CHECK_EQ(std::isinf(pred_scores[c]), 0);
     }
   }
 }
@@ -327,6 +668,15 @@ std::string NeighboursModel::info() const {
   snprintf(buff, BUFF_SIZE, "Similarity = %s\n",
            similarity_label[similarity_code_].c_str());
   msg += buff;
+  snprintf(buff, BUFF_SIZE, "Max. neighbours = %u\n", max_neighbours_);
+  msg += buff;
+  if (lsh_tables_ > 0) {
+    snprintf(buff, BUFF_SIZE, "LSH tables = %u, bits = %u\n",
+             lsh_tables_, lsh_bits_);
+    msg += buff;
+    snprintf(buff, BUFF_SIZE, "LSH bucket width = %g\n", lsh_bucket_width_);
+    msg += buff;
+  }
   msg += data_.info(0);
   return msg;
 }
@@ -17,22 +17,35 @@
 #define NEIGHBOURS_MODEL_H_
 
 #include <dataset.h>
+#include <lsh-index.h>
 #include <protos/neighbours-model.pb.h>
 #include <model.h>
-#include <similarities.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 using mcfs::protos::NeighboursModelConfig;
 using mcfs::protos::NeighboursModelConfig_Similarity;
 using mcfs::protos::NeighboursModelConfig_Similarity_COSINE;
 
+// Ratings of the nearest neighbours (rating indices in the training data),
+// weighted by the similarity of the neighbours.
+typedef std::vector<std::pair<float, uint32_t> > WeightedRatings;
+
+// Predicts the scores as the average of the weighted ratings, which must be
+// sorted by decreasing similarity. If some similarities are INFINITY, the
+// prediction is the plain average of those ratings.
+void predict_from_neighbours(const Dataset& data,
+                             const WeightedRatings& weighted_ratings,
+                             float* pred_scores);
+
 class NeighboursModel : public Model {
  public:
-  typedef Dataset::Rating Rating;
+  NeighboursModel();
+
   float train(const Dataset& train_set, const Dataset& valid_set);
-  void test(std::vector<Rating>* test_set) const;
+  void test(Dataset* test_set) const;
   bool save(const std::string& filename) const;
   bool load(const std::string& filename);
   bool save(NeighboursModelConfig * config) const;
@@ -41,14 +54,47 @@ class NeighboursModel : public Model {
   bool save_string(std::string* str) const;
   std::string info() const;
 
-NeighboursModel() : K_(0),
-      similarity_code_(NeighboursModelConfig_Similarity_COSINE),
-      similarity_(&StaticCosineSimilarity) {}
  private:
+  typedef void (NeighboursModel::*ComputeNeighboursFn)();
+  typedef void (NeighboursModel::*TestFn)(Dataset* test_set) const;
+
   Dataset data_;
   uint32_t K_;
+  uint32_t max_neighbours_;
   NeighboursModelConfig_Similarity similarity_code_;
-  const Similarity * similarity_;
+  // Instances of compute_neighbours_with() and test_with() for the
+  // similarity kernel in use, chosen by set_similarity().
+  ComputeNeighboursFn compute_neighbours_;
+  TestFn test_;
+  // Precomputed neighbours, in CSR format. The neighbours of user u are
+  // neighbours_user_[neighbours_offset_[u] .. neighbours_offset_[u + 1]),
+  // sorted by decreasing similarity. Empty if they were not computed.
+  std::vector<uint32_t> neighbours_offset_;
+  std::vector<uint32_t> neighbours_user_;
+  std::vector<float> neighbours_sim_;
+  // Locality-sensitive hashing index used to select the candidate
+  // neighbours. Empty if lsh_tables_ is 0.
+  uint32_t lsh_tables_;
+  uint32_t lsh_bits_;
+  float lsh_bucket_width_;
+  uint64_t lsh_seed_;
+  LSHIndex lsh_;
+  bool sparse_product_;
+  float bitmap_density_;
+
+  void build_lsh();
+  void compute_neighbours();
+  void compute_neighbours_by_product();
+  template <typename Kernel> void compute_neighbours_with();
+  template <typename Kernel> void test_with(Dataset* test_set) const;
+  template <typename Kernel> void use_kernel();
+  bool set_similarity(NeighboursModelConfig_Similarity similarity);
+
+  // Visitor of visit_similarity_kernel() that selects the kernel to use.
+  struct KernelSelector {
+    NeighboursModel* model;
+    template <typename Kernel> void visit() { model->use_kernel<Kernel>(); }
+  };
 };
 
 #endif  // NEIGHBOURS_MODEL_H_
@@ -22,19 +22,43 @@
 #endif
 #include <defines.h>
 #include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <glog/logging.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
 #include <random>
+#include <thread>
 
 using google::protobuf::TextFormat;
 using google::protobuf::io::FileInputStream;
 using google::protobuf::io::FileOutputStream;
+using mcfs::protos::PMFModelConfig_Optimizer_GAUSS_NEWTON;
+using mcfs::protos::PMFModelConfig_Optimizer_SGD;
+using mcfs::protos::PMFModelConfig_SGDSchedule_HOGWILD;
+using mcfs::protos::PMFModelConfig_SGDSchedule_STRATIFIED;
 
 extern std::default_random_engine PRNG;
 
+// Number of users whose scores are computed at once in recommend(), as the
+// product of their (kRecommendBlock x D) factors by the (D x M) item factors.
+static const uint32_t kRecommendBlock = 64;
+// Number of ratings predicted at once by each thread in test().
+static const size_t kTestBlock = 1024;
+// Minimum size of the factors HY of the users to predict the ratings grouped
+// by user in test().
+static const size_t kGroupByUserMinBytes = 4 << 20;
+// Number of rows whose Gauss-Newton steps are solved at once by each thread.
+static const size_t kSolveBlock = 256;
+
 void init_array_normal(float* mat, size_t n) {
   CHECK_NOTNULL(mat);
   DLOG(INFO) << "Matrix initialized using normal distribution.";
@@ -87,20 +111,84 @@ void print_mat(const std::string& name, const float* m,
 }
 #endif
 
-void sigmoid(const size_t N, float* x) {
+void sigmoid_scalar(const size_t N, float* x) {
   for (size_t i = 0; i < N; ++i) {
     x[i] = 1.0f / (1.0f + exp(-x[i]));
   }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// Sigmoid of blocks of 8 values, with exp() computed as in the Cephes
+// library: exp(x) = 2^n * exp(r), with |r| <= ln(2) / 2 and exp(r)
+// approximated by a polynomial (relative error about 1e-7).
+__attribute__((target("avx2,fma")))
+void sigmoid_avx2(const size_t N, float* x) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 max_x = _mm256_set1_ps(88.3762626647949f);
+  const __m256 min_x = _mm256_set1_ps(-88.3762626647949f);
+  const __m256 log2e = _mm256_set1_ps(1.44269504088896341f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 c1 = _mm256_set1_ps(0.693359375f);
+  const __m256 c2 = _mm256_set1_ps(-2.12194440e-4f);
+  const __m256 p0 = _mm256_set1_ps(1.9875691500e-4f);
+  const __m256 p1 = _mm256_set1_ps(1.3981999507e-3f);
+  const __m256 p2 = _mm256_set1_ps(8.3334519073e-3f);
+  const __m256 p3 = _mm256_set1_ps(4.1665795894e-2f);
+  const __m256 p4 = _mm256_set1_ps(1.6666665459e-1f);
+  const __m256 p5 = _mm256_set1_ps(5.0000001201e-1f);
+  size_t i = 0;
+  for (; i + 8 <= N; i += 8) {
+    // y = -x, clamped to the range where exp(y) is finite
+    __m256 y = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(x + i));
+    y = _mm256_max_ps(_mm256_min_ps(y, max_x), min_x);
+    // n = round(y / ln(2)), r = y - n * ln(2)
+    const __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(y, log2e, half));
+    __m256 r = _mm256_fnmadd_ps(n, c1, y);
+    r = _mm256_fnmadd_ps(n, c2, r);
+    // exp(r) = 1 + r + r^2 * P(r)
+    __m256 p = _mm256_fmadd_ps(p0, r, p1);
+    p = _mm256_fmadd_ps(p, r, p2);
+    p = _mm256_fmadd_ps(p, r, p3);
+    p = _mm256_fmadd_ps(p, r, p4);
+    p = _mm256_fmadd_ps(p, r, p5);
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, one));
+    // 2^n, built from the exponent bits
+    const __m256i e = _mm256_slli_epi32(
+        _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    const __m256 ey = _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+    _mm256_storeu_ps(x + i, _mm256_div_ps(one, _mm256_add_ps(one, ey)));
+  }
+  sigmoid_scalar(N - i, x + i);
+}
+#endif
+
+typedef void (*SigmoidKernel)(const size_t, float*);
+
+static SigmoidKernel select_sigmoid_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return &sigmoid_avx2;
+  }
+#endif
+  return &sigmoid_scalar;
+}
+
+static const SigmoidKernel kSigmoidKernel = select_sigmoid_kernel();
+
+// x = 1 / (1 + exp(-x)), with the fastest kernel supported by the CPU.
+void sigmoid(const size_t N, float* x) {
+  kSigmoidKernel(N, x);
+}
+
 // size(W) = M x D
 // size(H) = M x D
 void compute_H(const Dataset& data, const size_t D, const size_t N,
                const float* W, float* H) {
   memset(H, 0x00, sizeof(float) * D * N);
-  for (const Dataset::Rating& rat: data.ratings()) {
-    const uint32_t i = rat.user;
-    const uint32_t j = rat.item;
+  for (size_t r = 0; r < data.ratings_size(); ++r) {
+    const uint32_t i = data.user(r);
+    const uint32_t j = data.item(r);
     const float* Wj = W + j * D;  // select row j from W
     float * Hi = H + i * D;  // select row i from H
     cblas_saxpy(D, 1.0f, Wj, 1, Hi, 1);
@@ -197,7 +285,8 @@ float compute_loss(const Dataset& data, const size_t C, const size_t N,
   float loss = 0.0f;
   float* Zij = new float[C];
   // Basic Loss function computation
-  for (const Dataset::Rating& rat: data.ratings()) {
+  for (size_t r = 0; r < data.ratings_size(); ++r) {
+    const Dataset::Rating rat = data.rating(r);
     const uint32_t i = rat.user;
     const uint32_t j = rat.item;
     // Compute Zij
@@ -209,7 +298,7 @@ float compute_loss(const Dataset& data, const size_t C, const size_t N,
     // Zij = sigmoid(Zij) [Predicted rating]
     sigmoid(C, Zij);
     // Zij = Rij - Zij [Prediction error]
-    sxpay(C, -1.0f, rat.scores.data(), Zij);
+    sxpay(C, -1.0f, rat.scores, Zij);
     // Zij = Zij .^ 2 [Squared prediction error]
     sxpow2(C, Zij);
     loss += cblas_sasum(C, Zij, 1);
@@ -224,20 +313,163 @@ float compute_loss(const Dataset& data, const size_t C, const size_t N,
   return loss;
 }
 
-void compute_loss_grad(const Dataset& data, const size_t C, const size_t N,
+// Minibatch of ratings of a Dataset, given by their indices in it. The
+// ratings are also grouped by user, and the distinct users and items are
+// kept, so that a step of the SGD only costs in the size of the minibatch
+// (not in the number of users and items, as the indices of a Dataset).
+class MiniBatch {
+ public:
+  explicit MiniBatch(const Dataset& data) : data_(data) {}
+
+  // The (up to) n ratings from rating i.
+  void assign(size_t i, size_t n) {
+    i = std::min(i, data_.ratings_size());
+    n = std::min(n, data_.ratings_size() - i);
+    ratings_.resize(n);
+    for (size_t k = 0; k < n; ++k) ratings_[k] = i + k;
+    group();
+  }
+
+  // The given n ratings.
+  void assign(const uint32_t* ratings, size_t n) {
+    ratings_.assign(ratings, ratings + n);
+    group();
+  }
+
+  inline const Dataset& data() const { return data_; }
+  inline size_t size() const { return ratings_.size(); }
+  // Index in data() of the k-th rating of the minibatch.
+  inline uint32_t rating(size_t k) const { return ratings_[k]; }
+  // Distinct users and items of the minibatch.
+  inline const std::vector<uint32_t>& users() const { return users_; }
+  inline const std::vector<uint32_t>& items() const { return items_; }
+  // Positions in users() and items() of the user and item of the k-th
+  // rating.
+  inline uint32_t user_pos(size_t k) const { return user_pos_[k]; }
+  inline uint32_t item_pos(size_t k) const { return item_pos_[k]; }
+  // Positions in the minibatch of the ratings of the u-th user of users(),
+  // in the range [by_user_begin(u), by_user_end(u)), in order.
+  inline const uint32_t* by_user_begin(size_t u) const {
+    return by_user_.data() + user_start_[u];
+  }
+  inline const uint32_t* by_user_end(size_t u) const {
+    return by_user_.data() + user_start_[u + 1];
+  }
+
+ private:
+  const Dataset& data_;
+  std::vector<uint32_t> ratings_;
+  std::vector<uint32_t> by_user_;
+  std::vector<uint32_t> user_start_;
+  std::vector<uint32_t> users_;
+  std::vector<uint32_t> items_;
+  std::vector<uint32_t> user_pos_;
+  std::vector<uint32_t> item_pos_;
+
+  void group() {
+    by_user_.resize(ratings_.size());
+    for (size_t k = 0; k < ratings_.size(); ++k) by_user_[k] = k;
+    std::stable_sort(by_user_.begin(), by_user_.end(),
+                     [this](uint32_t a, uint32_t b) {
+                       return data_.user(ratings_[a]) <
+                           data_.user(ratings_[b]);
+                     });
+    users_.clear();
+    user_start_.clear();
+    user_pos_.resize(ratings_.size());
+    for (size_t k = 0; k < by_user_.size(); ++k) {
+      const uint32_t i = data_.user(ratings_[by_user_[k]]);
+      if (users_.empty() || users_.back() != i) {
+        users_.push_back(i);
+        user_start_.push_back(k);
+      }
+      user_pos_[by_user_[k]] = users_.size() - 1;
+    }
+    user_start_.push_back(by_user_.size());
+    items_.resize(ratings_.size());
+    for (size_t k = 0; k < ratings_.size(); ++k) {
+      items_[k] = data_.item(ratings_[k]);
+    }
+    std::sort(items_.begin(), items_.end());
+    items_.erase(std::unique(items_.begin(), items_.end()), items_.end());
+    item_pos_.resize(ratings_.size());
+    for (size_t k = 0; k < ratings_.size(); ++k) {
+      item_pos_[k] = std::lower_bound(items_.begin(), items_.end(),
+                                      data_.item(ratings_[k])) -
+          items_.begin();
+    }
+  }
+};
+
+// Update H' = Y + H after Y += alpha * dY and W += alpha * dW: H'ci +=
+// alpha * dYci and, for each item l rated by the user, H'ci += alpha * dWcl /
+// ratings_user[i]. If 'batch' is not NULL, only the rows of its users and
+// items are not null in dY and dW, and only the users affected by them are
+// patched.
+void update_HY(const Dataset& data, const size_t C, const size_t N,
+               const size_t M, const size_t D, const float alpha,
+               const float* dY, const float* dW, float* H,
+               const MiniBatch* batch = NULL) {
+  if (batch == NULL) {
+    cblas_saxpy(C * D * N, alpha, dY, 1, H, 1);
+  }
+  const size_t nitems = batch != NULL ? batch->items().size() : M;
+  for (size_t c = 0; c < C; ++c) {
+    if (batch != NULL) {
+      for (const uint32_t i : batch->users()) {
+        cblas_saxpy(D, alpha, dY + c * D * N + i * D, 1,
+                    H + c * D * N + i * D, 1);
+      }
+    }
+    for (size_t k = 0; k < nitems; ++k) {
+      const uint32_t l = batch != NULL ? batch->items()[k] : k;
+      const float* dWcl = dW + c * D * M + l * D;
+      for (const uint32_t i : data.users_by_item(l)) {
+        const float a = alpha / data.ratings_by_user(i).size();
+        cblas_saxpy(D, a, dWcl, 1, H + c * D * N + i * D, 1);
+      }
+    }
+  }
+}
+
+// Computes the gradient of the loss in the minibatch in dY, dV and dW. If
+// 'all_rows', the gradients are C x N x D (dY) and C x M x D (dV, dW), and
+// the rows of the users and items that are not in the minibatch are also
+// computed (only with their regularization). Otherwise only the rows of the
+// users and items of the minibatch are computed, and stored compactly, in
+// the order of batch.users() and batch.items() (C x users x D and C x items
+// x D).
+void compute_loss_grad(const MiniBatch& batch, const size_t C, const size_t N,
                        const size_t M, const size_t D, const float* Y,
                        const float* V, const float* W, const float* H,
                        const float lY, const float lV, const float lW,
-                       float* dY, float* dV, float* dW) {
-  memset(dY, 0x00, sizeof(float) * C * D * N);
-  memset(dV, 0x00, sizeof(float) * C * D * M);
-  memset(dW, 0x00, sizeof(float) * C * D * M);
+                       float* dY, float* dV, float* dW,
+                       const bool all_rows = true) {
+  const Dataset& data = batch.data();
+  // Rows of dY and of dV, dW
+  const size_t RY = all_rows ? N : batch.users().size();
+  const size_t RV = all_rows ? M : batch.items().size();
+  auto user = [&](size_t k) -> uint32_t {
+    return all_rows ? k : batch.users()[k];
+  };
+  auto item = [&](size_t k) -> uint32_t {
+    return all_rows ? k : batch.items()[k];
+  };
+  memset(dY, 0x00, sizeof(float) * C * D * RY);
+  memset(dV, 0x00, sizeof(float) * C * D * RV);
+  memset(dW, 0x00, sizeof(float) * C * D * RV);
   float* Zij = new float[C];
-  float* aux = new float[C];
   float* aux2 = new float[C];
-  for (const Dataset::Rating& rat: data.ratings()) {
+  // aux(k,c) = g(Zij) .* (1 - g(Zij)) .* (g(Zij) - Rij), for each rating k
+  float* aux = new float[batch.size() * C];
+  for (size_t k = 0; k < batch.size(); ++k) {
+    const Dataset::Rating rat = data.rating(batch.rating(k));
     const uint32_t i = rat.user;
     const uint32_t j = rat.item;
+    // Rows of the gradients of i and j
+    const size_t yi = all_rows ? i : batch.user_pos(k);
+    const size_t vj = all_rows ? j : batch.item_pos(k);
+    float* auxr = aux + k * C;
     // Compute Zij
     for (size_t c = 0; c < C; ++c) {
       const float* Hci = H + c * D * N + i * D;
@@ -246,59 +478,517 @@ void compute_loss_grad(const Dataset& data, const size_t C, const size_t N,
     }
     // Zij = g(Zij) [Predicted rating]
     sigmoid(C, Zij);
-    memcpy(aux, Zij, sizeof(float) * C);
+    memcpy(auxr, Zij, sizeof(float) * C);
     memcpy(aux2, Zij, sizeof(float) * C);
     // aux = -1 * (Rij - g(Zij)) = (g(Zij) - Rij) [- Prediction error]
-    cblas_saxpy(C, -1.0f, rat.scores.data(), 1, aux, 1);
+    cblas_saxpy(C, -1.0f, rat.scores, 1, auxr, 1);
     // aux2 = 1 - g(Zij)
     saxpk(C, -1.0f, aux2, 1.0f);
     // aux2 = g(Zij) .* (1 - g(Zij))
     sxdy(C, Zij, aux2);
     // aux = g(Zij) .* (1 - g(Zij)) .* (g(Zij) - Rij)
-    sxdy(C, aux2, aux);
-    const std::vector<Dataset::Rating*>& user_ratings =
-        data.ratings_by_user(i);
+    sxdy(C, aux2, auxr);
     for (size_t c = 0; c < C; ++c) {
       for (size_t d = 0; d < D; ++d) {
         // dY(c,d,i) += aux[c] * V(c,d,j)
         const float Vcdj = V[c * D * M + j * D + d];
-        dY[c * D * N + i * D + d] += aux[c] * Vcdj;
+        dY[c * D * RY + yi * D + d] += auxr[c] * Vcdj;
         // dV(c,d,j) += aux[c] * H'(c,d,i)
         const float Hcdi = H[c * D * N + i * D + d];
-        dV[c * D * N + j * D + d] += aux[c] * Hcdi;
-        // dW(c,d,j) += aux[c] * Vcdj / ratings_user[i]
-        if (user_ratings.size() == 0) {
-          continue;
-        }
-        for (const Dataset::Rating* rat: user_ratings) {
-          uint32_t l = rat->item;
-          dW[c * D * N + l * D + d] +=
-              aux[c] * Vcdj / user_ratings.size();
-        }
+        dV[c * D * RV + vj * D + d] += auxr[c] * Hcdi;
+      }
+    }
+  }
+  // dW(c,d,l) += aux[c] * V(c,d,j) / ratings_user[i], for each rating (i,j)
+  // and each item l rated by i. The contributions of all the ratings of a
+  // user are the same for all its items, so they are added up first
+  // (dWi) and then added once to each of its items.
+  float* dWi = new float[C * D];
+  for (size_t u = 0; u < batch.users().size(); ++u) {
+    const uint32_t* begin = batch.by_user_begin(u);
+    const uint32_t* end = batch.by_user_end(u);
+    const size_t n = end - begin;
+    memset(dWi, 0x00, sizeof(float) * C * D);
+    for (const uint32_t* k = begin; k != end; ++k) {
+      const uint32_t j = data.item(batch.rating(*k));
+      for (size_t c = 0; c < C; ++c) {
+        cblas_saxpy(D, aux[*k * C + c] / n, V + c * D * M + j * D, 1,
+                    dWi + c * D, 1);
+      }
+    }
+    for (const uint32_t* k = begin; k != end; ++k) {
+      const size_t vl = all_rows ? data.item(batch.rating(*k)) :
+          batch.item_pos(*k);
+      for (size_t c = 0; c < C; ++c) {
+        cblas_saxpy(D, 1.0f, dWi + c * D, 1, dW + c * D * RV + vl * D, 1);
       }
     }
   }
   // Regularization dY
   for (size_t c = 0; c < C; ++c) {
-    for (size_t i = 0; i < N; ++i) {
+    for (size_t k = 0; k < RY; ++k) {
+      const size_t i = user(k);
       for (size_t d = 0; d < D; ++d) {
-        dY[c * D * N + i * D + d] += lY * Y[c * D * N + i * D + d];
+        dY[c * D * RY + k * D + d] += lY * Y[c * D * N + i * D + d];
       }
     }
   }
   // Regularization dV, dW
   for (size_t c = 0; c < C; ++c) {
-    for (size_t j = 0; j < M; ++j) {
+    for (size_t k = 0; k < RV; ++k) {
+      const size_t j = item(k);
       for (size_t d = 0; d < D; ++d) {
-        dV[c * D * M + j * D + d] += lV * V[c * D * M + j * D + d];
-        dW[c * D * M + j * D + d] += lW * W[c * D * M + j * D + d];
+        dV[c * D * RV + k * D + d] += lV * V[c * D * M + j * D + d];
+        dW[c * D * RV + k * D + d] += lW * W[c * D * M + j * D + d];
       }
     }
   }
+  delete [] dWi;
   delete [] aux;
+  delete [] aux2;
   delete [] Zij;
 }
 
+// Solves A x = b for the symmetric positive definite D x D matrix A, given
+// in packed upper form, with its Cholesky factorization A = U' U (in double
+// precision). The solution is stored in b. 'work' must have room for D * D
+// + D values. Returns false if A is not positive definite.
+bool spd_solve_packed(const size_t D, const float* A, float* b,
+                      double* work) {
+  double* U = work;
+  double* y = work + D * D;
+  for (size_t r = 0, k = 0; r < D; ++r) {
+    for (size_t c = r; c < D; ++c, ++k) {
+      U[r * D + c] = A[k];
+    }
+  }
+  for (size_t k = 0; k < D; ++k) {
+    double s = U[k * D + k];
+    for (size_t p = 0; p < k; ++p) s -= U[p * D + k] * U[p * D + k];
+    if (!(s > 0.0)) {
+      return false;
+    }
+    U[k * D + k] = sqrt(s);
+    for (size_t c = k + 1; c < D; ++c) {
+      double t = U[k * D + c];
+      for (size_t p = 0; p < k; ++p) t -= U[p * D + k] * U[p * D + c];
+      U[k * D + c] = t / U[k * D + k];
+    }
+  }
+  // U' y = b, U x = y
+  for (size_t k = 0; k < D; ++k) {
+    double t = b[k];
+    for (size_t p = 0; p < k; ++p) t -= U[p * D + k] * y[p];
+    y[k] = t / U[k * D + k];
+  }
+  for (size_t k = D; k-- > 0; ) {
+    double t = y[k];
+    for (size_t p = k + 1; p < D; ++p) t -= U[k * D + p] * y[p];
+    y[k] = t / U[k * D + k];
+    b[k] = y[k];
+  }
+  return true;
+}
+
+// Workspace of a thread of gauss_newton_sweep().
+struct GNWorkspace {
+  std::vector<float> z;
+  std::vector<float> A;
+  std::vector<float> b;
+  std::vector<double> work;
+};
+
+// Accumulates in A (packed upper) and b the Gauss-Newton matrix sum(g'^2 f
+// f') and the gradient sum(g' (g - s) f) of the loss of the ratings 'rs' of
+// a row of factors x, where f is the vector of factors multiplied by x in
+// each rating (given by 'other'), g the predicted rating, g' its derivative
+// and s the score of criterion c.
+void gn_accumulate(const Dataset& data, const size_t c, const size_t D,
+                   const Dataset::RatingsSpan& rs, const float* x,
+                   const std::function<const float*(uint32_t)>& other,
+                   GNWorkspace* ws) {
+  std::fill(ws->A.begin(), ws->A.end(), 0.0f);
+  std::fill(ws->b.begin(), ws->b.end(), 0.0f);
+  if (rs.size() == 0) {
+    return;
+  }
+  ws->z.resize(rs.size());
+  for (size_t k = 0; k < rs.size(); ++k) {
+    ws->z[k] = cblas_sdot(D, x, 1, other(rs[k]), 1);
+  }
+  sigmoid(rs.size(), ws->z.data());
+  for (size_t k = 0; k < rs.size(); ++k) {
+    const float g = ws->z[k];
+    const float gp = g * (1.0f - g);
+    const float e = g - data.scores(rs[k])[c];
+    cblas_sspr(CblasRowMajor, CblasUpper, D, gp * gp, other(rs[k]), 1,
+               ws->A.data());
+    cblas_saxpy(D, gp * e, other(rs[k]), 1, ws->b.data(), 1);
+  }
+}
+
+// Regularized Gauss-Newton step of the row of factors x, given the matrix
+// A and gradient b of gn_accumulate(): x -= (A + (l + damping) I)^-1 (b +
+// l x). The change of x (minus the step) is left in b. Returns false (and
+// leaves x unchanged) if the system can not be solved.
+bool gn_step(const size_t D, const float l, const float damping, float* x,
+             GNWorkspace* ws) {
+  cblas_saxpy(D, l, x, 1, ws->b.data(), 1);
+  for (size_t k = 0; k < D; ++k) {
+    ws->A[k * D - k * (k - 1) / 2] += l + damping;
+  }
+  if (!spd_solve_packed(D, ws->A.data(), ws->b.data(), ws->work.data())) {
+    return false;
+  }
+  cblas_saxpy(D, -1.0f, ws->b.data(), 1, x, 1);
+  return true;
+}
+
+// Calls f(k, workspace) for k in [0, n), in parallel.
+void gn_parallel_for(const size_t n, const size_t D, const uint32_t threads,
+                     const std::function<void(size_t, GNWorkspace*)>& f) {
+  std::atomic<size_t> next_block(0);
+  auto worker = [&]() {
+    GNWorkspace ws;
+    ws.A.resize(D * (D + 1) / 2);
+    ws.b.resize(D);
+    ws.work.resize(D * D + D);
+    for (size_t b = next_block++ * kSolveBlock; b < n;
+         b = next_block++ * kSolveBlock) {
+      const size_t e = std::min(b + kSolveBlock, n);
+      for (size_t k = b; k < e; ++k) {
+        f(k, &ws);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < std::max(threads, 1u); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+}
+
+// One sweep of the Gauss-Newton optimizer: for each criterion, the factors
+// Y of each user, V of each item and W of each item are updated in turn
+// with a Gauss-Newton step, each row independently of the others (and in
+// parallel). The factors W of the items rated by the same user are coupled
+// through H'; each of them minimizes a separable majorizer of the
+// Gauss-Newton model, where the matrix of user i is divided by
+// ratings_user[i] instead of its square, so that the steps of all the items
+// together still decrease it. 'data' must be the normalized training data.
+void gauss_newton_sweep(const Dataset& data, const size_t C, const size_t N,
+                        const size_t M, const size_t D, const float lY,
+                        const float lV, const float lW, const float damping,
+                        const uint32_t threads, float* Y, float* V, float* W,
+                        float* H) {
+  const size_t P = D * (D + 1) / 2;
+  std::vector<float> AW(N * P), bW(N * D);
+  for (size_t c = 0; c < C; ++c) {
+    float* Yc = Y + c * D * N;
+    float* Vc = V + c * D * M;
+    float* Wc = W + c * D * M;
+    float* Hc = H + c * D * N;
+    auto item_factors = [&](uint32_t r) -> const float* {
+      return Vc + data.item(r) * D;
+    };
+    auto user_factors = [&](uint32_t r) -> const float* {
+      return Hc + data.user(r) * D;
+    };
+    // Y (H' = H + Y changes by the same amount)
+    gn_parallel_for(N, D, threads, [&](size_t i, GNWorkspace* ws) {
+      gn_accumulate(data, c, D, data.ratings_by_user(i), Hc + i * D,
+                    item_factors, ws);
+      if (gn_step(D, lY, damping, Yc + i * D, ws)) {
+        cblas_saxpy(D, -1.0f, ws->b.data(), 1, Hc + i * D, 1);
+      }
+    });
+    // V
+    gn_parallel_for(M, D, threads, [&](size_t j, GNWorkspace* ws) {
+      gn_accumulate(data, c, D, data.ratings_by_item(j), Vc + j * D,
+                    user_factors, ws);
+      gn_step(D, lV, damping, Vc + j * D, ws);
+    });
+    // W: matrix and gradient of each user, divided by ratings_user[i], and
+    // added up for each item
+    gn_parallel_for(N, D, threads, [&](size_t i, GNWorkspace* ws) {
+      const Dataset::RatingsSpan rs = data.ratings_by_user(i);
+      gn_accumulate(data, c, D, rs, Hc + i * D, item_factors, ws);
+      const float a = rs.size() > 0 ? 1.0f / rs.size() : 0.0f;
+      for (size_t k = 0; k < P; ++k) AW[i * P + k] = a * ws->A[k];
+      for (size_t d = 0; d < D; ++d) bW[i * D + d] = a * ws->b[d];
+    });
+    gn_parallel_for(M, D, threads, [&](size_t l, GNWorkspace* ws) {
+      std::fill(ws->A.begin(), ws->A.end(), 0.0f);
+      std::fill(ws->b.begin(), ws->b.end(), 0.0f);
+      for (const uint32_t i : data.users_by_item(l)) {
+        cblas_saxpy(P, 1.0f, AW.data() + i * P, 1, ws->A.data(), 1);
+        cblas_saxpy(D, 1.0f, bW.data() + i * D, 1, ws->b.data(), 1);
+      }
+      gn_step(D, lW, damping, Wc + l * D, ws);
+    });
+    // H' = H + Y, with the new W
+    compute_H(data, D, N, Wc, Hc);
+    cblas_saxpy(D * N, 1.0f, Yc, 1, Hc, 1);
+  }
+}
+
+// Momentum SGD updates of a matrix P of parameters (C blocks of R rows of D
+// values) in which each step only updates the rows touched by the minibatch.
+// The gradient G of a row that is not touched only has the regularization
+// term, so its updates (m' = lambda * p - momentum * m, p' = p - lr * m')
+// are linear in (p, m): the k steps skipped by the row are applied at once,
+// as the k-th power of the 2x2 matrix of the update, when the row is touched
+// again (or the matrix is flushed). The rows of M (the previous updates,
+// for the momentum) are stored densely, in the same layout as P.
+class LazyRows {
+ public:
+  LazyRows(size_t C, size_t R, size_t D, float* P, float* M, float lambda,
+           float learning_rate, float momentum)
+      : C_(C), R_(R), D_(D), P_(P), M_(M), lr_(learning_rate),
+        momentum_(momentum), last_(R, 0) {
+    // A^0 = I
+    powers_.push_back(1.0); powers_.push_back(0.0);
+    powers_.push_back(0.0); powers_.push_back(1.0);
+    A_[0] = 1.0 - static_cast<double>(learning_rate) * lambda;
+    A_[1] = static_cast<double>(learning_rate) * momentum;
+    A_[2] = lambda;
+    A_[3] = -momentum;
+  }
+
+  // Brings row r up to the end of step 'step': the steps skipped since its
+  // last update are applied and, if G is not NULL, the last one uses the
+  // gradient of the row in G (C blocks of D values, 'stride' values apart).
+  // Stores in 'delta' (C x D) the change of the row, and returns false if
+  // the row did not change.
+  bool advance(uint32_t r, uint32_t step, float* delta,
+               const float* G = NULL, size_t stride = 0) {
+    const bool with_grad = G != NULL;
+    DCHECK_LE(last_[r] + (with_grad ? 1 : 0), step);
+    const uint32_t k = step - last_[r] - (with_grad ? 1 : 0);
+    if (k == 0 && !with_grad) {
+      return false;
+    }
+    const double* Ak = power(k);
+    // Without regularization (the skipped steps do not change the row) nor
+    // momentum (the previous updates are not used), there is nothing to do
+    if (!with_grad && Ak[0] == 1.0 && Ak[1] == 0.0 && momentum_ == 0.0f) {
+      last_[r] = step;
+      return false;
+    }
+    for (size_t c = 0; c < C_; ++c) {
+      const size_t o = c * R_ * D_ + r * D_;
+      for (size_t d = 0; d < D_; ++d) {
+        const float p = P_[o + d];
+        float pn = Ak[0] * p + Ak[1] * M_[o + d];
+        float mn = Ak[2] * p + Ak[3] * M_[o + d];
+        if (with_grad) {
+          mn = G[c * stride + d] - momentum_ * mn;
+          pn -= lr_ * mn;
+        }
+        delta[c * D_ + d] = pn - p;
+        P_[o + d] = pn;
+        M_[o + d] = mn;
+      }
+    }
+    last_[r] = step;
+    return with_grad || Ak[0] != 1.0 || Ak[1] != 0.0;
+  }
+
+ private:
+  const size_t C_, R_, D_;
+  float* P_;
+  float* M_;
+  const float lr_;
+  const float momentum_;
+  double A_[4];
+  // Powers of A (4 values each, by rows), computed on demand.
+  std::vector<double> powers_;
+  // Last step applied to each row
+  std::vector<uint32_t> last_;
+
+  const double* power(uint32_t k) {
+    while (powers_.size() <= 4 * static_cast<size_t>(k)) {
+      const double* B = &powers_[powers_.size() - 4];
+      const double AB[4] = {
+        A_[0] * B[0] + A_[1] * B[2], A_[0] * B[1] + A_[1] * B[3],
+        A_[2] * B[0] + A_[3] * B[2], A_[2] * B[1] + A_[3] * B[3] };
+      powers_.insert(powers_.end(), AB, AB + 4);
+    }
+    return &powers_[4 * static_cast<size_t>(k)];
+  }
+};
+
+// Minibatch SGD in which several threads process different minibatches at
+// the same time and update the parameters without locks (Hogwild). Each
+// thread stores the gradient of its minibatch in its own matrices, which
+// only have the rows of its users and items (see compute_loss_grad()), and
+// only the rows touched by the minibatch are updated, with their
+// regularization and momentum. The rows of H' = H + Y affected by each
+// update are patched, also without locks (the H' computed from scratch
+// every hy_refresh_iters iterations discards the lost updates).
+//
+// With the stratified schedule (DSGD), the users and items are split in P
+// blocks (P = threads), and the ratings in P x P blocks. In stratum s,
+// thread t takes the minibatches from block (t, (t + s) % P), so the
+// threads update different users and items (except the factors W of the
+// other items rated by the users). A stratum ends when all its blocks have
+// been processed.
+class ParallelSGD {
+ public:
+  ParallelSGD(const Dataset& batches, const Dataset& data, size_t D,
+              float* Y, float* V, float* W, float* HY, float* dYp,
+              float* dVp, float* dWp, float lY, float lV, float lW,
+              float learning_rate, float momentum, uint32_t batch_size,
+              uint32_t threads, bool stratified)
+      : batches_(batches), data_(data), C_(data.criteria_size()),
+        N_(data.users()), M_(data.items()), D_(D), Y_(Y), V_(V), W_(W),
+        HY_(HY), dYp_(dYp), dVp_(dVp), dWp_(dWp), lY_(lY), lV_(lV), lW_(lW),
+        lr_(learning_rate), momentum_(momentum),
+        batch_size_(std::max(batch_size, 1u)), threads_(threads),
+        stratified_(stratified), buffers_(threads), stratum_(0) {
+    // A minibatch has at most batch_size users and items
+    const size_t rows = std::min<size_t>(batch_size_, batches.ratings_size());
+    for (Buffers& b : buffers_) {
+      b.dY.resize(C_ * rows * D_);
+      b.dV.resize(C_ * rows * D_);
+      b.dW.resize(C_ * rows * D_);
+      b.delta.resize(C_ * D_);
+    }
+    if (stratified_) {
+      blocks_.resize(threads_ * threads_);
+      cursor_.assign(threads_ * threads_, 0);
+      for (size_t r = 0; r < batches_.ratings_size(); ++r) {
+        blocks_[(batches_.user(r) % threads_) * threads_ +
+                batches_.item(r) % threads_].push_back(r);
+      }
+    }
+  }
+
+  // Processes the minibatches [begin, end).
+  void run(uint32_t begin, uint32_t end) {
+    if (batches_.ratings_size() == 0) {
+      return;
+    }
+    std::atomic<uint32_t> next(begin);
+    if (!stratified_) {
+      // Minibatch k is the (k % chunks)-th chunk of batch_size ratings
+      const size_t chunks =
+          (batches_.ratings_size() + batch_size_ - 1) / batch_size_;
+      run_workers([&](uint32_t t) {
+        MiniBatch mini_batch(batches_);
+        for (uint32_t k = next++; k < end; k = next++) {
+          mini_batch.assign((k % chunks) * batch_size_, batch_size_);
+          step(mini_batch, &buffers_[t]);
+        }
+      });
+      return;
+    }
+    while (next < end) {
+      run_workers([&](uint32_t t) {
+        const uint32_t b = t * threads_ + (t + stratum_) % threads_;
+        MiniBatch mini_batch(batches_);
+        while (cursor_[b] < blocks_[b].size() && next++ < end) {
+          const size_t n = std::min<size_t>(batch_size_,
+                                            blocks_[b].size() - cursor_[b]);
+          mini_batch.assign(blocks_[b].data() + cursor_[b], n);
+          cursor_[b] += n;
+          step(mini_batch, &buffers_[t]);
+        }
+      });
+      if (next >= end) {
+        break;
+      }
+      // All the blocks of the stratum were processed
+      for (uint32_t t = 0; t < threads_; ++t) {
+        cursor_[t * threads_ + (t + stratum_) % threads_] = 0;
+      }
+      stratum_ = (stratum_ + 1) % threads_;
+    }
+  }
+
+ private:
+  struct Buffers {
+    std::vector<float> dY, dV, dW, delta;
+  };
+
+  const Dataset& batches_;
+  const Dataset& data_;
+  const size_t C_, N_, M_, D_;
+  float* Y_;
+  float* V_;
+  float* W_;
+  float* HY_;
+  float* dYp_;
+  float* dVp_;
+  float* dWp_;
+  const float lY_, lV_, lW_;
+  const float lr_;
+  const float momentum_;
+  const uint32_t batch_size_;
+  const uint32_t threads_;
+  const bool stratified_;
+  std::vector<Buffers> buffers_;
+  // Stratified schedule: ratings of each block (by user block and item
+  // block), position of the next minibatch in each block, and stratum.
+  std::vector<std::vector<uint32_t> > blocks_;
+  std::vector<size_t> cursor_;
+  uint32_t stratum_;
+
+  void run_workers(const std::function<void(uint32_t)>& worker) {
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads_; ++t) {
+      workers.push_back(std::thread(worker, t));
+    }
+    for (std::thread& w : workers) w.join();
+  }
+
+  // m = g - momentum * m, P = P - lr * m for row r of P (C x R x D), with
+  // the gradient G of the row (C blocks of D values, 'stride' values apart),
+  // storing the change of the row in 'delta'.
+  void update_row(size_t R, uint32_t r, const float* G, size_t stride,
+                  float* Mo, float* P, float* delta) const {
+    for (size_t c = 0; c < C_; ++c) {
+      const size_t o = c * R * D_ + r * D_;
+      for (size_t d = 0; d < D_; ++d) {
+        const float m = G[c * stride + d] - momentum_ * Mo[o + d];
+        const float p = P[o + d];
+        Mo[o + d] = m;
+        P[o + d] = p - lr_ * m;
+        delta[c * D_ + d] = P[o + d] - p;
+      }
+    }
+  }
+
+  void step(const MiniBatch& mini_batch, Buffers* buf) {
+    compute_loss_grad(mini_batch, C_, N_, M_, D_, Y_, V_, W_, HY_,
+                      lY_, lV_, lW_, buf->dY.data(), buf->dV.data(),
+                      buf->dW.data(), false);
+    float* delta = buf->delta.data();
+    const size_t U = mini_batch.users().size();
+    const size_t I = mini_batch.items().size();
+    for (size_t k = 0; k < U; ++k) {
+      const uint32_t i = mini_batch.users()[k];
+      update_row(N_, i, buf->dY.data() + k * D_, U * D_, dYp_, Y_, delta);
+      for (size_t c = 0; c < C_; ++c) {
+        cblas_saxpy(D_, 1.0f, delta + c * D_, 1, HY_ + c * D_ * N_ + i * D_,
+                    1);
+      }
+    }
+    for (size_t k = 0; k < I; ++k) {
+      const uint32_t j = mini_batch.items()[k];
+      update_row(M_, j, buf->dV.data() + k * D_, I * D_, dVp_, V_, delta);
+      update_row(M_, j, buf->dW.data() + k * D_, I * D_, dWp_, W_, delta);
+      for (const uint32_t i : data_.users_by_item(j)) {
+        const float a = 1.0f / data_.ratings_by_user(i).size();
+        for (size_t c = 0; c < C_; ++c) {
+          cblas_saxpy(D_, a, delta + c * D_, 1, HY_ + c * D_ * N_ + i * D_,
+                      1);
+        }
+      }
+    }
+  }
+};
+
 float PMFModel::train(const Dataset& train_set, const Dataset& valid_set) {
   const uint32_t N = train_set.users();
   const uint32_t M = train_set.items();
@@ -330,8 +1020,10 @@ float PMFModel::train(const Dataset& train_set, const Dataset& valid_set) {
 #ifndef NDEBUG
   print_mat("W", W_, C, M, D_);
 #endif
-  // Copy the training data
+  // Copy the training data (the quantized factors become outdated)
   data_ = train_set;
+  hy_int8_.clear();
+  v_int8_.clear();
   // Show Model info
   LOG(INFO) << "Model config:\n" << info();
   // Get a copy of the data normalized to [0..1]
@@ -350,49 +1042,192 @@ float PMFModel::train(const Dataset& train_set, const Dataset& valid_set) {
   float last_v_rmse = test(valid_set);
   LOG(INFO) << "Init: Loss = " << last_loss << ", Train RMSE = " << last_t_rmse
             << ", Valid RMSE = " << last_v_rmse;
-  // Prepare matrices that will store the gradients
-  float* dY = new float[D_ * N * C];
-  float* dV = new float[D_ * M * C];
-  float* dW = new float[D_ * M * C];
+  // Prepare matrices that will store the gradients (only used by the serial
+  // SGD; the parallel SGD has its own). With sparse updates, they only have
+  // the rows of the users and items of the minibatch.
+  const bool gauss_newton =
+      optimizer_ == PMFModelConfig_Optimizer_GAUSS_NEWTON;
+  const uint32_t sgd_threads = sgd_threads_ > 0 ? sgd_threads_ : threads();
+  const bool serial_sgd = !gauss_newton && sgd_threads <= 1;
+  // The parallel SGD joins its threads at every evaluation and refresh of
+  // H', so fewer minibatches than threads in between leave threads idle
+  if (!gauss_newton && !serial_sgd &&
+      ((eval_iters_ > 0 && eval_iters_ < sgd_threads) ||
+       (hy_refresh_iters_ > 0 && hy_refresh_iters_ < sgd_threads))) {
+    LOG(WARNING) << "PMFModel: eval_iters and hy_refresh_iters should be "
+                 << "at least sgd_threads (" << sgd_threads << ") for the "
+                 << "SGD threads to run concurrently.";
+  }
+  const size_t batch_rows =
+      std::min<size_t>(batch_size_, norm_data.ratings_size());
+  const size_t RY = sparse_updates_ ? batch_rows : N;
+  const size_t RV = sparse_updates_ ? batch_rows : M;
+  float* dY = serial_sgd ? new float[D_ * RY * C] : NULL;
+  float* dV = serial_sgd ? new float[D_ * RV * C] : NULL;
+  float* dW = serial_sgd ? new float[D_ * RV * C] : NULL;
   // Previous gradients, useful for momentum
-  float* dYp = new float[D_ * N * C];
-  float* dVp = new float[D_ * M * C];
-  float* dWp = new float[D_ * M * C];
-  memset(dYp, 0x00, sizeof(float) * D_ * N * C);
-  memset(dVp, 0x00, sizeof(float) * D_ * M * C);
-  memset(dWp, 0x00, sizeof(float) * D_ * M * C);
+  float* dYp = gauss_newton ? NULL : new float[D_ * N * C];
+  float* dVp = gauss_newton ? NULL : new float[D_ * M * C];
+  float* dWp = gauss_newton ? NULL : new float[D_ * M * C];
+  if (!gauss_newton) {
+    memset(dYp, 0x00, sizeof(float) * D_ * N * C);
+    memset(dVp, 0x00, sizeof(float) * D_ * M * C);
+    memset(dWp, 0x00, sizeof(float) * D_ * M * C);
+  }
   // Prepare uniform distribution for minibatches
   std::uniform_int_distribution<uint32_t> udist(
       0, batch_size_ < norm_data.ratings_size() ?
       norm_data.ratings_size() - batch_size_ :
       norm_data.ratings_size());
-  // Training performing SGD
+  // Sparse updates
+  LazyRows sY(C, N, D_, Y_, dYp, lY_, learning_rate_, momentum_);
+  LazyRows sV(C, M, D_, V_, dVp, lV_, learning_rate_, momentum_);
+  LazyRows sW(C, M, D_, W_, dWp, lW_, learning_rate_, momentum_);
+  std::vector<float> delta(C * D_);
+  // H'ci += delta, after a change of Yci
+  auto patch_user = [&](uint32_t i) {
+    for (size_t c = 0; c < C; ++c) {
+      cblas_saxpy(D_, 1.0f, delta.data() + c * D_, 1,
+                  HY_ + c * D_ * N + i * D_, 1);
+    }
+  };
+  // H'ci += delta / ratings_user[i], for each user i that rated item l,
+  // after a change of Wcl
+  auto patch_item = [&](uint32_t l) {
+    for (const uint32_t i : data_.users_by_item(l)) {
+      const float a = 1.0f / data_.ratings_by_user(i).size();
+      for (size_t c = 0; c < C; ++c) {
+        cblas_saxpy(D_, a, delta.data() + c * D_, 1,
+                    HY_ + c * D_ * N + i * D_, 1);
+      }
+    }
+  };
+  const bool batch_rows_only =
+      lY_ == 0.0f && lW_ == 0.0f && momentum_ == 0.0f;
+  auto is_refresh_HY = [&](uint32_t iter) -> bool {
+    return hy_refresh_iters_ > 0 && iter % hy_refresh_iters_ == 0;
+  };
+  auto is_eval = [&](uint32_t iter) -> bool {
+    return iter == max_iters_ || (eval_iters_ > 0 && iter % eval_iters_ == 0);
+  };
+  // Parallel SGD
+  std::unique_ptr<ParallelSGD> parallel_sgd;
+  if (!gauss_newton && !serial_sgd) {
+    parallel_sgd.reset(new ParallelSGD(
+        norm_data, data_, D_, Y_, V_, W_, HY_, dYp, dVp, dWp, lY_, lV_, lW_,
+        learning_rate_, momentum_, batch_size_, sgd_threads,
+        sgd_schedule_ == PMFModelConfig_SGDSchedule_STRATIFIED));
+  }
+  MiniBatch mini_batch(norm_data);
+  const auto start = std::chrono::steady_clock::now();
+  // Training performing SGD (or Gauss-Newton sweeps)
   for (uint32_t iter = 1; iter <= max_iters_; ++iter) {
-    // Prepare minibatch
-    Dataset mini_batch;
-    norm_data.copy(&mini_batch, udist(PRNG), batch_size_);
-    // Compute loss gradient for the minibatch
-    compute_loss_grad(mini_batch, C, N, M, D_, Y_, V_, W_, HY_,
-                      lY_, lV_, lW_, dY, dV, dW);
-    // g' = - g' * momentum + g
-    sxpay(C * N * D_, -momentum_, dY, dYp);
-    sxpay(C * M * D_, -momentum_, dV, dVp);
-    sxpay(C * M * D_, -momentum_, dW, dWp);
-    // W = W - g' * lr
-    cblas_saxpy(C * D_ * N, -learning_rate_, dYp, 1, Y_, 1);
-    cblas_saxpy(C * D_ * M, -learning_rate_, dVp, 1, V_, 1);
-    cblas_saxpy(C * D_ * M, -learning_rate_, dWp, 1, W_, 1);
-    // Compute new H' = H + Y
-    compute_HY(data_, C, N, M, D_, Y_, W_, HY_);
+    // Prepare minibatch, or run in parallel all the minibatches until the
+    // next refresh of H' or evaluation
+    if (parallel_sgd) {
+      const uint32_t begin = iter - 1;
+      while (!is_refresh_HY(iter) && !is_eval(iter)) ++iter;
+      parallel_sgd->run(begin, iter);
+    } else if (!gauss_newton) {
+      mini_batch.assign(udist(PRNG), batch_size_);
+    }
+    const bool refresh_HY = is_refresh_HY(iter);
+    const bool eval = is_eval(iter);
+    if (gauss_newton) {
+      // Each sweep computes H' from scratch
+      gauss_newton_sweep(norm_data, C, N, M, D_, lY_, lV_, lW_, gn_damping_,
+                         threads(), Y_, V_, W_, HY_);
+    } else if (parallel_sgd) {
+      if (refresh_HY) {
+        compute_HY(data_, C, N, M, D_, Y_, W_, HY_);
+      }
+    } else if (sparse_updates_) {
+      const std::vector<uint32_t>& users = mini_batch.users();
+      const std::vector<uint32_t>& items = mini_batch.items();
+      // Bring up to date the rows read by the gradient. H'ci depends on the
+      // factors W of all the items rated by user i.
+      for (const uint32_t i : users) {
+        if (sY.advance(i, iter - 1, delta.data())) patch_user(i);
+        for (const uint32_t l : data_.items_by_user(i)) {
+          if (sW.advance(l, iter - 1, delta.data())) patch_item(l);
+        }
+      }
+      for (const uint32_t j : items) {
+        sV.advance(j, iter - 1, delta.data());
+      }
+      // Compute loss gradient of the touched rows for the minibatch
+      compute_loss_grad(mini_batch, C, N, M, D_, Y_, V_, W_, HY_,
+                        lY_, lV_, lW_, dY, dV, dW, false);
+      // Update the touched rows, and patch H' = H + Y
+      const size_t U = users.size();
+      const size_t I = items.size();
+      for (size_t k = 0; k < U; ++k) {
+        if (sY.advance(users[k], iter, delta.data(), dY + k * D_, U * D_)) {
+          patch_user(users[k]);
+        }
+      }
+      for (size_t k = 0; k < I; ++k) {
+        sV.advance(items[k], iter, delta.data(), dV + k * D_, I * D_);
+        if (sW.advance(items[k], iter, delta.data(), dW + k * D_, I * D_)) {
+          patch_item(items[k]);
+        }
+      }
+      // The model is only evaluated (or H' recomputed) with all the rows up
+      // to date.
+      if (eval || refresh_HY) {
+        for (uint32_t i = 0; i < N; ++i) {
+          if (sY.advance(i, iter, delta.data()) && !refresh_HY) {
+            patch_user(i);
+          }
+        }
+        for (uint32_t j = 0; j < M; ++j) {
+          sV.advance(j, iter, delta.data());
+          if (sW.advance(j, iter, delta.data()) && !refresh_HY) {
+            patch_item(j);
+          }
+        }
+      }
+      if (refresh_HY) {
+        compute_HY(data_, C, N, M, D_, Y_, W_, HY_);
+      }
+    } else {
+      // Compute loss gradient for the minibatch
+      compute_loss_grad(mini_batch, C, N, M, D_, Y_, V_, W_, HY_,
+                        lY_, lV_, lW_, dY, dV, dW);
+      // g' = - g' * momentum + g
+      sxpay(C * N * D_, -momentum_, dY, dYp);
+      sxpay(C * M * D_, -momentum_, dV, dVp);
+      sxpay(C * M * D_, -momentum_, dW, dWp);
+      // W = W - g' * lr
+      cblas_saxpy(C * D_ * N, -learning_rate_, dYp, 1, Y_, 1);
+      cblas_saxpy(C * D_ * M, -learning_rate_, dVp, 1, V_, 1);
+      cblas_saxpy(C * D_ * M, -learning_rate_, dWp, 1, W_, 1);
+      // Compute new H' = H + Y. H' is patched after each update, except
+      // every hy_refresh_iters iterations, when it is computed from scratch
+      // to discard the accumulated rounding errors. Without regularization
+      // of Y and W nor momentum, only the rows of the users and items of the
+      // minibatch change, and only the users affected by them are patched.
+      if (refresh_HY) {
+        compute_HY(data_, C, N, M, D_, Y_, W_, HY_);
+      } else {
+        update_HY(data_, C, N, M, D_, -learning_rate_, dYp, dWp, HY_,
+                  batch_rows_only ? &mini_batch : NULL);
+      }
+    }
+    if (!eval) {
+      continue;
+    }
     // Compute loss function in the whole train set
     last_loss = compute_loss(
         norm_data, C, N, M, D_, Y_, V_, W_, HY_, lY_, lV_, lW_);
     // Test the model in the whole train & valid set
     last_t_rmse = test(train_set);
     last_v_rmse = test(valid_set);
+    const float secs = std::chrono::duration<float>(
+        std::chrono::steady_clock::now() - start).count();
     LOG(INFO) << "Iter = " << iter << " Loss = " << last_loss
               << " Train RMSE = " << last_t_rmse
-              << " Valid RMSE = " << last_v_rmse;
+              << " Valid RMSE = " << last_v_rmse << " Time = " << secs;
   }
   delete [] dY;
   delete [] dV;
@@ -400,6 +1235,15 @@ float PMFModel::train(const Dataset& train_set, const Dataset& valid_set) {
   delete [] dYp;
   delete [] dVp;
   delete [] dWp;
+  // The stored H' is always computed from scratch
+  if (max_iters_ > 0 &&
+      (hy_refresh_iters_ == 0 || max_iters_ % hy_refresh_iters_ != 0)) {
+    compute_HY(data_, C, N, M, D_, Y_, W_, HY_);
+  }
+  build_mips();
+  if (int8_factors_) {
+    quantize_factors();
+  }
   return last_v_rmse;
 }
 
@@ -408,7 +1252,11 @@ PMFModel::PMFModel()
     : D_(10), max_iters_(100), learning_rate_(0.1f),
     momentum_(0.0f), matrix_init_id_(PMFModelConfig_MatrixInit_STATIC),
     lY_(0.0f), lV_(0.0f), lW_(0.0f),
-    Y_(NULL), V_(NULL), W_(NULL), HY_(NULL) {
+    Y_(NULL), V_(NULL), W_(NULL), HY_(NULL), mips_partitions_(0),
+    mips_iters_(10), mips_probes_(1), mips_seed_(0), int8_factors_(false),
+    hy_refresh_iters_(100), sparse_updates_(true), eval_iters_(1),
+    sgd_threads_(1), sgd_schedule_(PMFModelConfig_SGDSchedule_HOGWILD),
+    optimizer_(PMFModelConfig_Optimizer_SGD), gn_damping_(0.1f) {
 }
 
 PMFModel::~PMFModel() {
@@ -439,39 +1287,362 @@ void PMFModel::clear() {
     delete [] HY_;
     HY_ = NULL;
   }
+  mips_partitions_ = 0;
+  mips_iters_ = 10;
+  mips_probes_ = 1;
+  mips_seed_ = 0;
+  mips_.clear();
+  int8_factors_ = false;
+  hy_int8_.clear();
+  v_int8_.clear();
+  hy_refresh_iters_ = 100;
+  sparse_updates_ = true;
+  eval_iters_ = 1;
+  sgd_threads_ = 1;
+  sgd_schedule_ = PMFModelConfig_SGDSchedule_HOGWILD;
+  optimizer_ = PMFModelConfig_Optimizer_SGD;
+  gn_damping_ = 0.1f;
 }
 
-void PMFModel::test(std::vector<Dataset::Rating>* test_set) const {
+void PMFModel::test(Dataset* test_set) const {
   const uint32_t N = data_.users();
   const uint32_t M = data_.items();
   const uint32_t C = data_.criteria_size();
-  float* Zij = new float[C];
-  // Basic Loss function computation
-  for (auto it = test_set->begin(); it != test_set->end(); ++it) {
-    Dataset::Rating& rat = *it;
-    const uint32_t i = rat.user;
-    const uint32_t j = rat.item;
-    // Compute Zij
-    for (size_t c = 0; c < C; ++c) {
-      const float* Hci = HY_ + c * N * D_ + i * D_;
-      const float* Vcj = V_ + c * M * D_ + j * D_;
-      Zij[c] = cblas_sdot(D_, Hci, 1, Vcj, 1);
+  const bool use_int8 = int8_factors_ && !hy_int8_.empty();
+  // Grouping the ratings by user only pays off when the factors of the users
+  // do not fit in the cache (the scores are then written in random order).
+  const bool group_by_user =
+      sizeof(float) * C * N * D_ >= kGroupByUserMinBytes;
+  // Zij = H'ci * Vcj, or 0 for unknown users or items
+  auto predict = [&](uint32_t i, uint32_t j, size_t c) -> float {
+    if (i >= N || j >= M) {
+      return 0.0f;
+    } else if (use_int8) {
+      return hy_int8_.dot(c * N + i, v_int8_, c * M + j);
+    } else {
+      return cblas_sdot(D_, HY_ + c * N * D_ + i * D_, 1,
+                        V_ + c * M * D_ + j * D_, 1);
+    }
+  };
+  // Each thread predicts the next block of ratings, in order.
+  std::atomic<size_t> next_block(0);
+  auto worker = [&]() {
+    std::vector<float> Z(kTestBlock * C);
+    for (size_t b = next_block++ * kTestBlock; b < test_set->ratings_size();
+         b = next_block++ * kTestBlock) {
+      const size_t e = std::min(b + kTestBlock, test_set->ratings_size());
+      for (size_t r = b; r < e; ++r) {
+        for (size_t c = 0; c < C; ++c) {
+          Z[(r - b) * C + c] = predict(test_set->user(r), test_set->item(r), c);
+        }
+      }
+      // Z = sigmoid(Z) [Predicted ratings]
+      sigmoid((e - b) * C, Z.data());
+      memcpy(test_set->mutable_scores(b), Z.data(),
+             sizeof(float) * (e - b) * C);
+    }
+  };
+  // Each thread predicts all the ratings of the next user of the test set
+  // (found with its index, so the order of the ratings does not change):
+  // for each criterion, the factors of the items are gathered in a matrix
+  // and multiplied by the factors of the user with a single sgemv.
+  std::atomic<uint32_t> next_user(0);
+  auto user_worker = [&]() {
+    std::vector<float> Vg;
+    std::vector<float> Zg;
+    for (uint32_t i = next_user++; i < test_set->users(); i = next_user++) {
+      const Dataset::RatingsSpan ratings = test_set->ratings_by_user(i);
+      const Dataset::RatingsSpan items = test_set->items_by_user(i);
+      const size_t n = ratings.size();
+      if (n == 0) {
+        continue;
+      }
+      // Zg(t, c) = H'ci * Vcj, for the item j of the t-th rating of user i
+      Vg.resize(n * D_);
+      Zg.resize(n * C);
+      for (size_t c = 0; c < C; ++c) {
+        if (i >= N || use_int8) {
+          for (size_t t = 0; t < n; ++t) {
+            Zg[t * C + c] = predict(i, items[t], c);
+          }
+          continue;
+        }
+        for (size_t t = 0; t < n; ++t) {
+          float* Vgt = Vg.data() + t * D_;
+          if (items[t] < M) {
+            memcpy(Vgt, V_ + c * M * D_ + items[t] * D_, sizeof(float) * D_);
+          } else {
+            memset(Vgt, 0x00, sizeof(float) * D_);
+          }
+        }
+        cblas_sgemv(CblasRowMajor, CblasNoTrans, n, D_, 1.0f, Vg.data(), D_,
+                    HY_ + c * N * D_ + i * D_, 1, 0.0f, Zg.data() + c, C);
+      }
+      // Zg = sigmoid(Zg) [Predicted ratings]
+      sigmoid(n * C, Zg.data());
+      for (size_t t = 0; t < n; ++t) {
+        memcpy(test_set->mutable_scores(ratings[t]), Zg.data() + t * C,
+               sizeof(float) * C);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    if (group_by_user) {
+      workers.push_back(std::thread(user_worker));
+    } else {
+      workers.push_back(std::thread(worker));
     }
-    // Zij = sigmoid(Zij) [Predicted rating]
-    sigmoid(C, Zij);
-    memcpy(rat.scores.data(), Zij, sizeof(float) * C);
   }
-  delete [] Zij;
+  for (std::thread& w : workers) w.join();
 }
 
 float PMFModel::test(const Dataset& test_set) const {
   Dataset pred_ratings = test_set;
   pred_ratings.erase_scores();
-  CLOCK(this->test(&pred_ratings.mutable_ratings()));
+  CLOCK(this->test(&pred_ratings));
   pred_ratings.to_original_scale();
   return Dataset::rmse(test_set, pred_ratings);
 }
 
+void PMFModel::set_criteria_weights(const std::vector<float>& weights) {
+  criteria_weights_ = weights;
+}
+
+void PMFModel::set_mips_probes(uint32_t probes) {
+  mips_probes_ = probes;
+}
+
+void PMFModel::build_mips() {
+  mips_.clear();
+  if (mips_partitions_ == 0 || V_ == NULL) {
+    return;
+  }
+  const uint32_t M = data_.items();
+  const uint32_t C = data_.criteria_size();
+  mips_.resize(C);
+  for (uint32_t c = 0; c < C; ++c) {
+    mips_[c].build(V_ + c * M * D_, M, D_, mips_partitions_, mips_iters_,
+                   mips_seed_, threads());
+  }
+}
+
+void PMFModel::set_int8_factors(bool int8_factors) {
+  int8_factors_ = int8_factors;
+  if (int8_factors_ && hy_int8_.empty()) {
+    quantize_factors();
+  }
+}
+
+void PMFModel::quantize_factors() {
+  hy_int8_.clear();
+  v_int8_.clear();
+  if (HY_ == NULL || V_ == NULL) {
+    return;
+  }
+  const uint32_t C = data_.criteria_size();
+  hy_int8_.quantize(HY_, C * data_.users(), D_);
+  v_int8_.quantize(V_, C * data_.items(), D_);
+}
+
+float PMFModel::criteria_scale(std::vector<float>* scale) const {
+  const uint32_t C = data_.criteria_size();
+  // The score of item j is sum_c w_c * (sigmoid(HY_ci * V_cj) * (maxv_c -
+  // minv_c) + minv_c), so each criterion adds a scaled sigmoid to the score
+  // and the offsets are added only once, at the end.
+  scale->assign(C, 1.0f / C);
+  if (!criteria_weights_.empty()) {
+    CHECK_EQ(criteria_weights_.size(), C)
+        << "A weight for each criterion must be specified.";
+    *scale = criteria_weights_;
+  }
+  float offset = 0.0f;
+  for (uint32_t c = 0; c < C; ++c) {
+    offset += (*scale)[c] * data_.minv(c);
+    (*scale)[c] *= data_.maxv(c) - data_.minv(c);
+  }
+  return offset;
+}
+
+// Heap with the n best items seen so far (its top is the worst of them).
+typedef std::priority_queue<std::pair<float, uint32_t>,
+                            std::vector<std::pair<float, uint32_t> >,
+                            std::greater<std::pair<float, uint32_t> > > TopN;
+
+inline void top_n_push(uint32_t n, float score, uint32_t item, TopN* heap) {
+  if (heap->size() < n) {
+    heap->push(std::make_pair(score, item));
+  } else if (score > heap->top().first) {
+    heap->pop();
+    heap->push(std::make_pair(score, item));
+  }
+}
+
+void top_n_pop(TopN* heap, PMFModel::Recommendations* recs) {
+  recs->resize(heap->size());
+  for (size_t p = heap->size(); p > 0; --p) {
+    (*recs)[p - 1] = heap->top();
+    heap->pop();
+  }
+}
+
+void PMFModel::recommend(uint32_t user, uint32_t n, bool exclude_rated,
+                         Recommendations* recs) const {
+  CHECK_NOTNULL(recs);
+  std::vector<Recommendations> all_recs;
+  recommend(std::vector<uint32_t>(1, user), n, exclude_rated, &all_recs);
+  recs->swap(all_recs[0]);
+}
+
+void PMFModel::recommend(const std::vector<uint32_t>& users, uint32_t n,
+                         bool exclude_rated,
+                         std::vector<Recommendations>* recs) const {
+  CHECK_NOTNULL(recs);
+  CHECK_NOTNULL(HY_);
+  CHECK_NOTNULL(V_);
+  recs->assign(users.size(), Recommendations());
+  if (mips_probes_ > 0 && !mips_.empty()) {
+    recommend_mips(users, n, exclude_rated, recs);
+  } else {
+    recommend_exact(users, n, exclude_rated, recs);
+  }
+}
+
+void PMFModel::recommend_exact(const std::vector<uint32_t>& users,
+                               uint32_t n, bool exclude_rated,
+                               std::vector<Recommendations>* recs) const {
+  const uint32_t N = data_.users();
+  const uint32_t M = data_.items();
+  const uint32_t C = data_.criteria_size();
+  std::vector<float> scale;
+  const float offset = criteria_scale(&scale);
+  const uint32_t B = static_cast<uint32_t>(users.size());
+  std::atomic<uint32_t> next_block(0);
+  auto worker = [&]() {
+    std::vector<float> hy(static_cast<size_t>(kRecommendBlock) * D_);
+    std::vector<float> z(static_cast<size_t>(kRecommendBlock) * M);
+    std::vector<float> score(static_cast<size_t>(kRecommendBlock) * M);
+    TopN heap;
+    for (uint32_t b = next_block++ * kRecommendBlock; b < B;
+         b = next_block++ * kRecommendBlock) {
+      const uint32_t e = std::min(b + kRecommendBlock, B);
+      std::fill(score.begin(), score.end(), 0.0f);
+      for (uint32_t c = 0; c < C; ++c) {
+        // Gather the factors of the users of the block (unknown users get
+        // null factors, they are skipped below).
+        for (uint32_t k = b; k < e; ++k) {
+          float* hy_k = hy.data() + static_cast<size_t>(k - b) * D_;
+          if (users[k] < N) {
+            memcpy(hy_k, HY_ + c * N * D_ + users[k] * D_,
+                   sizeof(float) * D_);
+          } else {
+            memset(hy_k, 0x00, sizeof(float) * D_);
+          }
+        }
+        // Z = HY_block * V_c^T
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, e - b, M, D_,
+                    1.0f, hy.data(), D_, V_ + c * M * D_, D_, 0.0f,
+                    z.data(), M);
+        const size_t size = static_cast<size_t>(e - b) * M;
+        sigmoid(size, z.data());
+        cblas_saxpy(size, scale[c], z.data(), 1, score.data(), 1);
+      }
+      // Select the n best items of each user
+      for (uint32_t k = b; k < e; ++k) {
+        const uint32_t u = users[k];
+        if (u >= N || n == 0) {
+          continue;
+        }
+        const float* score_k = score.data() + static_cast<size_t>(k - b) * M;
+        const uint32_t* rated = NULL;
+        const uint32_t* rated_end = NULL;
+        if (exclude_rated) {
+          const Dataset::RatingsSpan items = data_.items_by_user(u);
+          rated = items.begin();
+          rated_end = items.end();
+        }
+        for (uint32_t j = 0; j < M; ++j) {
+          while (rated != rated_end && *rated < j) ++rated;
+          if (rated != rated_end && *rated == j) {
+            continue;
+          }
+          top_n_push(n, score_k[j] + offset, j, &heap);
+        }
+        top_n_pop(&heap, &(*recs)[k]);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+}
+
+void PMFModel::recommend_mips(const std::vector<uint32_t>& users,
+                              uint32_t n, bool exclude_rated,
+                              std::vector<Recommendations>* recs) const {
+  const uint32_t N = data_.users();
+  const uint32_t M = data_.items();
+  const uint32_t C = data_.criteria_size();
+  std::vector<float> scale;
+  const float offset = criteria_scale(&scale);
+  const uint32_t B = static_cast<uint32_t>(users.size());
+  std::atomic<uint32_t> next_user(0);
+  // Each thread takes the next user, gathers the candidate items from the
+  // index of each criterion (with a non-null weight) and scores them exactly.
+  auto worker = [&]() {
+    std::vector<uint32_t> candidates, criterion_candidates;
+    TopN heap;
+    for (uint32_t k = next_user++; k < B; k = next_user++) {
+      const uint32_t u = users[k];
+      if (u >= N || n == 0) {
+        continue;
+      }
+      candidates.clear();
+      for (uint32_t c = 0; c < C; ++c) {
+        if (scale[c] == 0.0f) {
+          continue;
+        }
+        mips_[c].candidates(HY_ + c * N * D_ + u * D_, mips_probes_,
+                            &criterion_candidates);
+        candidates.insert(candidates.end(), criterion_candidates.begin(),
+                          criterion_candidates.end());
+      }
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                       candidates.end());
+      const uint32_t* rated = NULL;
+      const uint32_t* rated_end = NULL;
+      if (exclude_rated) {
+        const Dataset::RatingsSpan items = data_.items_by_user(u);
+        rated = items.begin();
+        rated_end = items.end();
+      }
+      for (const uint32_t j : candidates) {
+        while (rated != rated_end && *rated < j) ++rated;
+        if (rated != rated_end && *rated == j) {
+          continue;
+        }
+        float z[1], s = offset;
+        for (uint32_t c = 0; c < C; ++c) {
+          z[0] = cblas_sdot(D_, HY_ + c * N * D_ + u * D_, 1,
+                            V_ + c * M * D_ + j * D_, 1);
+          sigmoid(1, z);
+          s += scale[c] * z[0];
+        }
+        top_n_push(n, s, j, &heap);
+      }
+      top_n_pop(&heap, &(*recs)[k]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads(); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+}
+
 bool PMFModel::save(const std::string& filename) const {
   PMFModelConfig config;
   if (!save(&config)) {
@@ -565,6 +1736,25 @@ bool PMFModel::save(PMFModelConfig* config) const {
   config->set_lw(lW_);
   config->set_matrix_init(matrix_init_id_);
   config->set_momentum(momentum_);
+  config->set_hy_refresh_iters(hy_refresh_iters_);
+  config->set_sparse_updates(sparse_updates_);
+  config->set_eval_iters(eval_iters_);
+  config->set_sgd_threads(sgd_threads_);
+  config->set_sgd_schedule(sgd_schedule_);
+  config->set_optimizer(optimizer_);
+  config->set_gn_damping(gn_damping_);
+  config->set_mips_partitions(mips_partitions_);
+  config->set_mips_iters(mips_iters_);
+  config->set_mips_probes(mips_probes_);
+  config->set_mips_seed(mips_seed_);
+  for (const MIPSIndex& index : mips_) {
+    index.save(config->add_mips_index());
+  }
+  config->set_int8_factors(int8_factors_);
+  if (int8_factors_ && !hy_int8_.empty()) {
+    hy_int8_.save(config->mutable_hy_int8());
+    v_int8_.save(config->mutable_v_int8());
+  }
   return true;
 }
 
@@ -610,6 +1800,54 @@ bool PMFModel::load(const PMFModelConfig& config) {
   lW_ = config.lw();
   matrix_init_id_ = config.matrix_init();
   momentum_ = config.momentum();
+  hy_refresh_iters_ = config.hy_refresh_iters();
+  sparse_updates_ = config.sparse_updates();
+  eval_iters_ = config.eval_iters();
+  sgd_threads_ = config.sgd_threads();
+  sgd_schedule_ = config.sgd_schedule();
+  optimizer_ = config.optimizer();
+  gn_damping_ = config.gn_damping();
+  mips_partitions_ = config.mips_partitions();
+  mips_iters_ = config.mips_iters();
+  mips_probes_ = config.mips_probes();
+  mips_seed_ = config.mips_seed();
+  // Load the MIPS index, or build it if it was not stored
+  if (config.mips_index_size() > 0) {
+    if (config.mips_index_size() !=
+        static_cast<int>(data_.criteria_size())) {
+      LOG(ERROR) << "PMFModel: Invalid MIPS index.";
+      return false;
+    }
+    mips_.resize(config.mips_index_size());
+    for (int c = 0; c < config.mips_index_size(); ++c) {
+      if (!mips_[c].load(config.mips_index(c), data_.items(), D_)) {
+        return false;
+      }
+    }
+  } else {
+    build_mips();
+  }
+  // Load the quantized factors, or quantize them if they were not stored
+  int8_factors_ = config.int8_factors();
+  hy_int8_.clear();
+  v_int8_.clear();
+  if (int8_factors_) {
+    if (config.has_hy_int8() && config.has_v_int8()) {
+      if (!hy_int8_.load(config.hy_int8()) || !v_int8_.load(config.v_int8())) {
+        return false;
+      }
+      // dot() reads the rows of both matrices with the same stride
+      const uint32_t stride = (D_ + kInt8Block - 1) / kInt8Block * kInt8Block;
+      if (hy_int8_.rows() != data_.criteria_size() * data_.users() ||
+          v_int8_.rows() != data_.criteria_size() * data_.items() ||
+          hy_int8_.stride() != stride || v_int8_.stride() != stride) {
+        LOG(ERROR) << "PMFModel: Invalid quantized factors.";
+        return false;
+      }
+    } else {
+      quantize_factors();
+    }
+  }
   return true;
 }
 
@@ -647,6 +1885,15 @@ std::string PMFModel::info() const {
   snprintf(buff, sizeof(buff), "lV = %f\n", lV_);
   msg += buff;
   snprintf(buff, sizeof(buff), "lW = %f\n", lW_);
+  if (mips_partitions_ > 0) {
+    snprintf(buff, sizeof(buff), "MIPS partitions = %u\n", mips_partitions_);
+    msg += buff;
+    snprintf(buff, sizeof(buff), "MIPS probes = %u\n", mips_probes_);
+    msg += buff;
+  }
+  if (int8_factors_) {
+    msg += "Int8 factors = true\n";
+  }
   msg += data_.info(0);
   return msg;
 }
@@ -18,16 +18,24 @@
 
 #include <model.h>
 #include <dataset.h>
+#include <mips-index.h>
+#include <quantized-matrix.h>
 #include <protos/pmf-model.pb.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 using mcfs::protos::PMFModelConfig;
 using mcfs::protos::PMFModelConfig_MatrixInit;
+using mcfs::protos::PMFModelConfig_Optimizer;
+using mcfs::protos::PMFModelConfig_SGDSchedule;
 
 class PMFModel : public Model {
  public:
+  // Recommended items, as pairs (score, item) by decreasing score.
+  typedef std::vector<std::pair<float, uint32_t> > Recommendations;
+
   PMFModel();
   ~PMFModel();
 
@@ -36,13 +44,36 @@ class PMFModel : public Model {
   bool load(const PMFModelConfig& config);
   bool load(const std::string& filename);
   bool load_string(const std::string& str);
-  void test(std::vector<Dataset::Rating>* test_set) const;
+  void test(Dataset* test_set) const;
   float test(const Dataset& test_set) const;
   float train(const Dataset& train_set, const Dataset& valid_set);
   bool save(PMFModelConfig* config) const;
   bool save(const std::string& filename) const;
   bool save_string(std::string* str) const;
 
+  // Number of users and items of the training data.
+  inline uint32_t users() const { return data_.users(); }
+  inline uint32_t items() const { return data_.items(); }
+
+  // Weights of the criteria used to rank the items: the score of an item is
+  // the weighted sum of its predicted ratings (in the original scale). By
+  // default (empty) all the criteria have the same weight, 1 / criteria.
+  void set_criteria_weights(const std::vector<float>& weights);
+  // Stores in 'recs' the n items with the highest score for 'user', never
+  // the items rated by the user in the training data if 'exclude_rated'.
+  void recommend(uint32_t user, uint32_t n, bool exclude_rated,
+                 Recommendations* recs) const;
+  // Same as above for many users at once (much faster than one by one): the
+  // scores of blocks of users are computed as matrix products, in parallel.
+  void recommend(const std::vector<uint32_t>& users, uint32_t n,
+                 bool exclude_rated, std::vector<Recommendations>* recs) const;
+  // Number of partitions of the MIPS index probed by the recommendations
+  // (0 = score all the items). Ignored if the model has no MIPS index.
+  void set_mips_probes(uint32_t probes);
+  // Whether the predictions use the factors quantized to 8-bit integers
+  // (they are quantized if needed, and stored by save()).
+  void set_int8_factors(bool int8_factors);
+
  private:
   Dataset data_;
   uint32_t D_;
@@ -58,6 +89,34 @@ class PMFModel : public Model {
   float* V_;
   float* W_;
   float* HY_;  // HY = H + Y
+  std::vector<float> criteria_weights_;
+  uint32_t mips_partitions_;
+  uint32_t mips_iters_;
+  uint32_t mips_probes_;
+  uint64_t mips_seed_;
+  std::vector<MIPSIndex> mips_;  // MIPS index of each criterion
+  bool int8_factors_;
+  QuantizedMatrix hy_int8_;
+  QuantizedMatrix v_int8_;
+  uint32_t hy_refresh_iters_;
+  bool sparse_updates_;
+  uint32_t eval_iters_;
+  uint32_t sgd_threads_;
+  PMFModelConfig_SGDSchedule sgd_schedule_;
+  PMFModelConfig_Optimizer optimizer_;
+  float gn_damping_;
+
+  void build_mips();
+  void quantize_factors();
+  // Stores in 'scale' the factor of the sigmoid of each criterion in the
+  // score of an item, and returns the constant term of the score.
+  float criteria_scale(std::vector<float>* scale) const;
+  void recommend_exact(const std::vector<uint32_t>& users, uint32_t n,
+                       bool exclude_rated,
+                       std::vector<Recommendations>* recs) const;
+  void recommend_mips(const std::vector<uint32_t>& users, uint32_t n,
+                      bool exclude_rated,
+                      std::vector<Recommendations>* recs) const;
 };
 
 #endif  // PMF_MODEL_H_
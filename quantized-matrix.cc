@@ -0,0 +1,171 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <quantized-matrix.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <glog/logging.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+
+int32_t int8_dot_scalar(const int8_t* a, const int8_t* b, size_t n) {
+  int32_t s = 0;
+  for (size_t i = 0; i < n; ++i) {
+    s += static_cast<int32_t>(a[i]) * b[i];
+  }
+  return s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Sign-extends blocks of 16 values to 16 bits and multiplies them, adding
+// adjacent pairs of products into 32-bit lanes.
+__attribute__((target("avx2")))
+int32_t int8_dot_avx2(const int8_t* a, const int8_t* b, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  for (size_t i = 0; i < n; i += 16) {
+    const __m256i va = _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+    const __m256i vb = _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+  const __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                  _mm256_extracti128_si256(acc, 1));
+  const __m128i s2 = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  return _mm_cvtsi128_si32(_mm_add_epi32(s2, _mm_shuffle_epi32(s2, 0xb1)));
+}
+
+// Multiplies blocks of 32 values and adds groups of 4 products into 32-bit
+// lanes with a single VNNI instruction. The instruction multiplies unsigned
+// by signed bytes, so it is given a + 128 (a with its sign bit flipped),
+// and 128 * sum(b) (also computed with VNNI) is subtracted at the end. The
+// last block of 16 values, if any, uses the 128-bit instruction. Rows of a
+// single block are faster with int8_dot_avx2(), which has no correction.
+__attribute__((target("avx2,avx512vl,avx512vnni")))
+int32_t int8_dot_vnni(const int8_t* a, const int8_t* b, size_t n) {
+  if (n < 32) return int8_dot_avx2(a, b, n);
+  const __m256i flip = _mm256_set1_epi8(static_cast<char>(0x80));
+  const __m256i ones = _mm256_set1_epi8(1);
+  __m256i acc = _mm256_setzero_si256();
+  __m256i sum_b = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i va = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)), flip);
+    const __m256i vb =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    acc = _mm256_dpbusd_epi32(acc, va, vb);
+    sum_b = _mm256_dpbusd_epi32(sum_b, ones, vb);
+  }
+  __m128i acc4 = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                               _mm256_extracti128_si256(acc, 1));
+  __m128i sum_b4 = _mm_add_epi32(_mm256_castsi256_si128(sum_b),
+                                 _mm256_extracti128_si256(sum_b, 1));
+  if (i < n) {
+    const __m128i va = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+        _mm256_castsi256_si128(flip));
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    acc4 = _mm_dpbusd_epi32(acc4, va, vb);
+    sum_b4 = _mm_dpbusd_epi32(sum_b4, _mm256_castsi256_si128(ones), vb);
+  }
+  const __m128i s = _mm_sub_epi32(acc4, _mm_slli_epi32(sum_b4, 7));
+  const __m128i s2 = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  return _mm_cvtsi128_si32(_mm_add_epi32(s2, _mm_shuffle_epi32(s2, 0xb1)));
+}
+
+#endif
+
+typedef int32_t (*Int8DotKernel)(const int8_t*, const int8_t*, size_t);
+
+static Int8DotKernel select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512vnni") &&
+      __builtin_cpu_supports("avx512vl")) {
+    return &int8_dot_vnni;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return &int8_dot_avx2;
+  }
+#endif
+  return &int8_dot_scalar;
+}
+
+static const Int8DotKernel kInt8DotKernel = select_kernel();
+
+int32_t int8_dot(const int8_t* a, const int8_t* b, size_t n) {
+  return kInt8DotKernel(a, b, n);
+}
+
+QuantizedMatrix::QuantizedMatrix() : rows_(0), stride_(0) {}
+
+void QuantizedMatrix::clear() {
+  rows_ = 0;
+  stride_ = 0;
+  values_.clear();
+  scale_.clear();
+}
+
+void QuantizedMatrix::quantize(const float* m, uint32_t rows, uint32_t cols) {
+  CHECK_NOTNULL(m);
+  clear();
+  rows_ = rows;
+  stride_ = (cols + kInt8Block - 1) / kInt8Block * kInt8Block;
+  values_.assign(static_cast<size_t>(rows) * stride_, 0);
+  scale_.assign(rows, 0.0f);
+  for (uint32_t r = 0; r < rows; ++r) {
+    const float* mr = m + static_cast<size_t>(r) * cols;
+    float maxv = 0.0f;
+    for (uint32_t c = 0; c < cols; ++c) {
+      maxv = std::max(maxv, fabsf(mr[c]));
+    }
+    if (maxv == 0.0f) {
+      continue;
+    }
+    scale_[r] = maxv / 127.0f;
+    int8_t* vr = &values_[static_cast<size_t>(r) * stride_];
+    for (uint32_t c = 0; c < cols; ++c) {
+      vr[c] = static_cast<int8_t>(lrintf(mr[c] / scale_[r]));
+    }
+  }
+}
+
+void QuantizedMatrix::save(PMFModelConfig_QuantizedMatrix* config) const {
+  CHECK_NOTNULL(config);
+  config->Clear();
+  config->set_values(std::string(values_.begin(), values_.end()));
+  for (const float s : scale_) config->add_scale(s);
+}
+
+bool QuantizedMatrix::load(const PMFModelConfig_QuantizedMatrix& config) {
+  clear();
+  if (config.scale_size() == 0 ||
+      config.values().size() % config.scale_size() != 0 ||
+      config.values().size() / config.scale_size() % kInt8Block != 0) {
+    LOG(ERROR) << "QuantizedMatrix: Invalid matrix.";
+    return false;
+  }
+  rows_ = config.scale_size();
+  stride_ = config.values().size() / rows_;
+  values_.assign(config.values().begin(), config.values().end());
+  scale_.assign(config.scale().begin(), config.scale().end());
+  return true;
+}
@@ -0,0 +1,73 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef QUANTIZED_MATRIX_H_
+#define QUANTIZED_MATRIX_H_
+
+#include <protos/pmf-model.pb.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using mcfs::protos::PMFModelConfig_QuantizedMatrix;
+
+// Dot product of two vectors of n 8-bit integers, where n is a multiple of
+// kInt8Block. Uses the fastest kernel supported by the CPU (detected at
+// runtime).
+static const size_t kInt8Block = 16;
+int32_t int8_dot(const int8_t* a, const int8_t* b, size_t n);
+
+// Individual kernels.
+int32_t int8_dot_scalar(const int8_t* a, const int8_t* b, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+int32_t int8_dot_avx2(const int8_t* a, const int8_t* b, size_t n);
+int32_t int8_dot_vnni(const int8_t* a, const int8_t* b, size_t n);
+#endif
+
+// Matrix of floats quantized to 8-bit integers with a scale per row (the
+// maximum absolute value of the row maps to 127). The rows are padded with
+// zeros to a multiple of kInt8Block values.
+class QuantizedMatrix {
+ public:
+  QuantizedMatrix();
+
+  void quantize(const float* m, uint32_t rows, uint32_t cols);
+  void clear();
+  inline bool empty() const { return rows_ == 0; }
+  inline uint32_t rows() const { return rows_; }
+  // Values stored per row (the columns, padded to a multiple of kInt8Block).
+  inline uint32_t stride() const { return stride_; }
+
+  // Approximate dot product of row r of this matrix and row s of 'other'
+  // (which must have the same number of columns).
+  inline float dot(uint32_t r, const QuantizedMatrix& other,
+                   uint32_t s) const {
+    return int8_dot(&values_[static_cast<size_t>(r) * stride_],
+                    &other.values_[static_cast<size_t>(s) * stride_],
+                    stride_) * scale_[r] * other.scale_[s];
+  }
+
+  void save(PMFModelConfig_QuantizedMatrix* config) const;
+  bool load(const PMFModelConfig_QuantizedMatrix& config);
+
+ private:
+  uint32_t rows_;
+  uint32_t stride_;
+  std::vector<int8_t> values_;
+  std::vector<float> scale_;
+};
+
+#endif  // QUANTIZED_MATRIX_H_
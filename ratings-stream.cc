@@ -0,0 +1,181 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ratings-stream.h>
+
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <limits>
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using mcfs::protos::Rating;
+using mcfs::protos::Ratings;
+
+const char kRatingsStreamMagic[8] = {'M', 'C', 'F', 'S', 'S', 'T', 'R', 0};
+
+RatingsStreamWriter::RatingsStreamWriter(int fd, uint32_t block_size)
+    : fs_(fd), block_size_(block_size), header_written_(false),
+      closed_(false), ok_(true) {
+  CHECK_GT(block_size_, 0);
+}
+
+RatingsStreamWriter::~RatingsStreamWriter() {
+  close();
+}
+
+bool RatingsStreamWriter::write_header(const Ratings& header) {
+  CHECK(!header_written_) << "The header was already written.";
+  CHECK_EQ(header.rating_size(), 0) << "The header can not contain ratings.";
+  {
+    CodedOutputStream coded(&fs_);
+    coded.WriteRaw(kRatingsStreamMagic, sizeof(kRatingsStreamMagic));
+    ok_ = ok_ && !coded.HadError();
+  }
+  header_written_ = true;
+  return write_message(header);
+}
+
+Rating* RatingsStreamWriter::add_rating() {
+  CHECK(!closed_);
+  if (static_cast<uint32_t>(block_.rating_size()) >= block_size_) {
+    flush();
+  }
+  return block_.add_rating();
+}
+
+bool RatingsStreamWriter::close(const Ratings* trailer) {
+  if (closed_) {
+    return ok_;
+  }
+  if (block_.rating_size() > 0 || !header_written_) {
+    flush();
+  }
+  // The trailer is written as a block without ratings
+  if (trailer != NULL) {
+    CHECK_EQ(trailer->rating_size(), 0);
+    write_message(*trailer);
+  }
+  closed_ = true;
+  ok_ = fs_.Flush() && ok_;
+  return ok_;
+}
+
+bool RatingsStreamWriter::flush() {
+  if (!header_written_) {
+    write_header(Ratings());
+  }
+  write_message(block_);
+  block_.Clear();
+  return ok_;
+}
+
+bool RatingsStreamWriter::write_message(const Ratings& msg) {
+  // The size is written as a varint32, and read back as the (int) limit of
+  // the message, which protobuf caps at 2 GB anyway.
+  const size_t size = msg.ByteSizeLong();
+  if (size > static_cast<size_t>(std::numeric_limits<int>::max())) {
+    LOG(ERROR) << "RatingsStreamWriter: Block too large (" << size
+               << " bytes).";
+    ok_ = false;
+    return false;
+  }
+  CodedOutputStream coded(&fs_);
+  coded.WriteVarint32(static_cast<uint32_t>(size));
+  msg.SerializeWithCachedSizes(&coded);
+  ok_ = ok_ && !coded.HadError();
+  LOG_IF(ERROR, !ok_) << "RatingsStreamWriter: Failed to write.";
+  return ok_;
+}
+
+RatingsStreamReader::RatingsStreamReader(int fd) : fs_(fd), ok_(true) {
+}
+
+bool RatingsStreamReader::open() {
+  char magic[sizeof(kRatingsStreamMagic)];
+  {
+    CodedInputStream coded(&fs_);
+    ok_ = coded.ReadRaw(magic, sizeof(magic)) &&
+        memcmp(magic, kRatingsStreamMagic, sizeof(magic)) == 0;
+  }
+  if (!ok_) {
+    LOG(ERROR) << "RatingsStreamReader: Not a ratings stream.";
+    return false;
+  }
+  Ratings header;
+  if (!read_message(&header)) {
+    ok_ = false;
+    LOG(ERROR) << "RatingsStreamReader: Failed to read the header.";
+    return false;
+  }
+  merge_metadata(header);
+  return true;
+}
+
+bool RatingsStreamReader::next(Ratings* block) {
+  CHECK_NOTNULL(block);
+  if (!ok_ || !read_message(block)) {
+    return false;
+  }
+  merge_metadata(*block);
+  return true;
+}
+
+bool RatingsStreamReader::read_message(Ratings* msg) {
+  CodedInputStream coded(&fs_);
+  uint32_t size = 0;
+  if (!coded.ReadVarint32(&size)) {
+    // End of the stream
+    return false;
+  }
+  const CodedInputStream::Limit limit = coded.PushLimit(size);
+  if (!msg->ParseFromCodedStream(&coded) || !coded.ConsumedEntireMessage()) {
+    LOG(ERROR) << "RatingsStreamReader: Failed to parse a block.";
+    ok_ = false;
+    return false;
+  }
+  coded.PopLimit(limit);
+  return true;
+}
+
+void RatingsStreamReader::merge_metadata(const Ratings& msg) {
+  if (msg.has_criteria_size()) {
+    header_.set_criteria_size(msg.criteria_size());
+  }
+  if (msg.minv_size() > 0) {
+    header_.mutable_minv()->CopyFrom(msg.minv());
+  }
+  if (msg.maxv_size() > 0) {
+    header_.mutable_maxv()->CopyFrom(msg.maxv());
+  }
+  if (msg.precision_size() > 0) {
+    header_.mutable_precision()->CopyFrom(msg.precision());
+  }
+  if (msg.has_num_users()) {
+    header_.set_num_users(msg.num_users());
+  }
+  if (msg.has_num_items()) {
+    header_.set_num_items(msg.num_items());
+  }
+}
+
+bool RatingsStreamReader::is_stream(int fd) {
+  char magic[sizeof(kRatingsStreamMagic)];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      memcmp(magic, kRatingsStreamMagic, sizeof(magic)) == 0;
+}
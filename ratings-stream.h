@@ -0,0 +1,90 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RATINGS_STREAM_H_
+#define RATINGS_STREAM_H_
+
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <protos/ratings.pb.h>
+#include <stdint.h>
+
+#include <string>
+
+// Chunked variant of the mcfs.protos.Ratings format, which can be read and
+// written with bounded memory. A stream file is the magic string
+// kRatingsStreamMagic followed by a sequence of length-delimited (varint32)
+// mcfs.protos.Ratings messages:
+//   - The first message is the header: it carries the dataset metadata
+//     (criteria size, min/max values, precision, number of users/items)
+//     and no ratings.
+//   - Each following message is a block of at most block_size ratings.
+//     Any metadata field set in a block overrides the one in the header.
+//     This allows writers to leave the metadata that is only known at the
+//     end (i.e. the number of users) for the last block.
+extern const char kRatingsStreamMagic[8];
+
+class RatingsStreamWriter {
+ public:
+  explicit RatingsStreamWriter(int fd, uint32_t block_size = 65536);
+  ~RatingsStreamWriter();
+
+  // Write the header. If it is not called before the first rating, an
+  // empty header is written.
+  bool write_header(const mcfs::protos::Ratings& header);
+  // Add a new rating to the current block. The block is written to the
+  // stream when it gets full.
+  mcfs::protos::Rating* add_rating();
+  // Write the pending ratings and the optional trailing metadata.
+  bool close(const mcfs::protos::Ratings* trailer = NULL);
+
+ private:
+  bool flush();
+  bool write_message(const mcfs::protos::Ratings& msg);
+
+  google::protobuf::io::FileOutputStream fs_;
+  mcfs::protos::Ratings block_;
+  uint32_t block_size_;
+  bool header_written_;
+  bool closed_;
+  bool ok_;
+};
+
+class RatingsStreamReader {
+ public:
+  explicit RatingsStreamReader(int fd);
+
+  // Check the magic string and read the header.
+  bool open();
+  // Read the next block of ratings. Returns false at the end of the stream
+  // or if the stream is corrupted (see ok()).
+  bool next(mcfs::protos::Ratings* block);
+  // Metadata merged from the header and the blocks read so far.
+  inline const mcfs::protos::Ratings& header() const { return header_; }
+  inline bool ok() const { return ok_; }
+
+  // Returns true if the file descriptor points to a stream file. The read
+  // offset of fd is restored.
+  static bool is_stream(int fd);
+
+ private:
+  bool read_message(mcfs::protos::Ratings* msg);
+  void merge_metadata(const mcfs::protos::Ratings& msg);
+
+  google::protobuf::io::FileInputStream fs_;
+  mcfs::protos::Ratings header_;
+  bool ok_;
+};
+
+#endif  // RATINGS_STREAM_H_
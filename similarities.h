@@ -6,198 +6,320 @@
 #include <algorithm>
 #include <stddef.h>
 #include <glog/logging.h>
+#include <dataset.h>
+#include <protos/neighbours-model.pb.h>
 
-template<typename T>
-float v_norm2(const std::vector<T>& v) {
-  float s = 0.0f;
-  for (const auto& x : v) {
-    s += x * x;
-  }
-  return sqrt(s);
+using mcfs::protos::NeighboursModelConfig;
+using mcfs::protos::NeighboursModelConfig_Similarity;
+
+// Pairs of common ratings of two users (or two items), see
+// Dataset::get_common_ratings_by_users() and
+// Dataset::get_common_ratings_by_items(). Each thread reuses the same
+// buffers in all its calls.
+struct CommonRatings {
+  std::vector<uint32_t> r1;
+  std::vector<uint32_t> r2;
+};
+
+inline CommonRatings& common_ratings() {
+  static thread_local CommonRatings buffer;
+  return buffer;
 }
 
-class Similarity {
- public:
-  virtual ~Similarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    CHECK_EQ(a.size(), b.size());
-    return 0.0f;
+// Statically specialized similarity kernels. Each one computes, in a static
+// compute() function, the similarity between the pairs of common ratings
+// of two users (or items) in a dataset, so that the loops using a kernel
+// can be instantiated for it and inline it.
+
+// Cosine of the common ratings (just the dot product if Normalize is
+// false).
+template <bool Normalize>
+struct CosineKernel {
+  static const bool kNormalize = Normalize;
+  static const bool kDistance = false;
+  static const bool kMaxDistance = false;
+  // Similarity from the sums over the common ratings (see
+  // OneVsAllSimilarity).
+  static inline float from_sums(float dot, float norm1, float norm2,
+                                float dist) {
+    return Normalize ? dot / (sqrt(norm1) * sqrt(norm2)) : dot;
+  }
+  static inline float compute(const Dataset& data,
+                              const CommonRatings& common) {
+    const size_t criteria = data.criteria_size();
+    const size_t n = common.r1.size();
+    if (n == 0) {
+      return 0.0f;
+    }
+    float s = 0.0f, sa = 0.0f, sb = 0.0f;
+    for (size_t k = 0; k < n; ++k) {
+      const float* a = data.scores(common.r1[k]);
+      const float* b = data.scores(common.r2[k]);
+      for (size_t c = 0; c < criteria; ++c) {
+        s += a[c] * b[c];
+        if (Normalize) {
+          sa += a[c] * a[c];
+          sb += b[c] * b[c];
+        }
+      }
+    }
+    return Normalize ? s / (sqrt(sa) * sqrt(sb)) : s;
   }
 };
 
-class CosineSimilarity : public Similarity {
-public:
-  virtual ~CosineSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    CHECK_EQ(a.size(), b.size());
-    if (a.size() == 0) {
-      return 0.0f;
+// Sum (or maximum, if Max) of the absolute differences between the common
+// ratings, normalized by the norm of each side's ratings if Normalize.
+template <bool Max, bool Normalize>
+inline float norm_distance(const Dataset& data, const CommonRatings& common) {
+  const size_t criteria = data.criteria_size();
+  const size_t n = common.r1.size();
+  // The vectors are normalized using the norms of the common ratings, so
+  // the pairs of common ratings are visited twice.
+  float la = 1.0f, lb = 1.0f;
+  if (Normalize) {
+    float sa = 0.0f, sb = 0.0f;
+    for (size_t k = 0; k < n; ++k) {
+      const float* a = data.scores(common.r1[k]);
+      const float* b = data.scores(common.r2[k]);
+      for (size_t c = 0; c < criteria; ++c) {
+        sa += a[c] * a[c];
+        sb += b[c] * b[c];
+      }
     }
-    float s = 0.0f;
-    for (size_t i = 0; i < a.size(); ++i) {
-      s += a[i]*b[i];
+    la = sqrt(sa);
+    lb = sqrt(sb);
+  }
+  float s = Max ? -INFINITY : 0.0f;
+  for (size_t k = 0; k < n; ++k) {
+    const float* a = data.scores(common.r1[k]);
+    const float* b = data.scores(common.r2[k]);
+    for (size_t c = 0; c < criteria; ++c) {
+      const float d = fabs(a[c] / la - b[c] / lb);
+      s = Max ? std::max<float>(s, d) : s + d;
     }
-    if (normalize) {
-      return s / (v_norm2<float>(a) * v_norm2<float>(b));
-    } else {
-      return s;
+  }
+  return s;
+}
+
+// Inverse of the P-norm of the difference between the common ratings.
+template <int P, bool Normalize>
+struct NormKernel {
+  static const bool kNormalize = Normalize;
+  static const bool kDistance = true;
+  static const bool kMaxDistance = false;
+  static inline float from_sums(float dot, float norm1, float norm2,
+                                float dist) {
+    return dist > 0 ? 1.0f / pow(dist, 1.0f / P) : INFINITY;
+  }
+  static inline float compute(const Dataset& data,
+                              const CommonRatings& common) {
+    if (common.r1.empty()) {
+      return 0.0f;
     }
+    const float s = norm_distance<false, Normalize>(data, common);
+    return s > 0 ? 1.0f / pow(s, 1.0f / P) : INFINITY;
   }
 };
 
-class CosineSqrtSimilarity : public CosineSimilarity {
-public:
-  virtual ~CosineSqrtSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    const float s = CosineSimilarity::operator()(a, b, normalize);
-    return sqrt(s);
+// Inverse of the infinity-norm of the difference between the common
+// ratings.
+template <bool Normalize>
+struct InfNormKernel {
+  static const bool kNormalize = Normalize;
+  static const bool kDistance = true;
+  static const bool kMaxDistance = true;
+  static inline float from_sums(float dot, float norm1, float norm2,
+                                float dist) {
+    return dist > 0 ? 1.0f / dist : INFINITY;
+  }
+  static inline float compute(const Dataset& data,
+                              const CommonRatings& common) {
+    if (common.r1.empty()) {
+      return 0.0f;
+    }
+    const float s = norm_distance<true, Normalize>(data, common);
+    return s > 0 ? 1.0f / s : INFINITY;
   }
 };
 
-class CosinePow2Similarity : public CosineSimilarity {
-public:
-  virtual ~CosinePow2Similarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    const float s = CosineSimilarity::operator()(a, b, normalize);
-    return s*s;
-  }
+struct SqrtTransform {
+  static inline float apply(float f) { return sqrt(f); }
 };
 
-class CosineExpSimilarity : public CosineSimilarity {
-public:
-  virtual ~CosineExpSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    const float s = CosineSimilarity::operator()(a, b, normalize);
-    return exp(s);
-  }
+struct Pow2Transform {
+  static inline float apply(float f) { return f * f; }
 };
 
-class NormSimilarity : public Similarity {
-private:
-  float p;
-public:
-  NormSimilarity(float p) : p(p) {}
-  virtual ~NormSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    CHECK_EQ(a.size(), b.size());
-    if (a.size() == 0) {
-      return 0.0f;
-    }
-    const std::vector<float> * va = &a;
-    const std::vector<float> * vb = &b;
-    std::vector<float> a_norm;
-    std::vector<float> b_norm;
-    // Normalize vectors before compute the euclidean distance
-    if (normalize) {
-      const float la = v_norm2(a);
-      const float lb = v_norm2(b);
-      a_norm.assign(a.begin(), a.end());
-      b_norm.assign(b.begin(), b.end());
-      for (size_t i = 0; i < a.size(); ++i) {
-        a_norm[i] /= la;
-        b_norm[i] /= lb;
-      }
-      va = &a_norm;
-      vb = &b_norm;
-    }
-    // Compute the P-norm of va - vb
-    float s = 0.0f;
-    for (size_t i = 0; i < va->size(); ++i) {
-      s += fabs(va->at(i) - vb->at(i));
-    }
-    if (s > 0) {
-      return 1.0f / pow(s, 1.0f / p);
-    } else {
-      return INFINITY;
-    }
+struct ExpTransform {
+  static inline float apply(float f) { return exp(f); }
+};
+
+// Kernel followed by a transformation of the similarity.
+template <typename Kernel, typename Transform>
+struct TransformedKernel {
+  static const bool kNormalize = Kernel::kNormalize;
+  static const bool kDistance = Kernel::kDistance;
+  static const bool kMaxDistance = Kernel::kMaxDistance;
+  static inline float from_sums(float dot, float norm1, float norm2,
+                                float dist) {
+    return Transform::apply(Kernel::from_sums(dot, norm1, norm2, dist));
+  }
+  static inline float compute(const Dataset& data,
+                              const CommonRatings& common) {
+    return Transform::apply(Kernel::compute(data, common));
   }
 };
 
-class InfNormSimilarity : public Similarity {
-public:
-  virtual ~InfNormSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    CHECK_EQ(a.size(), b.size());
-    if (a.size() == 0) {
-      return 0.0f;
+// Similarity between two users, from the items rated by both.
+template <typename Kernel>
+inline float user_similarity(const Dataset& data, uint32_t user1,
+                             uint32_t user2) {
+  CommonRatings& common = common_ratings();
+  data.get_common_ratings_by_users(user1, user2, &common.r1, &common.r2);
+  return Kernel::compute(data, common);
+}
+
+// Similarity between two items, from the users that rated both.
+template <typename Kernel>
+inline float item_similarity(const Dataset& data, uint32_t item1,
+                             uint32_t item2) {
+  CommonRatings& common = common_ratings();
+  data.get_common_ratings_by_items(item1, item2, &common.r1, &common.r2);
+  return Kernel::compute(data, common);
+}
+
+// Similarities between one user and all the users with some common rating,
+// computed in a single sweep over the raters of the items of the user
+// (two sweeps for the distance kernels, which first need the norms of the
+// common ratings). The sums of each pair are accumulated in dense arrays
+// indexed by user, in the same order as user_similarity(), so the results
+// are identical. Worth it when several similarities of the same user are
+// needed.
+template <typename Kernel>
+class OneVsAllSimilarity {
+ public:
+  void compute(const Dataset& data, uint32_t user) {
+    if (sim_.size() != data.users()) {
+      dot_.assign(data.users(), 0.0f);
+      norm1_.assign(data.users(), 0.0f);
+      norm2_.assign(data.users(), 0.0f);
+      dist_.assign(data.users(), 0.0f);
+      sim_.assign(data.users(), 0.0f);
+      touched_.clear();
+    }
+    for (const uint32_t v : touched_) {
+      dot_[v] = norm1_[v] = norm2_[v] = dist_[v] = sim_[v] = 0.0f;
     }
-    const std::vector<float> * va = &a;
-    const std::vector<float> * vb = &b;
-    std::vector<float> a_norm;
-    std::vector<float> b_norm;
-    // Normalize vectors before compute the euclidean distance
-    if (normalize) {
-      const float la = v_norm2(a);
-      const float lb = v_norm2(b);
-      a_norm.assign(a.begin(), a.end());
-      b_norm.assign(b.begin(), b.end());
-      for (size_t i = 0; i < a.size(); ++i) {
-        a_norm[i] /= la;
-        b_norm[i] /= lb;
+    touched_.clear();
+    const size_t criteria = data.criteria_size();
+    for (const uint32_t r : data.ratings_by_user(user)) {
+      const float* a = data.scores(r);
+      for (const uint32_t r2 : data.ratings_by_item(data.item(r))) {
+        const uint32_t v = data.user(r2);
+        const float* b = data.scores(r2);
+        if (sim_[v] == 0.0f) {
+          // Mark as touched until the similarities are computed
+          sim_[v] = 1.0f;
+          touched_.push_back(v);
+        }
+        for (size_t c = 0; c < criteria; ++c) {
+          if (!Kernel::kDistance) {
+            dot_[v] += a[c] * b[c];
+          }
+          if (Kernel::kNormalize) {
+            norm1_[v] += a[c] * a[c];
+            norm2_[v] += b[c] * b[c];
+          }
+        }
       }
-      va = &a_norm;
-      vb = &b_norm;
     }
-    // Compute the infinity-norm of va - vb
-    float s = -INFINITY;
-    for (size_t i = 0; i < va->size(); ++i) {
-      s = std::max<float>(s, fabs(va->at(i) - vb->at(i)));
+    if (Kernel::kDistance) {
+      // Norms of the common ratings of each pair, used to normalize them
+      for (const uint32_t v : touched_) {
+        norm1_[v] = Kernel::kNormalize ? sqrt(norm1_[v]) : 1.0f;
+        norm2_[v] = Kernel::kNormalize ? sqrt(norm2_[v]) : 1.0f;
+        dist_[v] = Kernel::kMaxDistance ? -INFINITY : 0.0f;
+      }
+      for (const uint32_t r : data.ratings_by_user(user)) {
+        const float* a = data.scores(r);
+        for (const uint32_t r2 : data.ratings_by_item(data.item(r))) {
+          const uint32_t v = data.user(r2);
+          const float* b = data.scores(r2);
+          const float la = norm1_[v], lb = norm2_[v];
+          for (size_t c = 0; c < criteria; ++c) {
+            const float d = fabs(a[c] / la - b[c] / lb);
+            dist_[v] = Kernel::kMaxDistance ?
+                std::max<float>(dist_[v], d) : dist_[v] + d;
+          }
+        }
+      }
     }
-    if (s > 0) {
-      return 1.0f / s;
-    } else {
-      return INFINITY;
+    for (const uint32_t v : touched_) {
+      sim_[v] = Kernel::from_sums(dot_[v], norm1_[v], norm2_[v], dist_[v]);
     }
   }
-};
-
-class NormExpSimilarity : public NormSimilarity {
-public:
-  NormExpSimilarity(float p) : NormSimilarity(p) {}
-  virtual ~NormExpSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    const float f = NormSimilarity::operator()(a, b, normalize);
-    return exp(f);
-  }
-};
-
-class InfNormExpSimilarity : public InfNormSimilarity {
-public:
-  virtual ~InfNormExpSimilarity() {}
-  virtual float operator() (
-      const std::vector<float>& a, const std::vector<float>& b,
-      bool normalize = true) const {
-    const float f = InfNormSimilarity::operator()(a, b, normalize);
-    return exp(f);
+  // Similarity between the user and 'other' (0 if they have no common
+  // ratings).
+  inline float similarity(uint32_t other) const {
+    return sim_[other];
   }
 
+ private:
+  std::vector<float> dot_;
+  std::vector<float> norm1_;
+  std::vector<float> norm2_;
+  std::vector<float> dist_;
+  std::vector<float> sim_;
+  std::vector<uint32_t> touched_;
 };
 
-static CosineSimilarity StaticCosineSimilarity;
-static CosineSqrtSimilarity StaticCosineSqrtSimilarity;
-static CosinePow2Similarity StaticCosinePow2Similarity;
-static CosineExpSimilarity StaticCosineExpSimilarity;
-static NormSimilarity StaticNormSimilarityP1(1);
-static NormSimilarity StaticNormSimilarityP2(2);
-static InfNormSimilarity StaticNormSimilarityPI;
-static NormExpSimilarity StaticNormExpSimilarityP1(1);
-static NormExpSimilarity StaticNormExpSimilarityP2(2);
-static InfNormExpSimilarity StaticNormExpSimilarityPI;
+// Calls visitor->visit<Kernel>() with the kernel of the given similarity
+// code. Returns false if the code is unknown.
+template <typename Visitor>
+bool visit_similarity_kernel(NeighboursModelConfig_Similarity similarity,
+                             Visitor* visitor) {
+  switch (similarity) {
+    case NeighboursModelConfig::COSINE:
+      visitor->template visit<CosineKernel<true> >();
+      break;
+    case NeighboursModelConfig::COSINE_SQRT:
+      visitor->template visit<
+        TransformedKernel<CosineKernel<true>, SqrtTransform> >();
+      break;
+    case NeighboursModelConfig::COSINE_POW2:
+      visitor->template visit<
+        TransformedKernel<CosineKernel<true>, Pow2Transform> >();
+      break;
+    case NeighboursModelConfig::COSINE_EXPO:
+      visitor->template visit<
+        TransformedKernel<CosineKernel<true>, ExpTransform> >();
+      break;
+    case NeighboursModelConfig::INV_NORM_P1:
+      visitor->template visit<NormKernel<1, true> >();
+      break;
+    case NeighboursModelConfig::INV_NORM_P2:
+      visitor->template visit<NormKernel<2, true> >();
+      break;
+    case NeighboursModelConfig::INV_NORM_PI:
+      visitor->template visit<InfNormKernel<true> >();
+      break;
+    case NeighboursModelConfig::I_N_P1_EXPO:
+      visitor->template visit<
+        TransformedKernel<NormKernel<1, true>, ExpTransform> >();
+      break;
+    case NeighboursModelConfig::I_N_P2_EXPO:
+      visitor->template visit<
+        TransformedKernel<NormKernel<2, true>, ExpTransform> >();
+      break;
+    case NeighboursModelConfig::I_N_PI_EXPO:
+      visitor->template visit<
+        TransformedKernel<InfNormKernel<true>, ExpTransform> >();
+      break;
+    default:
+      LOG(ERROR) << "Unknown similarity code " << similarity;
+      return false;
+  }
+  return true;
+}
 
 #endif  // SIMILARITIES_H
@@ -0,0 +1,167 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <similarity-matrix.h>
+
+#include <glog/logging.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+
+// Number of columns (users) of R^T processed at once, so that their
+// accumulators (three floats each) stay in the cache.
+static const uint32_t kColumnBlock = 4096;
+// Number of rows (users) that each thread takes at once.
+static const uint32_t kRowBlock = 64;
+
+SimilarityMatrix::SimilarityMatrix(const Dataset& data)
+    : users_(data.users()), criteria_(data.criteria_size()) {
+  row_offset_.reserve(data.users() + 1);
+  row_offset_.push_back(0);
+  row_item_.reserve(data.ratings_size());
+  row_scores_.reserve(data.ratings_size() * criteria_);
+  for (uint32_t u = 0; u < data.users(); ++u) {
+    for (const uint32_t r : data.ratings_by_user(u)) {
+      row_item_.push_back(data.item(r));
+      row_scores_.insert(row_scores_.end(), data.scores(r),
+                         data.scores(r) + criteria_);
+    }
+    row_offset_.push_back(row_item_.size());
+  }
+  col_offset_.reserve(data.items() + 1);
+  col_offset_.push_back(0);
+  col_user_.reserve(data.ratings_size());
+  col_scores_.reserve(data.ratings_size() * criteria_);
+  for (uint32_t i = 0; i < data.items(); ++i) {
+    for (const uint32_t r : data.ratings_by_item(i)) {
+      col_user_.push_back(data.user(r));
+      col_scores_.insert(col_scores_.end(), data.scores(r),
+                         data.scores(r) + criteria_);
+    }
+    col_offset_.push_back(col_user_.size());
+  }
+}
+
+void SimilarityMatrix::compute(bool normalize, float (*transform)(float),
+                               uint32_t top_k, uint32_t threads,
+                               std::vector<uint32_t>* offset,
+                               std::vector<uint32_t>* users,
+                               std::vector<float>* similarity) const {
+  CHECK_NOTNULL(offset);
+  CHECK_NOTNULL(users);
+  CHECK_NOTNULL(similarity);
+  typedef std::vector<std::pair<float, uint32_t> > Row;
+  std::vector<Row> rows(users_);
+  std::atomic<uint32_t> next_block(0);
+  // Each thread computes blocks of consecutive rows of R * R^T. Each row u
+  // is computed by blocks of columns: for each item of u, a cursor walks
+  // through the (sorted) users of the item, accumulating the products of
+  // the users in the current block of columns.
+  auto worker = [&]() {
+    std::vector<float> dot(kColumnBlock, 0.0f);
+    std::vector<float> norm_u(kColumnBlock, 0.0f);
+    std::vector<float> norm_v(kColumnBlock, 0.0f);
+    std::vector<uint32_t> touched;
+    std::vector<uint8_t> is_touched(kColumnBlock, 0);
+    std::vector<uint32_t> cursor;
+    for (uint32_t b = next_block++ * kRowBlock; b < users_;
+         b = next_block++ * kRowBlock) {
+      const uint32_t e = std::min(b + kRowBlock, users_);
+      for (uint32_t u = b; u < e; ++u) {
+        const uint32_t rb = row_offset_[u], re = row_offset_[u + 1];
+        cursor.resize(re - rb);
+        for (uint32_t k = rb; k < re; ++k) {
+          cursor[k - rb] = col_offset_[row_item_[k]];
+        }
+        Row& row = rows[u];
+        for (uint32_t v0 = 0; v0 < users_; v0 += kColumnBlock) {
+          const uint32_t v1 = std::min<uint64_t>(v0 + kColumnBlock, users_);
+          touched.clear();
+          // Accumulate in the same order as CosineKernel (by item), so the
+          // results are identical.
+          for (uint32_t k = rb; k < re; ++k) {
+            const float* a = &row_scores_[static_cast<size_t>(k) * criteria_];
+            const uint32_t ce = col_offset_[row_item_[k] + 1];
+            uint32_t& p = cursor[k - rb];
+            for (; p < ce && col_user_[p] < v1; ++p) {
+              const uint32_t j = col_user_[p] - v0;
+              const float* s = &col_scores_[static_cast<size_t>(p) * criteria_];
+              for (uint32_t c = 0; c < criteria_; ++c) {
+                dot[j] += a[c] * s[c];
+                if (normalize) {
+                  norm_u[j] += a[c] * a[c];
+                  norm_v[j] += s[c] * s[c];
+                }
+              }
+              if (!is_touched[j]) {
+                is_touched[j] = 1;
+                touched.push_back(j);
+              }
+            }
+          }
+          for (const uint32_t j : touched) {
+            const uint32_t v = v0 + j;
+            float f = normalize ?
+                dot[j] / (sqrt(norm_u[j]) * sqrt(norm_v[j])) : dot[j];
+            if (transform != NULL) {
+              f = transform(f);
+            }
+            CHECK_EQ(std::isnan(f), 0);
+            if (v != u && f > 0.0) {
+              row.push_back(std::make_pair(f, v));
+            }
+            dot[j] = norm_u[j] = norm_v[j] = 0.0f;
+            is_touched[j] = 0;
+          }
+        }
+        if (top_k == 0) {
+          std::sort(row.begin(), row.end(),
+                    [](const std::pair<float, uint32_t>& x,
+                       const std::pair<float, uint32_t>& y) {
+                      return x.second < y.second;
+                    });
+        } else if (row.size() > top_k) {
+          std::partial_sort(row.begin(), row.begin() + top_k, row.end(),
+                            std::greater<std::pair<float, uint32_t> >());
+          row.resize(top_k);
+          row.shrink_to_fit();
+        } else {
+          std::sort(row.begin(), row.end(),
+                    std::greater<std::pair<float, uint32_t> >());
+        }
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < std::max(threads, 1u); ++t) {
+    workers.push_back(std::thread(worker));
+  }
+  for (std::thread& w : workers) w.join();
+  // Store the rows in CSR format
+  offset->assign(1, 0);
+  users->clear();
+  similarity->clear();
+  for (const Row& row : rows) {
+    for (const std::pair<float, uint32_t>& s : row) {
+      similarity->push_back(s.first);
+      users->push_back(s.second);
+    }
+    offset->push_back(users->size());
+  }
+}
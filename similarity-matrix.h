@@ -0,0 +1,59 @@
+// Copyright 2012 Joan Puigcerver <joapuipe@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SIMILARITY_MATRIX_H_
+#define SIMILARITY_MATRIX_H_
+
+#include <dataset.h>
+
+#include <stdint.h>
+#include <vector>
+
+// Batch computation of the cosine similarities between all the pairs of
+// users of a dataset, as the sparse product R * R^T of the matrix R of
+// users x (items, criteria). Besides the dot products, the product also
+// accumulates the norms of the ratings of each user restricted to the
+// items rated by both, so the results are the same as CosineKernel.
+class SimilarityMatrix {
+ public:
+  // Builds the CSR matrices R and R^T (with their own copy of the scores).
+  explicit SimilarityMatrix(const Dataset& data);
+
+  // Computes the similarities (the cosine, or the dot product if not
+  // normalize, followed by 'transform' if not NULL) and keeps the positive
+  // ones. If top_k is 0 the result is the full sparse similarity matrix,
+  // with the similar users of each user in increasing order; otherwise
+  // only the top_k most similar users of each user are kept, by decreasing
+  // similarity. The result is stored in CSR format: the similar users of
+  // user u are users[offset[u] .. offset[u + 1]).
+  void compute(bool normalize, float (*transform)(float), uint32_t top_k,
+               uint32_t threads, std::vector<uint32_t>* offset,
+               std::vector<uint32_t>* users,
+               std::vector<float>* similarity) const;
+
+ private:
+  uint32_t users_;
+  uint32_t criteria_;
+  // R: items and scores of each user, sorted by item.
+  std::vector<uint32_t> row_offset_;
+  std::vector<uint32_t> row_item_;
+  std::vector<float> row_scores_;
+  // R^T: users and scores of each item, sorted by user.
+  std::vector<uint32_t> col_offset_;
+  std::vector<uint32_t> col_user_;
+  std::vector<float> col_scores_;
+};
+
+#endif  // SIMILARITY_MATRIX_H_
@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# Measures the time that the neighbours model takes to compute the
+# neighbours of all the users, intersecting their items either with sorted
+# lists or with bitmaps, for artificial datasets of growing density (the
+# probability that a user rated each item). Used to choose the default
+# density at which Dataset builds the bitmaps. The densities can be changed
+# with the DENSITIES environment variable (e.g. DENSITIES="0.001 0.01").
+
+if [ $# -gt 2 ]; then
+    echo "Usage: $0 [users] [items]"
+    exit 1
+fi
+
+USERS=${1:-1000}
+ITEMS=${2:-2000}
+DENSITIES=(${DENSITIES:-0.005 0.01 0.02 0.05 0.1 0.2 0.5})
+
+DATASET_BINARIZE=$(dirname $0)/../dataset-binarize
+MCFS_TRAIN=$(dirname $0)/../mcfs-train
+
+TMP=/tmp/bitmaps-$$
+TIMEFORMAT=%R
+echo "# density lists_seconds bitmaps_seconds"
+for d in ${DENSITIES[@]}; do
+    awk -v U=$USERS -v I=$ITEMS -v D=$d 'BEGIN {
+        srand(1);
+        for (u = 0; u < U; ++u)
+            for (i = 0; i < I; ++i)
+                if (rand() < D) printf("%d %d %d\n", u, i, 1 + int(rand() * 5));
+    }' | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 \
+        > $TMP-train 2> /dev/null
+    echo "0 0 3" | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 \
+        > $TMP-valid 2> /dev/null
+    line="$d"
+    for density in 2 0; do
+        secs=$( { time $MCFS_TRAIN -mtype neighbours -threads 1 \
+            -mconf "max_neighbours: 10 bitmap_density: $density" \
+            -train $TMP-train -valid $TMP-valid > /dev/null 2>&1; } 2>&1 )
+        line="$line $secs"
+    done
+    echo "$line"
+done
+rm -f $TMP-train $TMP-valid
@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Compares the exact neighbours model with the LSH candidate generation, for
+# several numbers of tables and bits per table. For each configuration it
+# reports the time to compute the k nearest neighbours of all the users,
+# the time to predict the validation set without precomputed neighbours,
+# the validation RMSE, and the recall@k of the LSH neighbours with respect
+# to the exact ones (the fraction of exact neighbours that are found).
+
+if [ $# -lt 2 -o $# -gt 4 ]; then
+    echo "Usage: $0 train_partition valid_partition [k] [similarity]"
+    exit 1
+fi
+
+TRAIN=$1
+VALID=$2
+K=${3:-25}
+SIMILARITY=${4:-COSINE}
+TABLES=(2 4 8 16)
+BITS=(4 8)
+
+MCFS_TRAIN=$(dirname $0)/../mcfs-train
+PROTOS=$(dirname $0)/../protos
+
+TMP=/tmp/neighbours-lsh-$$
+TIMEFORMAT=%R
+
+# Prints the pairs "user neighbour" stored in a model file.
+neighbours() {
+    protoc --proto_path=$PROTOS --decode=mcfs.protos.NeighboursModelConfig \
+        $PROTOS/neighbours-model.proto < $1 2> /dev/null | awk '
+        /^neighbours {/ { inside = 1; next; }
+        /^}/ { if (inside) ++u; inside = 0; next; }
+        inside && /^  user:/ { print u, $2; }'
+}
+
+# Runs one configuration, given the LSH options.
+run() {
+    local conf="k: $K similarity: $SIMILARITY $1"
+    local secs=$( { time $MCFS_TRAIN -mtype neighbours \
+        -mconf "$conf max_neighbours: $K" -train $TRAIN -valid $VALID \
+        -mfile $TMP-model > /dev/null 2>&1; } 2>&1 )
+    local out=$($MCFS_TRAIN -mtype neighbours -mconf "$conf" -train $TRAIN \
+        -valid $VALID --logtostderr 2>&1)
+    local test_secs=$(echo "$out" | grep 'Elapsed seconds' | awk '{print $NF}')
+    local rmse=$(echo "$out" | grep 'Valid RMSE:' | awk '{print $NF}')
+    neighbours $TMP-model > $TMP-neighbours
+    if [ -z "$1" ]; then
+        cp $TMP-neighbours $TMP-exact
+    fi
+    local recall=$(awk 'NR == FNR { e[$1" "$2] = 1; ++n; next; }
+        ($1" "$2) in e { ++m; }
+        END { printf("%.4f\n", n > 0 ? m / n : 1); }' \
+        $TMP-exact $TMP-neighbours)
+    echo "$secs $test_secs $rmse $recall"
+}
+
+echo "# tables bits neighbours_seconds test_seconds valid_rmse recall@$K"
+echo "exact - $(run "")"
+for t in ${TABLES[@]}; do
+    for b in ${BITS[@]}; do
+        echo "$t $b $(run "lsh_tables: $t lsh_bits: $b")"
+    done
+done
+rm -f $TMP-model $TMP-neighbours $TMP-exact
@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# Measures the time that the neighbours model takes to predict the ratings
+# of popular items, for a growing number of users that rated them.
+# Each artificial dataset has R users that rated the P popular items (and
+# some of the other items) plus T users that did not rate them. The test
+# set asks for the ratings of the popular items by those T users, so most
+# of the similarities are already memoized and the time is dominated by
+# the selection of the k nearest neighbours among the R raters.
+
+if [ $# -gt 1 ]; then
+    echo "Usage: $0 [k]"
+    exit 1
+fi
+
+K=${1:-25}
+T=40
+P=20
+ITEMS=100
+ITEMS_PER_USER=20
+RATERS=(1000 4000 16000 64000)
+
+DATASET_BINARIZE=$(dirname $0)/../dataset-binarize
+MCFS_TRAIN=$(dirname $0)/../mcfs-train
+MCFS_TEST=$(dirname $0)/../mcfs-test
+
+TMP=/tmp/neighbours-popularity-$$
+echo "# raters test_seconds"
+for r in ${RATERS[@]}; do
+    # Training ratings: users 0..r-1 rated the popular items 0..P-1, all
+    # the users rated some of the other items.
+    awk -v R=$r -v T=$T -v P=$P -v I=$ITEMS -v N=$ITEMS_PER_USER 'BEGIN {
+        srand(R);
+        for (u = 0; u < R + T; ++u) {
+            for (i = 0; u < R && i < P; ++i) {
+                printf("%d %d %d\n", u, i, 1 + int(rand() * 5));
+            }
+            delete seen;
+            for (n = 0; n < N; ++n) {
+                i = P + int(rand() * I);
+                if (i in seen) continue;
+                seen[i] = 1;
+                printf("%d %d %d\n", u, i, 1 + int(rand() * 5));
+            }
+        }
+    }' | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 \
+        > $TMP-train 2> /dev/null
+    # Test ratings: the popular items by users r..r+T-1
+    awk -v R=$r -v T=$T -v P=$P 'BEGIN {
+        for (u = R; u < R + T; ++u)
+            for (i = 0; i < P; ++i) printf("%d %d 3\n", u, i);
+    }' | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 \
+        > $TMP-test 2> /dev/null
+    $MCFS_TRAIN -mconf "k: $K" -mtype neighbours -train $TMP-train \
+        -valid $TMP-test -mfile $TMP-model > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        echo "Failed raters=$r..."
+        rm -f $TMP-train $TMP-test $TMP-model
+        exit 1
+    fi
+    secs=$($MCFS_TEST -mtype neighbours -mfile $TMP-model -test $TMP-test \
+        -threads 1 --logtostderr 2>&1 | grep 'Elapsed seconds' | \
+        awk '{print $NF}')
+    echo "$r $secs"
+    rm -f $TMP-train $TMP-test $TMP-model
+done
@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Measures the throughput (predicted pairs per second) of the PMF model on a
+# large artificial test set: a PMF model is trained for a few iterations on
+# random ratings of the given users and items, and then used to predict the
+# given number of random (user, item) pairs. The number of threads can be
+# changed with the THREADS environment variable (0 = number of CPUs).
+
+if [ $# -gt 3 ]; then
+    echo "Usage: $0 [users] [items] [pairs]"
+    exit 1
+fi
+
+USERS=${1:-10000}
+ITEMS=${2:-5000}
+PAIRS=${3:-10000000}
+THREADS=${THREADS:-0}
+
+DATASET_BINARIZE=$(dirname $0)/../dataset-binarize
+MCFS_TRAIN=$(dirname $0)/../mcfs-train
+MCFS_TEST=$(dirname $0)/../mcfs-test
+
+TMP=/tmp/pmf-test-$$
+random_pairs() {
+    awk -v U=$USERS -v I=$ITEMS -v P=$1 -v S=$2 'BEGIN {
+        srand(S);
+        for (p = 0; p < P; ++p)
+            printf("%d %d %d\n", int(rand() * U), int(rand() * I),
+                   1 + int(rand() * 5));
+        # Make sure that all the users and items appear
+        printf("%d %d 3\n", U - 1, I - 1);
+    }' | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 2> /dev/null
+}
+random_pairs $((USERS * 5)) 1 > $TMP-train
+random_pairs 1000 2 > $TMP-valid
+random_pairs $PAIRS 3 > $TMP-test
+$MCFS_TRAIN -mtype pmf -mconf "max_iters: 5 matrix_init: NORMAL" \
+    -mfile $TMP-model -train $TMP-train -valid $TMP-valid > /dev/null 2>&1
+secs=$($MCFS_TEST -mtype pmf -mfile $TMP-model -test $TMP-test \
+    -threads $THREADS 2>&1 | grep "Elapsed seconds" | tail -1 | \
+    awk '{print $NF}')
+echo "# pairs seconds pairs_per_second"
+echo "$((PAIRS + 1)) $secs $(awk -v P=$((PAIRS + 1)) -v S=$secs \
+    'BEGIN { printf("%.0f", P / S); }')"
+rm -f $TMP-train $TMP-valid $TMP-test $TMP-model
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Measures the time that the PMF model takes to train a few iterations on an
+# artificial dataset with a skewed number of ratings per user (the user u
+# rates about RATINGS / (u + 1) / H items, where H is the harmonic number of
+# the users), and prints the loss of the last iteration, so that different
+# builds can be compared. The batch size and the number of iterations can be
+# changed with the BATCH_SIZE and ITERS environment variables, and other
+# options of the model can be given with MCONF (e.g. MCONF="momentum: 0.9").
+
+if [ $# -gt 3 ]; then
+    echo "Usage: $0 [users] [items] [ratings]"
+    exit 1
+fi
+
+USERS=${1:-10000}
+ITEMS=${2:-5000}
+RATINGS=${3:-1000000}
+BATCH_SIZE=${BATCH_SIZE:-10000}
+ITERS=${ITERS:-10}
+MCONF=${MCONF:-}
+
+DATASET_BINARIZE=$(dirname $0)/../dataset-binarize
+MCFS_TRAIN=$(dirname $0)/../mcfs-train
+
+TMP=/tmp/pmf-train-$$
+awk -v U=$USERS -v I=$ITEMS -v R=$RATINGS 'BEGIN {
+    srand(1);
+    for (u = 0; u < U; ++u) h += 1.0 / (u + 1);
+    for (u = 0; u < U; ++u) {
+        n = int(R / (u + 1) / h);
+        if (n < 1) n = 1;
+        if (n > I) n = I;
+        for (k = 0; k < n; ++k)
+            printf("%d %d %d\n", u, int(rand() * I), 1 + int(rand() * 5));
+    }
+    # Make sure that all the items appear
+    printf("%d %d 3\n", U - 1, I - 1);
+}' | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 > $TMP-train 2> /dev/null
+echo "0 0 3" | $DATASET_BINARIZE -precision INT -minv 1 -maxv 5 \
+    > $TMP-valid 2> /dev/null
+OPTIONS="max_iters: $ITERS batch_size: $BATCH_SIZE matrix_init: NORMAL $MCONF"
+TIMEFORMAT=%R
+echo "# seconds last_loss"
+secs=$( { time $MCFS_TRAIN -mtype pmf -threads 1 -mconf "$OPTIONS" \
+    -train $TMP-train -valid $TMP-valid > $TMP-log 2>&1; } 2>&1 )
+loss=$(grep "Iter = $ITERS " $TMP-log | sed 's/.*Loss = \([^ ]*\).*/\1/')
+echo "$secs $loss"
+rm -f $TMP-train $TMP-valid $TMP-log